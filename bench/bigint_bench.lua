@@ -0,0 +1,64 @@
+-- times etf.integer multiplication, division and decimal string conversion
+-- across operand sizes
+--
+-- usage: lua bench/bigint_bench.lua [seconds per measurement]
+--
+-- Multiplication switches from schoolbook to Karatsuba once both operands
+-- are BIGINT_KARATSUBA_THRESHOLD words long (32 by default), and decimal
+-- conversion splits around powers of 10 past BIGINT_DEC_THRESHOLD digits
+-- (200 by default). The thresholds are compile-time constants, so comparing
+-- schoolbook and Karatsuba multiplication takes two builds, see the README.
+
+local etf = require'etf'
+
+local budget = tonumber(arg and arg[1]) or 0.2
+
+local function random_integer(bytes)
+  local t = { '0x' }
+  for i=1,bytes do
+    t[#t+1] = string.format('%02x',math.random(i == 1 and 128 or 0,255))
+  end
+  return etf.integer(table.concat(t))
+end
+
+-- best of 5 runs, in microseconds per call
+local function measure(f)
+  local iterations = 1
+  local best
+  while true do
+    collectgarbage('collect')
+    local start = os.clock()
+    for _=1,iterations do f() end
+    local elapsed = os.clock() - start
+    if elapsed >= budget / 5 then break end
+    iterations = iterations * 2
+  end
+  for _=1,5 do
+    collectgarbage('collect')
+    local start = os.clock()
+    for _=1,iterations do f() end
+    local elapsed = (os.clock() - start) / iterations * 1e6
+    if not best or elapsed < best then best = elapsed end
+  end
+  return best
+end
+
+math.randomseed(1)
+
+print(string.format('%8s %14s %14s %14s %14s %14s','bytes',
+  'mul (us)','div (us)','mod (us)','tostring (us)','parse (us)'))
+
+-- products and numerators are twice the operand size, which has to
+-- stay within the default 4096-byte integer limit
+for _, bytes in ipairs({ 16, 32, 64, 128, 192, 256, 384, 512, 1024, 2000 }) do
+  local a = random_integer(bytes)
+  local b = random_integer(bytes)
+  local n = a * b + a
+  local s = tostring(n)
+  print(string.format('%8d %14.2f %14.2f %14.2f %14.2f %14.2f', bytes,
+    measure(function() return a * b end),
+    measure(function() return n / b end),
+    measure(function() return n % b end),
+    measure(function() return tostring(n) end),
+    measure(function() return etf.integer(s) end)))
+end
@@ -32,6 +32,70 @@
 
 #define ETF_NO_COMPRESSION -2
 
+/* encoders keep their output buffer between calls, anything
+ * over this many bytes is released after each encode */
+#define ETF_DEFAULT_ARENA_MAX (1024 * 1024)
+
+/* default chunk size for encode_stream */
+#define ETF_DEFAULT_CHUNK_LEN (64 * 1024)
+
+/* binaries at least this long are referenced instead of copied
+ * when writing segmented output */
+#define ETF_DEFAULT_REF_THRESHOLD (16 * 1024)
+
+/* initial slots in the encoder's metatable dispatch table, must be a
+ * power of two and comfortably larger than the number of etf.* metatables */
+#define ETF_META_SLOTS 32
+
+/* default and largest number of slots in the encoder's map key cache */
+#define ETF_DEFAULT_KEY_CACHE 128
+#define ETF_MAX_KEY_CACHE 65536
+
+/* largest encoded key kept in the map key cache */
+#define ETF_KEY_CACHE_BYTES 64
+
+/* entries in a distribution atom cache, 8 segments of 256 */
+#define ETF_ATOM_CACHE_SIZE 2048
+
+/* most atom cache references a single distribution header can hold */
+#define ETF_ATOM_CACHE_REFS 255
+
+/* most fragmented messages an atom cache reassembles at once */
+#define ETF_DIST_MAX_PENDING 64
+
+/* how plain tables are classified as lists or maps */
+enum {
+    ETF_ARRAY_STRICT = 0, /* keys are exactly 1..n */
+    ETF_ARRAY_RAWLEN, /* the table has a border, #t > 0 */
+    ETF_ARRAY_METATABLE /* never, only etf.list tables are lists */
+};
+
+/* value types a shape field can be pinned to */
+enum {
+    ETF_SHAPE_ANY = 0,
+    ETF_SHAPE_ATOM,
+    ETF_SHAPE_BINARY,
+    ETF_SHAPE_STRING,
+    ETF_SHAPE_INTEGER,
+    ETF_SHAPE_FLOAT
+};
+
+/* uservalue array slots holding the metatables the decoder assigns */
+enum {
+    ETF_DECODER_MT_PID = 1,
+    ETF_DECODER_MT_PORT,
+    ETF_DECODER_MT_REFERENCE,
+    ETF_DECODER_MT_EXPORT,
+    ETF_DECODER_MT_NEW_FUN,
+    ETF_DECODER_MT_FUN,
+    ETF_DECODER_MT_TUPLE,
+    ETF_DECODER_MT_LIST,
+    ETF_DECODER_MT_MAP
+};
+
+#define _131_DIST_HEADER 68
+#define _131_DIST_FRAG_HEADER 69
+#define _131_DIST_FRAG_CONT 70
 #define _131_NEW_FLOAT_EXT 70
 #define _131_BIT_BINARY_EXT 77
 #define _131_ETFZLIB 80
@@ -77,14 +141,32 @@ extern "C" {
 #include <stdint.h>
 #include <assert.h>
 
-#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
+#include <stdio.h>
 #include <math.h>
+#include <limits.h>
+
+#if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#define ETF_HAVE_WRITEV 1
+#include <sys/uio.h>
+#include <unistd.h>
 #endif
 
 #ifdef __cplusplus
 }
 #endif
 
+#ifndef LUA_FILEHANDLE
+#define LUA_FILEHANDLE "FILE*"
+#endif
+
+#if defined(ETF_HAVE_WRITEV)
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define ETF_IOV_MAX IOV_MAX
+#else
+#define ETF_IOV_MAX 1024
+#endif
+#endif
+
 #define BIGINT_API ETF_PRIVATE
 #define BIGINT_IMPLEMENTATION
 
@@ -238,11 +320,32 @@ static const char * const etf_map_mt          = "etf.map";
 static const char * const etf_atom_mt         = "etf.atom";
 static const char * const etf_string_mt       = "etf.string";
 static const char * const etf_binary_mt       = "etf.binary";
+static const char * const etf_buffer_mt       = "etf.buffer";
+static const char * const etf_raw_mt          = "etf.raw";
+static const char * const etf_atom_cache_mt   = "etf.atom_cache";
+
+/* registry fields holding the weak-valued pools of interned atoms */
+static const char * const etf_atom_pool       = "etf.atom_pool";
+static const char * const etf_atom_latin1_pool = "etf.atom_latin1_pool";
 
 static const char * const etf_131_decoder_mt  = "etf.decoder.131";
 static const char * const etf_131_encoder_mt  = "etf.encoder.131";
 
 
+/* open-addressed hash set of atom names compiled from a rules table.
+ * names point into Lua strings kept alive by the owner's uservalue */
+typedef struct etf_atom_rule_s {
+    const char *name;
+    size_t len;
+    uint32_t hash;
+    int value; /* index into the uservalue's rule_values, 0 for an empty slot */
+} etf_atom_rule;
+
+typedef struct etf_atom_rules_s {
+    size_t mask;
+    etf_atom_rule rule[1];
+} etf_atom_rules;
+
 typedef struct etf_131_decoder_state_s {
     lua_State *L;
     const uint8_t *data;
@@ -255,25 +358,416 @@ typedef struct etf_131_decoder_state_s {
     uint8_t key; /* set to 1 if we're decoding a map key */
     uint8_t force_bigint; /* set to 1 if we're forcing all ints to bigints */
     uint8_t force_float; /* set to 1 if we're forcing all floats to etf.floats */
+    uint8_t packet; /* size of the {packet,N} length header, 0 for none */
+    uint8_t default_map; /* set to 1 if no custom atom_map was given */
+    const etf_atom_rules *rules; /* atoms to decode as constants, or NULL */
+    int consts; /* stack index of the rule_values table while decoding */
+    int uv; /* stack index of the decoder's uservalue while decoding */
+    int atoms; /* stack index of the message's atom cache references, 0 if none */
     mz_stream strm;
     size_t offset;
     uint8_t z[ETF_BUFFER_LEN];
     int (*read)(struct etf_131_decoder_state_s *, uint8_t *data, size_t len);
 } etf_131_decoder_state;
 
+/* an etf.integer. The bigint is first, so the userdata can be used as a
+ * bigint, and values up to 128 bits use the inline words */
+#define ETF_INTEGER_INLINE (16 / BIGINT_WORD_SIZE)
+
+typedef struct etf_integer_s {
+    bigint b;
+    bigint_word small[ETF_INTEGER_INLINE];
+} etf_integer;
+
+/* an interned atom. data holds the encoded atom (tag, length and name),
+ * the name is the last len bytes */
+typedef struct etf_atom_data_s {
+    size_t len;
+    size_t enclen;
+    uint8_t utf8;
+    uint8_t data[1];
+} etf_atom_data;
+
+#define etf_atom_name(a) (&(a)->data[(a)->enclen - (a)->len])
+
+/* a pre-encoded term, without the version byte */
+typedef struct etf_raw_s {
+    size_t len;
+    uint8_t data[1];
+} etf_raw;
+
+/* growable, contiguous byte buffer used for encoder output */
+typedef struct etf_buffer_s {
+    uint8_t *data;
+    size_t len;
+    size_t alloc;
+    uint8_t locked; /* set to 1 while decode_packets is reading from data */
+} etf_buffer;
+
+/* an atom cache entry, name points into a Lua string anchored in
+ * the cache's uservalue at index + 1 */
+typedef struct etf_atom_cache_entry_s {
+    const char *name; /* NULL for an unused entry */
+    size_t len;
+} etf_atom_cache_entry;
+
+/* an atom referenced by the message being encoded */
+typedef struct etf_atom_cache_ref_s {
+    uint16_t index; /* cache index, segment * 256 + internal index */
+    uint8_t isnew; /* set to 1 if the text has to be sent */
+    size_t offset; /* the atom's text, in names */
+    size_t len;
+} etf_atom_cache_ref;
+
+/* one direction of a distribution connection's atom cache. The refs
+ * are scratch space for the message being encoded, entries are only
+ * updated once the whole message has been encoded */
+typedef struct etf_atom_cache_s {
+    etf_atom_cache_entry entry[ETF_ATOM_CACHE_SIZE];
+    uint32_t gen; /* current message */
+    uint32_t seen[ETF_ATOM_CACHE_SIZE]; /* message that last referenced the entry */
+    uint8_t ref[ETF_ATOM_CACHE_SIZE]; /* the entry's index into refs, if seen in this message */
+    size_t nrefs;
+    etf_atom_cache_ref refs[ETF_ATOM_CACHE_REFS];
+    etf_buffer names;
+    etf_buffer header; /* the distribution header being built */
+    uint64_t sequence; /* last fragmented message's sequence id */
+    size_t pending; /* fragmented messages being reassembled */
+} etf_atom_cache;
+
+/* a piece of segmented encoder output, either a range of E->out
+ * or a reference to a Lua string anchored in the pin table */
+typedef struct etf_segment_s {
+    const uint8_t *ref; /* NULL for a range of E->out */
+    size_t offset; /* offset into E->out, or index into the pin table */
+    size_t len;
+} etf_segment;
+
+struct etf_131_encoder_state_s;
+
+/* a field of a registered shape, name and key point into the shape's
+ * own allocation */
+typedef struct etf_shape_field_s {
+    const char *name;
+    size_t namelen;
+    const uint8_t *key; /* the pre-encoded key term */
+    size_t keylen;
+    uint8_t type; /* one of ETF_SHAPE_* */
+} etf_shape_field;
+
+/* compiled encode plan for tables with a given metatable, shapes are
+ * kept in a list and freed when replaced or along with the encoder */
+typedef struct etf_shape_s {
+    struct etf_shape_s *next;
+    int names; /* registry reference to the array of field names */
+    unsigned int busy; /* encodes using the plan, it's kept while non-zero */
+    size_t nfields;
+    etf_shape_field field[1];
+} etf_shape;
+
+/* a map key string and its encoded form. str points into a Lua string
+ * anchored in the uservalue's key_cache table, at the same index as the slot */
+typedef struct etf_key_slot_s {
+    const char *str; /* NULL for an empty slot */
+    size_t len;
+    uint8_t enclen;
+    uint8_t bytes[ETF_KEY_CACHE_BYTES];
+} etf_key_slot;
+
+/* maps a metatable (by identity) to the function that encodes it,
+ * or to a shape */
+typedef struct etf_meta_slot_s {
+    const void *mt; /* NULL for an empty slot */
+    int (*encode)(struct etf_131_encoder_state_s *);
+    etf_shape *shape;
+} etf_meta_slot;
+
 typedef struct etf_131_encoder_state_s {
     lua_State *L;
-    int strtable;
-    size_t strcount;
+    etf_buffer *out; /* where encoded bytes are appended */
+    etf_buffer arena; /* encoder-owned buffer used by encode() */
+    size_t arena_max; /* high-water mark for the retained output buffer */
+    size_t count; /* bytes counted when sizing a value */
+    int sink; /* stack index of the encode_stream sink function, 0 if not streaming */
+    uint8_t sink_self; /* set to 1 if the sink is a method, with self at sink + 1 */
+    size_t chunk; /* flush to the sink once this many bytes are buffered */
+    size_t flushed; /* total bytes passed to the sink */
+    etf_segment *segs; /* segmented output, used by encode_to_fd */
+    size_t nsegs;
+    size_t segalloc;
+    size_t segstart; /* start of the not-yet-recorded range of E->out */
+    int pins; /* stack index of the table anchoring referenced strings */
+    size_t npins;
+    size_t ref_threshold;
+    size_t reflen; /* total bytes referenced rather than copied */
+    uint8_t refs; /* set to 1 if large binaries should be referenced instead of copied */
     uint8_t key; /* set to 1 if we're encoding a map key */
+    uint8_t packet; /* size of the {packet,N} length header, 0 for none */
+    uint8_t default_map; /* set to 1 if no custom value_map was given */
+    uint8_t keys_as_atoms; /* set to 1 to encode string map keys as atoms */
+    uint8_t arrays; /* one of ETF_ARRAY_* */
+    uint8_t memo; /* set to 1 once a table has been memoized */
+    etf_atom_cache *cache; /* set while encoding a distribution message */
+    const etf_atom_rules *rules; /* strings to encode as atoms, or NULL */
+    int compress; /* compression level, or ETF_NO_COMPRESSION */
+    int zlevel; /* level strm was initialized with, or ETF_NO_COMPRESSION */
     mz_stream strm;
-    uint8_t z[ETF_BUFFER_LEN];
+    etf_meta_slot *metas; /* filled from mt_map when created, then register_shape */
+    size_t metamask;
+    size_t nmetas;
+    etf_shape *shapes;
+    etf_key_slot *keys; /* direct-mapped cache of encoded map keys, or NULL */
+    size_t keymask;
     int (*write)(struct etf_131_encoder_state_s *, const uint8_t *data, size_t len);
 } etf_131_encoder_state;
 
 static int etf_131_decode(etf_131_decoder_state *D);
 static int etf_131_encode(etf_131_encoder_state *E);
 
+/* FNV-1a */
+static uint32_t etf_hash(const uint8_t *data, size_t len) {
+    uint32_t h = 2166136261U;
+    while(len--) {
+        h ^= *data++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static int etf_atom_rules_find(const etf_atom_rules *R, const uint8_t *name, size_t len) {
+    uint32_t h = etf_hash(name,len);
+    size_t i = h & R->mask;
+
+    while(R->rule[i].value) {
+        if(R->rule[i].hash == h && R->rule[i].len == len &&
+           memcmp(R->rule[i].name,name,len) == 0) {
+            return R->rule[i].value;
+        }
+        i = (i + 1) & R->mask;
+    }
+    return 0;
+}
+
+/* metatables the decoder assigns, in ETF_DECODER_MT_* order */
+static const char * const etf_131_decoder_metas[] = {
+    etf_pid_mt,
+    etf_port_mt,
+    etf_reference_mt,
+    etf_export_mt,
+    etf_new_fun_mt,
+    etf_fun_mt,
+    etf_tuple_mt,
+    etf_list_mt,
+    etf_map_mt,
+    NULL,
+};
+
+/* sets the metatable of the value on top of the stack from the
+ * decoder's uservalue, avoiding a registry lookup by name */
+static void etf_131_decoder_setmetatable(etf_131_decoder_state *D, int slot) {
+    lua_rawgeti(D->L,D->uv,slot);
+    lua_setmetatable(D->L,-2);
+}
+
+static size_t etf_meta_hash(const void *mt, size_t mask) {
+    return ((size_t)mt >> 4) & mask;
+}
+
+static const etf_meta_slot *etf_131_encoder_meta_find(const etf_131_encoder_state *E, const void *mt) {
+    size_t i = etf_meta_hash(mt,E->metamask);
+
+    while(E->metas[i].mt != NULL) {
+        if(E->metas[i].mt == mt) return &E->metas[i];
+        i = (i + 1) & E->metamask;
+    }
+    return NULL;
+}
+
+/* adds (or replaces) a dispatch entry, growing the table to keep it
+ * at most half full. returns 0 on success, 1 if out of memory */
+static int etf_131_encoder_meta_add(etf_131_encoder_state *E, const void *mt,
+  int (*encode)(etf_131_encoder_state *), etf_shape *shape) {
+    etf_meta_slot *metas = NULL;
+    size_t mask = 0;
+    size_t i;
+    size_t j;
+
+    if((E->nmetas + 1) * 2 > E->metamask + 1) {
+        mask = (E->metamask + 1) * 2 - 1;
+        metas = (etf_meta_slot *)calloc(mask + 1,sizeof(etf_meta_slot));
+        if(metas == NULL) return 1;
+        for(i = 0; i <= E->metamask; i++) {
+            if(E->metas[i].mt == NULL) continue;
+            j = etf_meta_hash(E->metas[i].mt,mask);
+            while(metas[j].mt != NULL) j = (j + 1) & mask;
+            metas[j] = E->metas[i];
+        }
+        free(E->metas);
+        E->metas = metas;
+        E->metamask = mask;
+    }
+
+    i = etf_meta_hash(mt,E->metamask);
+    while(E->metas[i].mt != NULL && E->metas[i].mt != mt) {
+        i = (i + 1) & E->metamask;
+    }
+    if(E->metas[i].mt == NULL) E->nmetas++;
+    E->metas[i].mt = mt;
+    E->metas[i].encode = encode;
+    E->metas[i].shape = shape;
+    return 0;
+}
+
+/* compiles the rules table at idx into a hash set, which is anchored in
+ * the uservalue table at uv, along with the names (rule_names) and
+ * constants (rule_values). If values is 0, the table is an array of
+ * names, otherwise it maps names to constants. */
+static etf_atom_rules *etf_atom_rules_compile(lua_State *L, int idx, int uv, int values) {
+    etf_atom_rules *R = NULL;
+    etf_atom_rule *rule = NULL;
+    const char *name = NULL;
+    size_t len = 0;
+    size_t count = 0;
+    size_t size = 8;
+    int n = 0;
+    uint32_t h;
+    size_t i;
+
+    lua_pushnil(L);
+    while(lua_next(L,idx)) {
+        count++;
+        lua_pop(L,1);
+    }
+    while(size < count * 2) size *= 2;
+
+    R = (etf_atom_rules *)lua_newuserdata(L,sizeof(etf_atom_rules) + sizeof(etf_atom_rule) * (size - 1));
+    if(R == NULL) {
+        luaL_error(L,"out of memory");
+        return NULL;
+    }
+    memset(R,0,sizeof(etf_atom_rules) + sizeof(etf_atom_rule) * (size - 1));
+    R->mask = size - 1;
+    lua_setfield(L,uv,"rule_set");
+
+    lua_newtable(L); /* rule_names */
+    lua_newtable(L); /* rule_values */
+
+    lua_pushnil(L);
+    while(lua_next(L,idx)) {
+        /* stack is: rule_names, rule_values, key, value */
+        if(values) lua_pushvalue(L,-2);
+        else lua_pushvalue(L,-1);
+        if(lua_type(L,-1) != LUA_TSTRING) {
+            luaL_error(L,"atom rules must be strings");
+            return NULL;
+        }
+        name = lua_tolstring(L,-1,&len);
+        lua_rawseti(L,-5,++n);
+        if(values) lua_pushvalue(L,-1);
+        else lua_pushboolean(L,1);
+        lua_rawseti(L,-4,n);
+        lua_pop(L,1);
+
+        h = etf_hash((const uint8_t *)name,len);
+        i = h & R->mask;
+        while(R->rule[i].value) i = (i + 1) & R->mask;
+        rule = &R->rule[i];
+        rule->name = name;
+        rule->len = len;
+        rule->hash = h;
+        rule->value = n;
+    }
+
+    lua_setfield(L,uv,"rule_values");
+    lua_setfield(L,uv,"rule_names");
+
+    return R;
+}
+static int etf_131_decoder_read(etf_131_decoder_state *D, uint8_t *data, size_t len);
+
+/* converts n to a size_t, returns 0 if it's not a non-negative
+ * integer that fits (including NaN and infinities) */
+static int etf_tosize(lua_Number n, size_t *len) {
+    if(!(n >= 0 && n < (lua_Number)SIZE_MAX && n == floor(n))) return 0;
+    *len = (size_t)n;
+    return 1;
+}
+
+/* makes sure there's room for len more bytes, returns 0 on success */
+static int etf_buffer_reserve(etf_buffer *b, size_t len) {
+    uint8_t *data;
+    size_t alloc;
+
+    if(b->alloc - b->len >= len) return 0;
+    if(len > SIZE_MAX - b->len) return 1;
+
+    alloc = b->alloc ? b->alloc : ETF_BUFFER_LEN;
+    while(alloc - b->len < len) {
+        if(alloc > SIZE_MAX / 2) {
+            alloc = b->len + len;
+            break;
+        }
+        alloc *= 2;
+    }
+
+    data = (uint8_t *)realloc(b->data,alloc);
+    if(data == NULL) return 1;
+
+    b->data = data;
+    b->alloc = alloc;
+    return 0;
+}
+
+static int etf_buffer_append(etf_buffer *b, const uint8_t *data, size_t len) {
+    if(etf_buffer_reserve(b,len)) return 1;
+    memcpy(&b->data[b->len],data,len);
+    b->len += len;
+    return 0;
+}
+
+/* drops the first len bytes */
+static void etf_buffer_consume(etf_buffer *b, size_t len) {
+    if(len >= b->len) {
+        b->len = 0;
+        return;
+    }
+    memmove(b->data,&b->data[len],b->len - len);
+    b->len -= len;
+}
+
+/* releases memory beyond max bytes, contents are discarded */
+static void etf_buffer_shrink(etf_buffer *b, size_t max) {
+    uint8_t *data;
+
+    b->len = 0;
+    if(b->alloc <= max) return;
+    if(max == 0) {
+        free(b->data);
+        b->data = NULL;
+        b->alloc = 0;
+        return;
+    }
+    data = (uint8_t *)realloc(b->data,max);
+    if(data == NULL) return;
+    b->data = data;
+    b->alloc = max;
+}
+
+static void etf_buffer_free(etf_buffer *b) {
+    if(b->data != NULL) free(b->data);
+    b->data = NULL;
+    b->len = 0;
+    b->alloc = 0;
+}
+
+/* checks for an etf.buffer that can be modified */
+static etf_buffer *
+etf_checkbuffer(lua_State *L, int idx) {
+    etf_buffer *buf = (etf_buffer *)luaL_checkudata(L,idx,etf_buffer_mt);
+    if(buf->locked) luaL_error(L,"buffer is in use by decode_packets");
+    return buf;
+}
+
 static inline
 uint64_t unpack_uint64le(const uint8_t *b) {
     return (((uint64_t)b[7])<<56) |
@@ -546,6 +1040,28 @@ etf_isbigint(lua_State *L, int idx) {
     return (bigint *)luaL_testudata(L,idx,etf_integer_mt);
 }
 
+static inline void
+etf_integer_init(etf_integer *i) {
+    bigint_init_storage(&i->b,i->small,ETF_INTEGER_INLINE);
+}
+
+/* reads a metamethod operand as an int64_t, if it's a Lua integer or an
+ * etf.integer that fits. returns 0 if the bigint path is needed */
+static inline int
+etf_bigint_small(lua_State *L, int idx, int64_t *v) {
+    bigint *b = NULL;
+
+    if(lua_type(L,idx) == LUA_TNUMBER) {
+        if(!lua_isinteger(L,idx)) return 0;
+        *v = (int64_t)lua_tointeger(L,idx);
+        return 1;
+    }
+    if( (b = etf_isbigint(L,idx)) != NULL) {
+        return bigint_to_i64(v,b) == 0;
+    }
+    return 0;
+}
+
 static int
 etf_tobigint(lua_State *L, int idx, bigint* dest) {
     const char *str = NULL;
@@ -568,17 +1084,17 @@ etf_tobigint(lua_State *L, int idx, bigint* dest) {
 
 static bigint*
 etf_pushbigint(lua_State *L) {
-    bigint *r = NULL;
+    etf_integer *r = NULL;
 
-    r = (bigint *)lua_newuserdata(L,sizeof(bigint));
+    r = (etf_integer *)lua_newuserdata(L,sizeof(etf_integer));
     if(r == NULL) {
         luaL_error(L,"out of memory");
         return NULL;
     }
     luaL_setmetatable(L,etf_integer_mt);
-    bigint_init(r);
+    etf_integer_init(r);
 
-    return r;
+    return &r->b;
 }
 
 static inline void
@@ -640,63 +1156,108 @@ etf_tou64(lua_State *L, int index) {
     return (uint64_t)lua_tointeger(L,index);
 }
 
+/* an etf.float is a full userdata holding just the double */
+static inline double *
+etf_pushfloat(lua_State *L, double f) {
+    double *d = (double *)lua_newuserdata(L,sizeof(double));
+    if(d == NULL) {
+        luaL_error(L,"out of memory");
+        return NULL;
+    }
+    *d = f;
+    luaL_setmetatable(L,etf_float_mt);
+    return d;
+}
+
 static int
 etf_float(lua_State *L) {
     int type = lua_type(L,1);
-
-    lua_newtable(L);
+    double f = 0.0;
 
     if(type == LUA_TNONE || type == LUA_TNIL) {
-        lua_pushnumber(L,0.0);
+        f = 0.0;
     } else if(type == LUA_TNUMBER) {
-        lua_pushvalue(L,1);
+        f = (double)lua_tonumber(L,1);
     } else {
         lua_pushvalue(L, lua_upvalueindex(1));
         lua_pushvalue(L,1);
         lua_call(L,1,1);
         if(lua_type(L,-1) != LUA_TNUMBER) return luaL_error(L,"unacceptable value for float");
+        f = (double)lua_tonumber(L,-1);
     }
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
+
+    etf_pushfloat(L,f);
     return 1;
 }
 
-static inline int etf_isfloat(lua_State *L, int idx) {
-    int res = 0;
+/* reads the etf.float at idx into f, returns 0 if it isn't one. A table
+ * given etf.float_mt by hand has its float field read with rawget,
+ * the metatable's __index is the userdata's */
+static int etf_tofloat(lua_State *L, int idx, double *f) {
+    double *d = (double *)luaL_testudata(L,idx,etf_float_mt);
+    int res;
 
-    if(lua_getmetatable(L,idx) == 0) return 0;
+    if(d != NULL) {
+        *f = *d;
+        return 1;
+    }
+    if(lua_type(L,idx) != LUA_TTABLE || !lua_getmetatable(L,idx)) return 0;
     luaL_getmetatable(L,etf_float_mt);
     res = lua_rawequal(L,-1,-2);
     lua_pop(L,2);
+    if(!res) return 0;
 
-    return res;
+    lua_pushliteral(L,"float");
+    lua_rawget(L,idx < 0 ? idx - 1 : idx);
+    *f = (double)lua_tonumber(L,-1);
+    lua_pop(L,1);
+    return 1;
+}
+
+/* reads an operand of a float metamethod, either an etf.float or a number */
+static inline double etf_checkfloat(lua_State *L, int idx) {
+    double f;
+    if(etf_tofloat(L,idx,&f)) return f;
+    return (double)luaL_checknumber(L,idx);
 }
 
-static inline void etf_getfloat(lua_State *L, int idx) {
-    if(etf_isfloat(L,idx)) {
-        lua_getfield(L,idx,"float");
+/* float.float is the value as a Lua number */
+static int
+etf_float__index(lua_State *L) {
+    double f;
+    const char *key = lua_tostring(L,2);
+
+    if(!etf_tofloat(L,1,&f)) return luaL_argerror(L,1,"etf.float expected");
+    if(key != NULL && strcmp(key,"float") == 0) {
+        lua_pushnumber(L,(lua_Number)f);
     } else {
-        lua_pushvalue(L,idx);
+        lua_pushnil(L);
     }
+    return 1;
 }
 
 static int
 etf_float__tostring(lua_State *L) {
     lua_pushvalue(L,lua_upvalueindex(1));
-    lua_getfield(L,1,"float");
+    lua_pushnumber(L,(lua_Number)etf_checkfloat(L,1));
     lua_call(L,1,1);
     return 1;
 }
 
 static int
 etf_float__concat(lua_State *L) {
-    lua_pushvalue(L,lua_upvalueindex(1));
-    etf_getfloat(L,1);
-    lua_call(L,1,1);
+    double f;
+    int i;
 
-    lua_pushvalue(L,lua_upvalueindex(1));
-    etf_getfloat(L,2);
-    lua_call(L,1,1);
+    for(i = 1; i <= 2; i++) {
+        lua_pushvalue(L,lua_upvalueindex(1));
+        if(etf_tofloat(L,i,&f)) {
+            lua_pushnumber(L,(lua_Number)f);
+        } else {
+            lua_pushvalue(L,i);
+        }
+        lua_call(L,1,1);
+    }
 
     lua_concat(L,2);
     return 1;
@@ -704,302 +1265,144 @@ etf_float__concat(lua_State *L) {
 
 static int
 etf_float__add(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
-    lua_pushnumber(L, lua_tonumber(L,-2) + lua_tonumber(L,-1));
-    lua_insert(L, lua_gettop(L) - 2);
-    lua_pop(L,2);
-#else
-    lua_arith(L, LUA_OPADD);
-#endif
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
-
+    etf_pushfloat(L,etf_checkfloat(L,1) + etf_checkfloat(L,2));
     return 1;
 }
 
 static int
 etf_float__sub(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
-    lua_pushnumber(L, lua_tonumber(L,-2) - lua_tonumber(L,-1));
-    lua_insert(L, lua_gettop(L) - 2);
-    lua_pop(L,2);
-#else
-    lua_arith(L, LUA_OPSUB);
-#endif
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
-
+    etf_pushfloat(L,etf_checkfloat(L,1) - etf_checkfloat(L,2));
     return 1;
 }
 
 static int
 etf_float__mul(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
-    lua_pushnumber(L, lua_tonumber(L,-2) * lua_tonumber(L,-1));
-    lua_insert(L, lua_gettop(L) - 2);
-    lua_pop(L,2);
-#else
-    lua_arith(L, LUA_OPMUL);
-#endif
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
-
+    etf_pushfloat(L,etf_checkfloat(L,1) * etf_checkfloat(L,2));
     return 1;
 }
 
 static int
 etf_float__div(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
-    lua_pushnumber(L, lua_tonumber(L,-2) / lua_tonumber(L,-1));
-    lua_insert(L, lua_gettop(L) - 2);
-    lua_pop(L,2);
-#else
-    lua_arith(L, LUA_OPDIV);
-#endif
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
-
+    etf_pushfloat(L,etf_checkfloat(L,1) / etf_checkfloat(L,2));
     return 1;
 }
 
+/* same as Lua's float modulo, the result has the sign of the divisor */
 static int
 etf_float__mod(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
-    lua_pushnumber(L, fmod(lua_tonumber(L,-2),lua_tonumber(L,-1)));
-    lua_insert(L, lua_gettop(L) - 2);
-    lua_pop(L,2);
-#else
-    lua_arith(L, LUA_OPMOD);
-#endif
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
+    double a = etf_checkfloat(L,1);
+    double b = etf_checkfloat(L,2);
+    double m = fmod(a,b);
 
+    if((m > 0) ? b < 0 : (m < 0 && b != m)) m += b;
+    etf_pushfloat(L,m);
     return 1;
 }
 
 static int
 etf_float__pow(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
-    lua_pushnumber(L, pow(lua_tonumber(L,-2),lua_tonumber(L,-1)));
-    lua_insert(L, lua_gettop(L) - 2);
-    lua_pop(L,2);
-#else
-    lua_arith(L, LUA_OPPOW);
-#endif
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
-
+    etf_pushfloat(L,pow(etf_checkfloat(L,1),etf_checkfloat(L,2)));
     return 1;
 }
 
 static int
 etf_float__unm(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-
-#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
-    lua_pushnumber(L, -(lua_tonumber(L,-1)));
-    lua_insert(L, lua_gettop(L) - 1);
-    lua_pop(L,1);
-#else
-    lua_arith(L, LUA_OPUNM);
-#endif
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
-
+    etf_pushfloat(L,-etf_checkfloat(L,1));
     return 1;
 }
 
 #if LUA_VERSION_NUM >= 503
 static int
 etf_float__idiv(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-    lua_arith(L, LUA_OPIDIV);
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
+    etf_pushfloat(L,floor(etf_checkfloat(L,1) / etf_checkfloat(L,2)));
+    return 1;
+}
 
+/* bitwise operators go through Lua, which raises an error for
+ * values without an integer representation */
+static int
+etf_float_bitwise(lua_State *L, int op) {
+    lua_pushnumber(L,(lua_Number)etf_checkfloat(L,1));
+    if(op != LUA_OPBNOT) {
+        lua_pushnumber(L,(lua_Number)etf_checkfloat(L,2));
+    }
+    lua_arith(L,op);
+    etf_pushfloat(L,(double)lua_tonumber(L,-1));
     return 1;
 }
 
 static int
 etf_float__bnot(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-
-    lua_arith(L, LUA_OPBNOT);
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
-
-    return 1;
+    return etf_float_bitwise(L,LUA_OPBNOT);
 }
 
 static int
 etf_float__band(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-    lua_arith(L, LUA_OPBAND);
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
-
-    return 1;
+    return etf_float_bitwise(L,LUA_OPBAND);
 }
 
 static int
 etf_float__bor(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-    lua_arith(L, LUA_OPBOR);
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
-
-    return 1;
+    return etf_float_bitwise(L,LUA_OPBOR);
 }
 
 static int
 etf_float__bxor(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-    lua_arith(L, LUA_OPBXOR);
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
-
-    return 1;
+    return etf_float_bitwise(L,LUA_OPBXOR);
 }
 
 static int
 etf_float__shl(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-    lua_arith(L, LUA_OPSHL);
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
-
-    return 1;
+    return etf_float_bitwise(L,LUA_OPSHL);
 }
 
 static int
 etf_float__shr(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-    lua_arith(L, LUA_OPSHR);
-
-    lua_setfield(L,-2,"float");
-    luaL_setmetatable(L,etf_float_mt);
-
-    return 1;
+    return etf_float_bitwise(L,LUA_OPSHR);
 }
 #endif
 
 static int
 etf_float__eq(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
-    lua_pushboolean(L, lua_equal(L, -2, -1));
-#else
-    lua_pushboolean(L, lua_compare(L, -2, -1, LUA_OPEQ));
-#endif
-
+    lua_pushboolean(L, etf_checkfloat(L,1) == etf_checkfloat(L,2));
     return 1;
 }
 
 static int
 etf_float__lt(lua_State *L) {
-    lua_newtable(L);
-
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
-
-#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
-    lua_pushboolean(L, lua_lessthan(L, -2, -1));
-#else
-    lua_pushboolean(L, lua_compare(L, -2, -1, LUA_OPLT));
-#endif
-
+    lua_pushboolean(L, etf_checkfloat(L,1) < etf_checkfloat(L,2));
     return 1;
 }
 
 static int
 etf_float__le(lua_State *L) {
-    lua_newtable(L);
+    lua_pushboolean(L, etf_checkfloat(L,1) <= etf_checkfloat(L,2));
+    return 1;
+}
 
-    etf_getfloat(L,1);
-    etf_getfloat(L,2);
+/* int64_t arithmetic for the etf.integer fast paths, these store the
+ * result in *a and return 1 (leaving *a alone) on overflow */
+static inline int
+etf_i64_add(int64_t *a, int64_t b) {
+    if((b > 0 && *a > INT64_MAX - b) || (b < 0 && *a < INT64_MIN - b)) return 1;
+    *a += b;
+    return 0;
+}
 
-#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
-    lua_pushboolean(L, !lua_lessthan(L, -1, -2));
-#else
-    lua_pushboolean(L, lua_compare(L, -2, -1, LUA_OPLE));
-#endif
+static inline int
+etf_i64_sub(int64_t *a, int64_t b) {
+    if((b < 0 && *a > INT64_MAX + b) || (b > 0 && *a < INT64_MIN + b)) return 1;
+    *a -= b;
+    return 0;
+}
 
-    return 1;
+/* only multiplies values that fit in 32 bits, anything larger takes
+ * the bigint path */
+static inline int
+etf_i64_mul(int64_t *a, int64_t b) {
+    if(*a < INT32_MIN || *a > INT32_MAX || b < INT32_MIN || b > INT32_MAX) return 1;
+    *a *= b;
+    return 0;
 }
 
 static int
@@ -1041,36 +1444,45 @@ etf_bigint__add(lua_State *L) {
     bigint *a = NULL;
     bigint *b = NULL;
     bigint *r = NULL;
-    bigint tmp_a = BIGINT_INIT;
-    bigint tmp_b = BIGINT_INIT;
+    etf_integer tmp_a;
+    etf_integer tmp_b;
+    int64_t x, y;
 
     r = etf_pushbigint(L);
 
+    if(etf_bigint_small(L,1,&x) && etf_bigint_small(L,2,&y) && etf_i64_add(&x,y) == 0) {
+        bigint_from_i64(r,x);
+        return 1;
+    }
+
+    etf_integer_init(&tmp_a);
+    etf_integer_init(&tmp_b);
+
     if( (a = etf_isbigint(L,1)) == NULL) {
-        if(etf_tobigint(L,1,&tmp_a) != 0) {
-            bigint_free(&tmp_a);
+        if(etf_tobigint(L,1,&tmp_a.b) != 0) {
+            bigint_free(&tmp_a.b);
             return luaL_error(L,"error converting value at index %d",1);
         }
-        a = &tmp_a;
+        a = &tmp_a.b;
     }
 
     if( (b = etf_isbigint(L,2)) == NULL) {
-        if(etf_tobigint(L,2,&tmp_b) != 0) {
-            bigint_free(&tmp_a);
-            bigint_free(&tmp_b);
+        if(etf_tobigint(L,2,&tmp_b.b) != 0) {
+            bigint_free(&tmp_a.b);
+            bigint_free(&tmp_b.b);
             return luaL_error(L,"error converting value at index %d",2);
         }
-        b = &tmp_b;
+        b = &tmp_b.b;
     }
 
     if(bigint_add(r,a,b)) {
-        bigint_free(&tmp_a);
-        bigint_free(&tmp_b);
+        bigint_free(&tmp_a.b);
+        bigint_free(&tmp_b.b);
         return luaL_error(L,"out of memory");
     }
 
-    bigint_free(&tmp_a);
-    bigint_free(&tmp_b);
+    bigint_free(&tmp_a.b);
+    bigint_free(&tmp_b.b);
 
     return 1;
 }
@@ -1080,36 +1492,45 @@ etf_bigint__sub(lua_State *L) {
     bigint *a = NULL;
     bigint *b = NULL;
     bigint *r = NULL;
-    bigint tmp_a = BIGINT_INIT;
-    bigint tmp_b = BIGINT_INIT;
+    etf_integer tmp_a;
+    etf_integer tmp_b;
+    int64_t x, y;
 
     r = etf_pushbigint(L);
 
+    if(etf_bigint_small(L,1,&x) && etf_bigint_small(L,2,&y) && etf_i64_sub(&x,y) == 0) {
+        bigint_from_i64(r,x);
+        return 1;
+    }
+
+    etf_integer_init(&tmp_a);
+    etf_integer_init(&tmp_b);
+
     if( (a = etf_isbigint(L,1)) == NULL) {
-        if(etf_tobigint(L,1,&tmp_a) != 0) {
-            bigint_free(&tmp_a);
+        if(etf_tobigint(L,1,&tmp_a.b) != 0) {
+            bigint_free(&tmp_a.b);
             return luaL_error(L,"error converting value at index %d",1);
         }
-        a = &tmp_a;
+        a = &tmp_a.b;
     }
 
     if( (b = etf_isbigint(L,2)) == NULL) {
-        if(etf_tobigint(L,2,&tmp_b) != 0) {
-            bigint_free(&tmp_a);
-            bigint_free(&tmp_b);
+        if(etf_tobigint(L,2,&tmp_b.b) != 0) {
+            bigint_free(&tmp_a.b);
+            bigint_free(&tmp_b.b);
             return luaL_error(L,"error converting value at index %d",2);
         }
-        b = &tmp_b;
+        b = &tmp_b.b;
     }
 
     if(bigint_sub(r,a,b)) {
-        bigint_free(&tmp_a);
-        bigint_free(&tmp_b);
+        bigint_free(&tmp_a.b);
+        bigint_free(&tmp_b.b);
         return luaL_error(L,"out of memory");
     }
 
-    bigint_free(&tmp_a);
-    bigint_free(&tmp_b);
+    bigint_free(&tmp_a.b);
+    bigint_free(&tmp_b.b);
 
     return 1;
 }
@@ -1119,36 +1540,45 @@ etf_bigint__mul(lua_State *L) {
     bigint *a = NULL;
     bigint *b = NULL;
     bigint *r = NULL;
-    bigint tmp_a = BIGINT_INIT;
-    bigint tmp_b = BIGINT_INIT;
+    etf_integer tmp_a;
+    etf_integer tmp_b;
+    int64_t x, y;
 
     r = etf_pushbigint(L);
 
+    if(etf_bigint_small(L,1,&x) && etf_bigint_small(L,2,&y) && etf_i64_mul(&x,y) == 0) {
+        bigint_from_i64(r,x);
+        return 1;
+    }
+
+    etf_integer_init(&tmp_a);
+    etf_integer_init(&tmp_b);
+
     if( (a = etf_isbigint(L,1)) == NULL) {
-        if(etf_tobigint(L,1,&tmp_a) != 0) {
-            bigint_free(&tmp_a);
+        if(etf_tobigint(L,1,&tmp_a.b) != 0) {
+            bigint_free(&tmp_a.b);
             return luaL_error(L,"error converting value at index %d",1);
         }
-        a = &tmp_a;
+        a = &tmp_a.b;
     }
 
     if( (b = etf_isbigint(L,2)) == NULL) {
-        if(etf_tobigint(L,2,&tmp_b) != 0) {
-            bigint_free(&tmp_a);
-            bigint_free(&tmp_b);
+        if(etf_tobigint(L,2,&tmp_b.b) != 0) {
+            bigint_free(&tmp_a.b);
+            bigint_free(&tmp_b.b);
             return luaL_error(L,"error converting value at index %d",2);
         }
-        b = &tmp_b;
+        b = &tmp_b.b;
     }
 
     if(bigint_mul(r,a,b)) {
-        bigint_free(&tmp_a);
-        bigint_free(&tmp_b);
+        bigint_free(&tmp_a.b);
+        bigint_free(&tmp_b.b);
         return luaL_error(L,"out of memory");
     }
 
-    bigint_free(&tmp_a);
-    bigint_free(&tmp_b);
+    bigint_free(&tmp_a.b);
+    bigint_free(&tmp_b.b);
 
     return 1;
 }
@@ -1158,39 +1588,43 @@ etf_bigint__div(lua_State *L) {
     bigint *a = NULL;
     bigint *b = NULL;
     bigint *r = NULL;
-    bigint tmp_a = BIGINT_INIT;
-    bigint tmp_b = BIGINT_INIT;
-    bigint tmp_remain = BIGINT_INIT;
+    etf_integer tmp_a;
+    etf_integer tmp_b;
+    etf_integer tmp_remain;
+
+    etf_integer_init(&tmp_a);
+    etf_integer_init(&tmp_b);
+    etf_integer_init(&tmp_remain);
 
     r = etf_pushbigint(L);
 
     if( (a = etf_isbigint(L,1)) == NULL) {
-        if(etf_tobigint(L,1,&tmp_a) != 0) {
-            bigint_free(&tmp_a);
+        if(etf_tobigint(L,1,&tmp_a.b) != 0) {
+            bigint_free(&tmp_a.b);
             return luaL_error(L,"error converting value at index %d",1);
         }
-        a = &tmp_a;
+        a = &tmp_a.b;
     }
 
     if( (b = etf_isbigint(L,2)) == NULL) {
-        if(etf_tobigint(L,2,&tmp_b) != 0) {
-            bigint_free(&tmp_a);
-            bigint_free(&tmp_b);
+        if(etf_tobigint(L,2,&tmp_b.b) != 0) {
+            bigint_free(&tmp_a.b);
+            bigint_free(&tmp_b.b);
             return luaL_error(L,"error converting value at index %d",2);
         }
-        b = &tmp_b;
+        b = &tmp_b.b;
     }
 
-    if(bigint_div_mod(r,&tmp_remain,a,b)) {
-        bigint_free(&tmp_remain);
-        bigint_free(&tmp_a);
-        bigint_free(&tmp_b);
+    if(bigint_div_mod(r,&tmp_remain.b,a,b)) {
+        bigint_free(&tmp_remain.b);
+        bigint_free(&tmp_a.b);
+        bigint_free(&tmp_b.b);
         return luaL_error(L,"out of memory");
     }
 
-    bigint_free(&tmp_remain);
-    bigint_free(&tmp_a);
-    bigint_free(&tmp_b);
+    bigint_free(&tmp_remain.b);
+    bigint_free(&tmp_a.b);
+    bigint_free(&tmp_b.b);
 
     return 1;
 }
@@ -1200,39 +1634,43 @@ etf_bigint__mod(lua_State *L) {
     bigint *a = NULL;
     bigint *b = NULL;
     bigint *r = NULL;
-    bigint tmp_a = BIGINT_INIT;
-    bigint tmp_b = BIGINT_INIT;
-    bigint tmp_quot = BIGINT_INIT;
+    etf_integer tmp_a;
+    etf_integer tmp_b;
+    etf_integer tmp_quot;
+
+    etf_integer_init(&tmp_a);
+    etf_integer_init(&tmp_b);
+    etf_integer_init(&tmp_quot);
 
     r = etf_pushbigint(L);
 
     if( (a = etf_isbigint(L,1)) == NULL) {
-        if(etf_tobigint(L,1,&tmp_a) != 0) {
-            bigint_free(&tmp_a);
+        if(etf_tobigint(L,1,&tmp_a.b) != 0) {
+            bigint_free(&tmp_a.b);
             return luaL_error(L,"error converting value at index %d",1);
         }
-        a = &tmp_a;
+        a = &tmp_a.b;
     }
 
     if( (b = etf_isbigint(L,2)) == NULL) {
-        if(etf_tobigint(L,2,&tmp_b) != 0) {
-            bigint_free(&tmp_a);
-            bigint_free(&tmp_b);
+        if(etf_tobigint(L,2,&tmp_b.b) != 0) {
+            bigint_free(&tmp_a.b);
+            bigint_free(&tmp_b.b);
             return luaL_error(L,"error converting value at index %d",2);
         }
-        b = &tmp_b;
+        b = &tmp_b.b;
     }
 
-    if(bigint_div_mod(&tmp_quot,r,a,b)) {
-        bigint_free(&tmp_quot);
-        bigint_free(&tmp_a);
-        bigint_free(&tmp_b);
+    if(bigint_div_mod(&tmp_quot.b,r,a,b)) {
+        bigint_free(&tmp_quot.b);
+        bigint_free(&tmp_a.b);
+        bigint_free(&tmp_b.b);
         return luaL_error(L,"out of memory");
     }
 
-    bigint_free(&tmp_quot);
-    bigint_free(&tmp_a);
-    bigint_free(&tmp_b);
+    bigint_free(&tmp_quot.b);
+    bigint_free(&tmp_a.b);
+    bigint_free(&tmp_b.b);
 
     return 1;
 }
@@ -1241,29 +1679,38 @@ static int
 etf_bigint__eq(lua_State *L) {
     bigint *a = NULL;
     bigint *b = NULL;
-    bigint tmp_a = BIGINT_INIT;
-    bigint tmp_b = BIGINT_INIT;
+    etf_integer tmp_a;
+    etf_integer tmp_b;
+    int64_t x, y;
+
+    if(etf_bigint_small(L,1,&x) && etf_bigint_small(L,2,&y)) {
+        lua_pushboolean(L,x == y);
+        return 1;
+    }
+
+    etf_integer_init(&tmp_a);
+    etf_integer_init(&tmp_b);
 
     if( (a = etf_isbigint(L,1)) == NULL) {
-        if(etf_tobigint(L,1,&tmp_a) != 0) {
-            bigint_free(&tmp_a);
+        if(etf_tobigint(L,1,&tmp_a.b) != 0) {
+            bigint_free(&tmp_a.b);
             return luaL_error(L,"error converting value at index %d",1);
         }
-        a = &tmp_a;
+        a = &tmp_a.b;
     }
 
     if( (b = etf_isbigint(L,2)) == NULL) {
-        if(etf_tobigint(L,2,&tmp_b) != 0) {
-            bigint_free(&tmp_a);
-            bigint_free(&tmp_b);
+        if(etf_tobigint(L,2,&tmp_b.b) != 0) {
+            bigint_free(&tmp_a.b);
+            bigint_free(&tmp_b.b);
             return luaL_error(L,"error converting value at index %d",2);
         }
-        b = &tmp_b;
+        b = &tmp_b.b;
     }
 
     lua_pushboolean(L,bigint_eq(a,b));
-    bigint_free(&tmp_a);
-    bigint_free(&tmp_b);
+    bigint_free(&tmp_a.b);
+    bigint_free(&tmp_b.b);
 
     return 1;
 }
@@ -1272,29 +1719,38 @@ static int
 etf_bigint__lt(lua_State *L) {
     bigint *a = NULL;
     bigint *b = NULL;
-    bigint tmp_a = BIGINT_INIT;
-    bigint tmp_b = BIGINT_INIT;
+    etf_integer tmp_a;
+    etf_integer tmp_b;
+    int64_t x, y;
+
+    if(etf_bigint_small(L,1,&x) && etf_bigint_small(L,2,&y)) {
+        lua_pushboolean(L,x < y);
+        return 1;
+    }
+
+    etf_integer_init(&tmp_a);
+    etf_integer_init(&tmp_b);
 
     if( (a = etf_isbigint(L,1)) == NULL) {
-        if(etf_tobigint(L,1,&tmp_a) != 0) {
-            bigint_free(&tmp_a);
+        if(etf_tobigint(L,1,&tmp_a.b) != 0) {
+            bigint_free(&tmp_a.b);
             return luaL_error(L,"error converting value at index %d",1);
         }
-        a = &tmp_a;
+        a = &tmp_a.b;
     }
 
     if( (b = etf_isbigint(L,2)) == NULL) {
-        if(etf_tobigint(L,2,&tmp_b) != 0) {
-            bigint_free(&tmp_a);
-            bigint_free(&tmp_b);
+        if(etf_tobigint(L,2,&tmp_b.b) != 0) {
+            bigint_free(&tmp_a.b);
+            bigint_free(&tmp_b.b);
             return luaL_error(L,"error converting value at index %d",2);
         }
-        b = &tmp_b;
+        b = &tmp_b.b;
     }
 
     lua_pushboolean(L,bigint_lt(a,b));
-    bigint_free(&tmp_a);
-    bigint_free(&tmp_b);
+    bigint_free(&tmp_a.b);
+    bigint_free(&tmp_b.b);
 
     return 1;
 }
@@ -1303,29 +1759,38 @@ static int
 etf_bigint__le(lua_State *L) {
     bigint *a = NULL;
     bigint *b = NULL;
-    bigint tmp_a = BIGINT_INIT;
-    bigint tmp_b = BIGINT_INIT;
+    etf_integer tmp_a;
+    etf_integer tmp_b;
+    int64_t x, y;
+
+    if(etf_bigint_small(L,1,&x) && etf_bigint_small(L,2,&y)) {
+        lua_pushboolean(L,x <= y);
+        return 1;
+    }
+
+    etf_integer_init(&tmp_a);
+    etf_integer_init(&tmp_b);
 
     if( (a = etf_isbigint(L,1)) == NULL) {
-        if(etf_tobigint(L,1,&tmp_a) != 0) {
-            bigint_free(&tmp_a);
+        if(etf_tobigint(L,1,&tmp_a.b) != 0) {
+            bigint_free(&tmp_a.b);
             return luaL_error(L,"error converting value at index %d",1);
         }
-        a = &tmp_a;
+        a = &tmp_a.b;
     }
 
     if( (b = etf_isbigint(L,2)) == NULL) {
-        if(etf_tobigint(L,2,&tmp_b) != 0) {
-            bigint_free(&tmp_a);
-            bigint_free(&tmp_b);
+        if(etf_tobigint(L,2,&tmp_b.b) != 0) {
+            bigint_free(&tmp_a.b);
+            bigint_free(&tmp_b.b);
             return luaL_error(L,"error converting value at index %d",2);
         }
-        b = &tmp_b;
+        b = &tmp_b.b;
     }
 
     lua_pushboolean(L,bigint_le(a,b));
-    bigint_free(&tmp_a);
-    bigint_free(&tmp_b);
+    bigint_free(&tmp_a.b);
+    bigint_free(&tmp_b.b);
 
     return 1;
 }
@@ -1396,8 +1861,98 @@ etf_bigint__gc(lua_State *L) {
     return 0;
 }
 
+/* pushes the interned atom for name, creating it if needed */
+static etf_atom_data *
+etf_pushatom(lua_State *L, const char *name, size_t len, int utf8) {
+    etf_atom_data *a = NULL;
+    size_t header;
+
+    lua_getfield(L,LUA_REGISTRYINDEX,utf8 ? etf_atom_pool : etf_atom_latin1_pool);
+    lua_pushlstring(L,name,len);
+    lua_pushvalue(L,-1);
+    lua_rawget(L,-3);
+
+    if(lua_type(L,-1) == LUA_TUSERDATA) {
+        lua_replace(L,-3);
+        lua_pop(L,1);
+        return (etf_atom_data *)lua_touserdata(L,-1);
+    }
+    lua_pop(L,1);
+
+    header = len > UINT8_MAX || !utf8 ? 3 : 2;
+    a = (etf_atom_data *)lua_newuserdata(L,sizeof(etf_atom_data) + header + len);
+    if(a == NULL) {
+        luaL_error(L,"out of memory");
+        return NULL;
+    }
+    a->len = len;
+    a->enclen = header + len;
+    a->utf8 = (uint8_t)(utf8 != 0);
+
+    if(len > UINT8_MAX) {
+        a->data[0] = _131_ATOM_UTF8_EXT;
+        pack_uint16be(&a->data[1],(uint16_t)len);
+    } else if(utf8) {
+        a->data[0] = _131_SMALL_ATOM_UTF8_EXT;
+        a->data[1] = (uint8_t)len;
+    } else {
+        a->data[0] = _131_ATOM_EXT;
+        pack_uint16be(&a->data[1],(uint16_t)len);
+    }
+    memcpy(&a->data[header],name,len);
+    luaL_setmetatable(L,etf_atom_mt);
+
+    /* stack is: pool, name, atom */
+    lua_pushvalue(L,-1);
+    lua_insert(L,-4);
+    lua_rawset(L,-3);
+    lua_pop(L,1);
+
+    return a;
+}
+
+/* pushes the atom at idx and returns it, or returns NULL (pushing nothing)
+ * if the value isn't an atom. A table given etf.atom_mt by hand, with
+ * atom and utf8 fields, is interned, its fields are read with rawget
+ * since the metatable's __index is the userdata's */
+static etf_atom_data *
+etf_toatom(lua_State *L, int idx) {
+    etf_atom_data *a = NULL;
+    const char *name = NULL;
+    size_t len;
+    int res;
+
+    if(idx < 0) idx = lua_gettop(L) + idx + 1;
+
+    if( (a = (etf_atom_data *)luaL_testudata(L,idx,etf_atom_mt)) != NULL) {
+        lua_pushvalue(L,idx);
+        return a;
+    }
+    if(lua_type(L,idx) != LUA_TTABLE || !lua_getmetatable(L,idx)) return NULL;
+    luaL_getmetatable(L,etf_atom_mt);
+    res = lua_rawequal(L,-1,-2);
+    lua_pop(L,2);
+    if(!res) return NULL;
+
+    lua_pushliteral(L,"atom");
+    lua_rawget(L,idx);
+    if(lua_type(L,-1) != LUA_TSTRING || lua_rawlen(L,-1) > UINT16_MAX) {
+        lua_pop(L,1);
+        return NULL;
+    }
+    name = lua_tolstring(L,-1,&len);
+
+    lua_pushliteral(L,"utf8");
+    lua_rawget(L,idx);
+    a = etf_pushatom(L,name,len,lua_toboolean(L,-1));
+    lua_replace(L,-3);
+    lua_pop(L,1);
+    return a;
+}
+
 static int
 etf_atom(lua_State *L) {
+    const char *name = NULL;
     size_t len;
     int type;
     int idx;
@@ -1405,6 +1960,8 @@ etf_atom(lua_State *L) {
     type = lua_type(L,1);
     if(type == LUA_TSTRING) {
         idx = 1;
+    } else if(type == LUA_TTABLE && lua_isnone(L,2) && etf_toatom(L,1) != NULL) {
+        return 1;
     } else {
         lua_pushvalue(L,lua_upvalueindex(1));
         lua_pushvalue(L,1);
@@ -1417,37 +1974,49 @@ etf_atom(lua_State *L) {
         return luaL_error(L,"missing required string argument");
     }
 
-    len = lua_rawlen(L,idx);
+    name = lua_tolstring(L,idx,&len);
     if(len > UINT16_MAX) {
         return luaL_error(L,"string length is too long");
     }
 
-    lua_newtable(L);
-    lua_pushvalue(L,idx);
-    lua_setfield(L,-2,"atom");
-
-    if(lua_isboolean(L,2)) {
-        lua_pushvalue(L,2);
-    } else {
-        lua_pushboolean(L,1);
-    }
-    lua_setfield(L,-2,"utf8");
-
-    luaL_setmetatable(L,etf_atom_mt);
+    etf_pushatom(L,name,len,lua_isboolean(L,2) ? lua_toboolean(L,2) : 1);
     return 1;
 }
 
 static int
 etf_atom__eq(lua_State *L) {
-    lua_getfield(L,1,"atom");
-    lua_getfield(L,2,"atom");
-    lua_pushboolean(L,lua_rawequal(L,-1,-2));
+    etf_atom_data *a = etf_toatom(L,1);
+    etf_atom_data *b = etf_toatom(L,2);
+
+    lua_pushboolean(L,a != NULL && b != NULL && a->len == b->len &&
+      memcmp(etf_atom_name(a),etf_atom_name(b),a->len) == 0);
     return 1;
 }
 
 static int
 etf_atom__tostring(lua_State *L) {
-    lua_getfield(L,1,"atom");
+    etf_atom_data *a = etf_toatom(L,1);
+
+    if(a == NULL) return luaL_argerror(L,1,"etf.atom expected");
+    lua_pushlstring(L,(const char *)etf_atom_name(a),a->len);
+    return 1;
+}
+
+/* atom.atom is the name, atom.utf8 is false for Latin-1 atoms */
+static int
+etf_atom__index(lua_State *L) {
+    etf_atom_data *a = etf_toatom(L,1);
+    const char *key = lua_tostring(L,2);
+
+    if(a == NULL) return luaL_argerror(L,1,"etf.atom expected");
+
+    if(key != NULL && strcmp(key,"atom") == 0) {
+        lua_pushlstring(L,(const char *)etf_atom_name(a),a->len);
+    } else if(key != NULL && strcmp(key,"utf8") == 0) {
+        lua_pushboolean(L,a->utf8);
+    } else {
+        lua_pushnil(L);
+    }
     return 1;
 }
 
@@ -1542,6 +2111,15 @@ static int etf_decode_string(etf_131_decoder_state *D, size_t len) {
     char *buffer;
     luaL_Buffer buf;
 
+    if(D->read == etf_131_decoder_read) {
+        /* uncompressed data is contiguous, no need to copy it out first */
+        if(len > D->len) return luaL_error(D->L,"attempt to read beyond available data");
+        lua_pushlstring(D->L,(const char *)D->data,len);
+        D->data += len;
+        D->len -= len;
+        return 1;
+    }
+
     luaL_buffinit(D->L,&buf);
 
     while(r < len) {
@@ -1557,36 +2135,51 @@ static int etf_decode_string(etf_131_decoder_state *D, size_t len) {
     return 1;
 }
 
+/* packs little-endian digit bytes into r's words, starting at byte offset */
+static inline void etf_bigint_pack(bigint *r, size_t offset, const uint8_t *bytes, size_t len) {
+    size_t i;
+
+    for(i = 0; i < len; i++, offset++) {
+        r->words[offset / BIGINT_WORD_SIZE] |= (bigint_word)bytes[i] << (8 * (offset % BIGINT_WORD_SIZE));
+    }
+}
+
 static int etf_131_decoder_process_bigint(etf_131_decoder_state *D, uint32_t bytes, uint8_t sign) {
-    int ret;
-    const uint8_t *str;
+    uint8_t buffer[256];
     bigint *r = NULL;
-    bigint_word w = 0;
-    bigint tmp = BIGINT_INIT;
-    tmp.size = 1;
-    tmp.words = &w;
-    uint32_t b = bytes;
+    size_t offset = 0;
+    size_t n;
     int64_t i;
 
     r = etf_pushbigint(D->L);
 
-    if( (ret = etf_decode_string(D,bytes)) != 1) return ret;
-    str = (const uint8_t *)lua_tolstring(D->L,-1,NULL);
+    /* digits are little-endian bytes, they're packed straight into words */
+    n = ((size_t)bytes + BIGINT_WORD_SIZE - 1) / BIGINT_WORD_SIZE;
+    if(bigint_resize(r,n)) return luaL_error(D->L,"out of memory");
+    if(n) memset(r->words,0,n * BIGINT_WORD_SIZE);
 
-    while(b--) {
-        w = (bigint_word)str[b];
-        if(bigint_lshift_overwrite(r,8)) return luaL_error(D->L,"out of memory");
-        if(bigint_add_unsigned(r,&tmp)) return luaL_error(D->L,"out of memory");
+    if(D->read == etf_131_decoder_read) {
+        if(bytes > D->len) return luaL_error(D->L,"attempt to read beyond available data");
+        etf_bigint_pack(r,0,D->data,bytes);
+        D->data += bytes;
+        D->len -= bytes;
+    } else {
+        while(offset < bytes) {
+            n = bytes - offset > sizeof(buffer) ? sizeof(buffer) : bytes - offset;
+            D->read(D,buffer,n);
+            etf_bigint_pack(r,offset,buffer,n);
+            offset += n;
+        }
     }
-    lua_pop(D->L,1);
 
-    r->sign = (size_t)sign;
+    bigint_truncate(r);
+    r->sign = r->size ? (size_t)sign : 0;
 
     /* see if this can be represented in a native lua number */
     /* if r >= D->b_min && r <= D->b_max */
     if(!D->force_bigint) {
       if(bigint_ge(r,D->b_min) && bigint_le(r,D->b_max)) {
-          if(bigint_to_i64(&i,r) == 0) {
+          if(bigint_to_i64(&i,r) == 0 && i >= D->i_min && i <= D->i_max) {
               lua_pop(D->L,1);
               lua_pushinteger(D->L,i);
           }
@@ -1596,17 +2189,72 @@ static int etf_131_decoder_process_bigint(etf_131_decoder_state *D, uint32_t byt
     return 1;
 }
 
+static int etf_131_decoder_push_atom(etf_131_decoder_state *D, const uint8_t *name, size_t len, uint8_t pushed);
+
 static int etf_131_decoder_process_atom(etf_131_decoder_state *D, size_t len) {
     int r;
+    uint8_t tmp[256];
+    const uint8_t *name = NULL;
+    uint8_t pushed = 0;
+
+    /* get at the atom's bytes without creating a string, when we can */
+    if(D->read == etf_131_decoder_read) {
+        if(len > D->len) return luaL_error(D->L,"attempt to read beyond available data");
+        name = D->data;
+        D->data += len;
+        D->len -= len;
+    } else if(len <= sizeof(tmp)) {
+        D->read(D,tmp,len);
+        name = tmp;
+    } else {
+        if( (r = etf_decode_string(D,len)) != 1) return r;
+        name = (const uint8_t *)lua_tostring(D->L,-1);
+        pushed = 1;
+    }
+
+    return etf_131_decoder_push_atom(D,name,len,pushed);
+}
+
+/* maps an atom's name to a value, if pushed is set the name is
+ * a string already on top of the stack */
+static int etf_131_decoder_push_atom(etf_131_decoder_state *D, const uint8_t *name, size_t len, uint8_t pushed) {
     int idx;
+    int v;
+
+    if(!D->key) {
+        if(D->rules != NULL && (v = etf_atom_rules_find(D->rules,name,len)) != 0) {
+            if(pushed) lua_pop(D->L,1);
+            lua_rawgeti(D->L,D->consts,v);
+            return 1;
+        }
+
+        /* same as etf_131_atom_map_default, without calling into Lua */
+        if(D->default_map && len <= 5) {
+            if(len == 4 && memcmp(name,"true",4) == 0) {
+                if(pushed) lua_pop(D->L,1);
+                lua_pushboolean(D->L,1);
+                return 1;
+            }
+            if(len == 5 && memcmp(name,"false",5) == 0) {
+                if(pushed) lua_pop(D->L,1);
+                lua_pushboolean(D->L,0);
+                return 1;
+            }
+            if(len == 3 && memcmp(name,"nil",3) == 0) {
+                if(pushed) lua_pop(D->L,1);
+                lua_getfield(D->L,D->uv,"null");
+                return 1;
+            }
+        }
+    }
 
-    if( (r = etf_decode_string(D,len)) != 1) return r;
+    if(!pushed) lua_pushlstring(D->L,(const char *)name,len);
+    if(D->default_map) return 1;
 
     idx = lua_gettop(D->L);
 
-    lua_getuservalue(D->L,1);
-    lua_getfield(D->L,-1,"atom_map");
-    lua_pushvalue(D->L,-3);
+    lua_getfield(D->L,D->uv,"atom_map");
+    lua_pushvalue(D->L,-2);
     lua_pushboolean(D->L,D->key);
     lua_call(D->L,2,1);
 
@@ -1635,14 +2283,15 @@ static int etf_131_decoder_readz(etf_131_decoder_state *D, uint8_t *data, size_t
 
     do {
         if(D->offset == ETF_BUFFER_LEN) {
-            if(!D->strm.avail_in) return luaL_error(D->L,"readz: no data left to decompress");
+            /* inflate may still be holding output after all input is consumed */
             D->strm.avail_out = ETF_BUFFER_LEN;
             D->strm.next_out = D->z;
             D->offset = 0;
             ret = mz_inflate(&D->strm, MZ_NO_FLUSH);
-            if(!(ret == MZ_OK || ret == MZ_STREAM_END)) {
+            if(!(ret == MZ_OK || ret == MZ_STREAM_END || ret == MZ_BUF_ERROR)) {
                 return luaL_error(D->L,"inflate error: %d", ret);
             }
+            if(D->strm.avail_out == ETF_BUFFER_LEN) return luaL_error(D->L,"readz: no data left to decompress");
         }
         m = ETF_BUFFER_LEN - D->strm.avail_out - D->offset;
         if(m) {
@@ -1657,6 +2306,46 @@ static int etf_131_decoder_readz(etf_131_decoder_state *D, uint8_t *data, size_t
     return 0;
 }
 
+/* hands the buffered output to the encode_stream sink */
+static int etf_131_encoder_flush(etf_131_encoder_state *E) {
+    lua_State *L = E->L;
+
+    if(E->out->len == 0) return 0;
+
+    lua_pushvalue(L,E->sink);
+    if(E->sink_self) lua_pushvalue(L,E->sink + 1);
+    lua_pushlstring(L,(const char *)E->out->data,E->out->len);
+    lua_call(L,1 + E->sink_self,2);
+
+    /* file:write style sinks return nil, error on failure */
+    if(E->sink_self && lua_isnil(L,-2)) {
+        return luaL_error(L,"error writing to sink: %s",
+          lua_isstring(L,-1) ? lua_tostring(L,-1) : "unknown error");
+    }
+    lua_pop(L,2);
+
+    E->flushed += E->out->len;
+    E->out->len = 0;
+    return 0;
+}
+
+/* points deflate's output at the free space in E->out. When streaming,
+ * a full chunk is flushed first and the space is capped at the rest of
+ * the chunk, so deflate never writes past chunk_size bytes */
+static int etf_131_encoder_deflate_out(etf_131_encoder_state *E) {
+    size_t room;
+
+    if(E->sink && E->out->len >= E->chunk) etf_131_encoder_flush(E);
+    if(etf_buffer_reserve(E->out,ETF_BUFFER_LEN)) return luaL_error(E->L,"out of memory");
+    room = E->out->alloc - E->out->len;
+    if(E->sink && room > E->chunk - E->out->len) room = E->chunk - E->out->len;
+    if(room > UINT_MAX) room = UINT_MAX;
+
+    E->strm.avail_out = (unsigned int)room;
+    E->strm.next_out = &E->out->data[E->out->len];
+    return 0;
+}
+
 static int etf_131_encoder_writez(etf_131_encoder_state *E, const uint8_t *data, size_t len) {
     int r;
 
@@ -1664,20 +2353,85 @@ static int etf_131_encoder_writez(etf_131_encoder_state *E, const uint8_t *data,
     E->strm.next_in = data;
 
     do {
-        E->strm.avail_out = ETF_BUFFER_LEN;
-        E->strm.next_out = E->z;
+        if( (r = etf_131_encoder_deflate_out(E)) != 0) return r;
         r = mz_deflate(&E->strm, MZ_NO_FLUSH);
         if(r != MZ_OK) return luaL_error(E->L,"error deflating data: %d", r);
-        lua_pushlstring(E->L,(const char *)E->z,ETF_BUFFER_LEN - E->strm.avail_out);
-        lua_rawseti(E->L,E->strtable,++E->strcount);
+        E->out->len = (size_t)(E->strm.next_out - E->out->data);
     } while (E->strm.avail_in);
 
     return 0;
 }
 
 static int etf_131_encoder_write(etf_131_encoder_state *E, const uint8_t *data, size_t len) {
-    lua_pushlstring(E->L,(const char *)data, len);
-    lua_rawseti(E->L,E->strtable,++E->strcount);
+    if(etf_buffer_append(E->out,data,len)) return luaL_error(E->L,"out of memory");
+    return 0;
+}
+
+/* used by encode_stream, never buffers more than E->chunk bytes */
+static int etf_131_encoder_write_stream(etf_131_encoder_state *E, const uint8_t *data, size_t len) {
+    size_t n;
+
+    while(len) {
+        if(E->out->len >= E->chunk) etf_131_encoder_flush(E);
+        n = E->chunk - E->out->len;
+        if(n > len) n = len;
+        if(etf_buffer_append(E->out,data,n)) return luaL_error(E->L,"out of memory");
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int etf_131_encoder_segment(etf_131_encoder_state *E, const uint8_t *ref, size_t offset, size_t len) {
+    etf_segment *segs;
+    size_t segalloc;
+
+    if(len == 0) return 0;
+
+    if(E->nsegs == E->segalloc) {
+        segalloc = E->segalloc ? E->segalloc * 2 : 16;
+        segs = (etf_segment *)realloc(E->segs,sizeof(etf_segment) * segalloc);
+        if(segs == NULL) return luaL_error(E->L,"out of memory");
+        E->segs = segs;
+        E->segalloc = segalloc;
+    }
+
+    E->segs[E->nsegs].ref = ref;
+    E->segs[E->nsegs].offset = offset;
+    E->segs[E->nsegs].len = len;
+    E->nsegs++;
+    return 0;
+}
+
+/* records whatever's been written to E->out since the last segment */
+static int etf_131_encoder_close_segment(etf_131_encoder_state *E) {
+    etf_131_encoder_segment(E,NULL,E->segstart,E->out->len - E->segstart);
+    E->segstart = E->out->len;
+    return 0;
+}
+
+/* records a reference to the string at the top of the stack, instead of
+ * copying its bytes. The string is anchored in the pin table until the
+ * call is finished. */
+static int etf_131_encoder_write_ref(etf_131_encoder_state *E, const uint8_t *data, size_t len) {
+    etf_131_encoder_close_segment(E);
+
+    if(lua_isnil(E->L,E->pins)) {
+        lua_newtable(E->L);
+        lua_replace(E->L,E->pins);
+    }
+    lua_pushvalue(E->L,-1);
+    lua_rawseti(E->L,E->pins,(int)++E->npins);
+    E->reflen += len;
+
+    return etf_131_encoder_segment(E,data,E->npins,len);
+}
+
+/* used by size(), only counts bytes */
+static int etf_131_encoder_count(etf_131_encoder_state *E, const uint8_t *data, size_t len) {
+    (void)data;
+    E->count += len;
     return 0;
 }
 
@@ -1719,13 +2473,26 @@ static int etf_131_decoder_ETFZLIB(etf_131_decoder_state *D) {
     return ret;
 }
 
+/* outside of a distribution message there's no atom cache to
+ * resolve references with, they decode as nil */
 static int etf_131_decoder_ATOM_CACHE_REF(etf_131_decoder_state *D) {
     uint8_t atom_idx;
+    const char *name = NULL;
+    size_t len = 0;
 
     D->read(D,&atom_idx,1);
 
-    lua_pushnil(D->L);
-    return 1;
+    if(D->atoms == 0) {
+        lua_pushnil(D->L);
+        return 1;
+    }
+
+    lua_rawgeti(D->L,D->atoms,atom_idx + 1);
+    if(lua_isnil(D->L,-1)) {
+        return luaL_error(D->L,"invalid atom cache reference %d",(int)atom_idx);
+    }
+    name = lua_tolstring(D->L,-1,&len);
+    return etf_131_decoder_push_atom(D,(const uint8_t *)name,len,1);
 }
 
 static int etf_131_decoder_NEW_FLOAT_EXT(etf_131_decoder_state *D) {
@@ -1740,10 +2507,7 @@ static int etf_131_decoder_NEW_FLOAT_EXT(etf_131_decoder_state *D) {
     u1.tmp = unpack_uint64be(buffer);
 
     if(D->force_float) {
-        lua_newtable(D->L);
-        lua_pushnumber(D->L,(lua_Number)u1.val);
-        lua_setfield(D->L,-2,"float");
-        luaL_setmetatable(D->L,etf_float_mt);
+        etf_pushfloat(D->L,u1.val);
     } else {
         lua_pushnumber(D->L,u1.val);
     }
@@ -1799,7 +2563,7 @@ static int etf_131_decoder_PID_EXT(etf_131_decoder_state *D) {
     lua_pushinteger(D->L,creation);
     lua_setfield(D->L,-2,"creation");
 
-    luaL_setmetatable(D->L,etf_pid_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_PID);
 
     return 1;
 }
@@ -1829,7 +2593,7 @@ static int etf_131_decoder_NEW_PID_EXT(etf_131_decoder_state *D) {
     etf_pushu32(D,creation);
     lua_setfield(D->L,-2,"creation");
 
-    luaL_setmetatable(D->L,etf_pid_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_PID);
 
     return 1;
 }
@@ -1853,7 +2617,7 @@ static int etf_131_decoder_PORT_EXT(etf_131_decoder_state *D) {
     lua_pushinteger(D->L,buffer[4]);
     lua_setfield(D->L,-2,"creation");
 
-    luaL_setmetatable(D->L,etf_port_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_PORT);
 
     return 1;
 }
@@ -1878,7 +2642,7 @@ static int etf_131_decoder_NEW_PORT_EXT(etf_131_decoder_state *D) {
     etf_pushu32(D,creation);
     lua_setfield(D->L,-2,"creation");
 
-    luaL_setmetatable(D->L,etf_port_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_PORT);
 
     return 1;
 }
@@ -1904,7 +2668,7 @@ static int etf_131_decoder_V4_PORT_EXT(etf_131_decoder_state *D) {
     etf_pushu64(D,creation);
     lua_setfield(D->L,-2,"creation");
 
-    luaL_setmetatable(D->L,etf_port_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_PORT);
 
     return 1;
 }
@@ -1934,7 +2698,7 @@ static int etf_131_decoder_REFERENCE_EXT(etf_131_decoder_state *D) {
     lua_pushinteger(D->L,creation);
     lua_setfield(D->L,-2,"creation");
 
-    luaL_setmetatable(D->L,etf_reference_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_REFERENCE);
 
     return 1;
 }
@@ -1971,7 +2735,7 @@ static int etf_131_decoder_NEW_REFERENCE_EXT(etf_131_decoder_state *D) {
     lua_pushinteger(D->L,creation);
     lua_setfield(D->L,-2,"creation");
 
-    luaL_setmetatable(D->L,etf_reference_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_REFERENCE);
 
     return 1;
 }
@@ -2008,7 +2772,7 @@ static int etf_131_decoder_NEWER_REFERENCE_EXT(etf_131_decoder_state *D) {
     etf_pushu32(D,creation);
     lua_setfield(D->L,-2,"creation");
 
-    luaL_setmetatable(D->L,etf_reference_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_REFERENCE);
 
     return 1;
 }
@@ -2027,7 +2791,7 @@ static int etf_131_decoder_EXPORT_EXT(etf_131_decoder_state *D) {
     if( (r = etf_131_decode(D)) != 1) return r;
     lua_setfield(D->L,-2,"arity");
 
-    luaL_setmetatable(D->L,etf_export_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_EXPORT);
 
     return 1;
 }
@@ -2078,7 +2842,7 @@ static int etf_131_decoder_NEW_FUN_EXT(etf_131_decoder_state *D) {
     }
     lua_setfield(D->L,-2,"free_vars");
 
-    luaL_setmetatable(D->L,etf_new_fun_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_NEW_FUN);
 
     return 1;
 }
@@ -2115,7 +2879,7 @@ static int etf_131_decoder_FUN_EXT(etf_131_decoder_state *D) {
     }
     lua_setfield(D->L,-2,"free_vars");
 
-    luaL_setmetatable(D->L,etf_fun_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_FUN);
 
     return 1;
 }
@@ -2126,7 +2890,7 @@ static int etf_131_decoder_SMALL_INTEGER_EXT(etf_131_decoder_state *D) {
 
     D->read(D,&v,1);
 
-    if(D->force_bigint) {
+    if(D->force_bigint || v > D->i_max) {
         r = etf_pushbigint(D->L);
         if(bigint_from_u8(r,v)) return luaL_error(D->L,"out of memory");
     } else {
@@ -2145,10 +2909,7 @@ static int etf_131_decoder_FLOAT_EXT(etf_131_decoder_state *D) {
     sscanf(tmp,"%lf",&f);
 
     if(D->force_float) {
-        lua_newtable(D->L);
-        lua_pushnumber(D->L,(lua_Number)f);
-        lua_setfield(D->L,-2,"float");
-        luaL_setmetatable(D->L,etf_float_mt);
+        etf_pushfloat(D->L,f);
     } else {
         lua_pushnumber(D->L,(lua_Number)f);
     }
@@ -2183,7 +2944,7 @@ static int etf_131_decoder_tuple(etf_131_decoder_state *D, uint32_t items) {
         if(r != 1) return r;
         lua_rawseti(D->L,-2,i);
     }
-    luaL_setmetatable(D->L, etf_tuple_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_TUPLE);
 
     return 1;
 }
@@ -2259,7 +3020,7 @@ static int etf_131_decoder_LIST_EXT(etf_131_decoder_state *D) {
         return luaL_error(D->L,"LIST_EXT: list does not end with NIL_EXT marker");
     }
 
-    luaL_setmetatable(D->L, etf_list_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_LIST);
     return 1;
 }
 
@@ -2323,7 +3084,7 @@ static int etf_131_decoder_MAP_EXT(etf_131_decoder_state *D) {
         lua_settable(D->L,-3);
     }
 
-    luaL_setmetatable(D->L, etf_map_mt);
+    etf_131_decoder_setmetatable(D,ETF_DECODER_MT_MAP);
     return 1;
 }
 
@@ -2381,94 +3142,40 @@ static int etf_131_encoder_INTEGER_EXT(etf_131_encoder_state *E, int32_t n) {
 }
 
 static int etf_131_encoder_BIG_EXT(etf_131_encoder_state *E, const bigint *n) {
-    uint8_t buffer[8];
-    uint8_t i = 0;
+    uint8_t buffer[256];
+    size_t pos = 0;
     size_t len = 0;
+    size_t i;
+    size_t j;
     bigint_word w;
-    size_t bitlength = bigint_bitlength(n);
-    size_t r = bitlength % 8;
-    if(r) {
-        bitlength += 8 - r;
-    }
-    len = bitlength / 8;
+
+    len = (bigint_bitlength(n) + 7) / 8;
 
     if(len < 256) {
-        buffer[0] = _131_SMALL_BIG_EXT;
-        buffer[1] = (uint8_t)len;
-        i = 2;
+        buffer[pos++] = _131_SMALL_BIG_EXT;
+        buffer[pos++] = (uint8_t)len;
     } else {
-        buffer[0] = _131_LARGE_BIG_EXT;
-        pack_uint32be(&buffer[1],len);
-        i = 5;
-    }
-    buffer[i++] = (uint8_t)n->sign;
-
-    E->write(E,buffer,i);
-
-    for(i=0;i<n->size;i++) {
-        w = n->words[i];
-        len = 0;
-        switch(bitlength) {
-            default:
-#if BIGINT_WORD_WIDTH == 8
-            /* fall-through */
-            case 64: {
-                buffer[len++] = w & 0xFF;
-                bitlength -= 8;
-                w >>= 8;
-            }
-            /* fall-through */
-            case 56: {
-                buffer[len++] = w & 0xFF;
-                bitlength -= 8;
-                w >>= 8;
-            }
-            /* fall-through */
-            case 48: {
-                buffer[len++] = w & 0xFF;
-                bitlength -= 8;
-                w >>= 8;
-            }
-            /* fall-through */
-            case 40: {
-                buffer[len++] = w & 0xFF;
-                bitlength -= 8;
-                w >>= 8;
-            }
-#endif
-#if BIGINT_WORD_WIDTH >= 4
-            /* fall-through */
-            case 32: {
-                buffer[len++] = w & 0xFF;
-                bitlength -= 8;
-                w >>= 8;
-            }
-            /* fall-through */
-            case 24: {
-                buffer[len++] = w & 0xFF;
-                bitlength -= 8;
-                w >>= 8;
-            }
-#endif
-#if BIGINT_WORD_WIDTH >= 2
-            /* fall-through */
-            case 16: {
-                buffer[len++] = w & 0xFF;
-                bitlength -= 8;
-                w >>= 8;
-            }
-#endif
-#if BIGINT_WORD_WIDTH >= 1
-            /* fall-through */
-            case 8: {
-                buffer[len++] = w & 0xFF;
-                bitlength -= 8;
-                w >>= 8;
-            }
-#endif
+        buffer[pos++] = _131_LARGE_BIG_EXT;
+        pack_uint32be(&buffer[pos],(uint32_t)len);
+        pos += 4;
+    }
+    buffer[pos++] = (uint8_t)n->sign;
+
+    /* words are unpacked into little-endian digit bytes, and written out
+     * a buffer at a time */
+    for(i = 0; i < len; i += BIGINT_WORD_SIZE) {
+        w = n->words[i / BIGINT_WORD_SIZE];
+        for(j = 0; j < BIGINT_WORD_SIZE && i + j < len; j++) {
+            buffer[pos++] = (uint8_t)(w & 0xFF);
+            w >>= 8;
+        }
+        if(pos > sizeof(buffer) - BIGINT_WORD_SIZE) {
+            E->write(E,buffer,pos);
+            pos = 0;
         }
-        E->write(E,buffer,len);
     }
+    if(pos) E->write(E,buffer,pos);
+
     return 0;
 }
 
@@ -2503,6 +3210,10 @@ static int etf_131_encoder_BINARY_EXT(etf_131_encoder_state *E) {
     header[0] = _131_BINARY_EXT;
     pack_uint32be(&header[1],(uint32_t)len);
     E->write(E,header,5);
+
+    if(E->refs && E->write == etf_131_encoder_write && len >= E->ref_threshold) {
+        return etf_131_encoder_write_ref(E,data,len);
+    }
     E->write(E,data,len);
 
     return 0;
@@ -2564,22 +3275,92 @@ static int etf_131_encoder_LIST_EXT(etf_131_encoder_state *E, int total) {
     return etf_131_encoder_NIL_EXT(E);
 }
 
-static int etf_131_encoder_MAP_EXT(etf_131_encoder_state *E, int total) {
+/* encodes the string map key at -2 (below its value), using the key
+ * cache. Keys are only added to the cache when the output is contiguous,
+ * so the encoded bytes can be copied back out of E->out */
+static int etf_131_encoder_cached_key(etf_131_encoder_state *E) {
+    etf_key_slot *slot = NULL;
+    const char *str = NULL;
+    size_t len = 0;
+    size_t start = 0;
+    size_t i;
+    int capture;
     int r;
-    uint8_t header[5];
 
-    header[0] = _131_MAP_EXT;
-    pack_uint32be(&header[1],total);
+    str = lua_tolstring(E->L,-2,&len);
+    i = (((size_t)str >> 4) ^ ((size_t)str >> 12)) & E->keymask;
+    slot = &E->keys[i];
 
-    E->write(E,header,5);
+    if(slot->str == str && slot->len == len) {
+        return E->write(E,slot->bytes,slot->enclen);
+    }
 
-    lua_pushnil(E->L);
-    while(lua_next(E->L,-2)) {
-        lua_pushvalue(E->L,-2);
-        E->key = 1;
-        r = etf_131_encode(E);
-        if(r) return r;
-        lua_pop(E->L,1);
+    capture = E->write == etf_131_encoder_write && !E->refs && E->cache == NULL && len < ETF_KEY_CACHE_BYTES;
+    start = E->out->len;
+
+    lua_pushvalue(E->L,-2);
+    E->key = 1;
+    r = etf_131_encode(E);
+    if(r) return r;
+    lua_pop(E->L,1);
+
+    if(capture && E->out->len - start <= ETF_KEY_CACHE_BYTES) {
+        slot->str = str;
+        slot->len = len;
+        slot->enclen = (uint8_t)(E->out->len - start);
+        memcpy(slot->bytes,&E->out->data[start],slot->enclen);
+
+        /* replacing the anchor releases the previous key in this slot */
+        lua_getuservalue(E->L,1);
+        lua_getfield(E->L,-1,"key_cache");
+        lua_pushvalue(E->L,-4);
+        lua_rawseti(E->L,-2,(int)i + 1);
+        lua_pop(E->L,2);
+    }
+
+    return 0;
+}
+
+/* encodes the table on top of the stack as a map. With contiguous output
+ * the pairs are counted while encoding and the header is patched after,
+ * otherwise the table is walked once to count them first */
+static int etf_131_encoder_MAP_EXT(etf_131_encoder_state *E) {
+    int r;
+    uint8_t header[5];
+    uint32_t total = 0;
+    size_t start = 0;
+    int patch;
+
+    patch = E->write == etf_131_encoder_write;
+
+    if(!patch) {
+        lua_pushnil(E->L);
+        while(lua_next(E->L,-2)) {
+            total++;
+            lua_pop(E->L,1);
+        }
+    }
+
+    header[0] = _131_MAP_EXT;
+    pack_uint32be(&header[1],total);
+
+    start = E->out->len;
+    E->write(E,header,5);
+
+    total = 0;
+    lua_pushnil(E->L);
+    while(lua_next(E->L,-2)) {
+        total++;
+        if(E->keys != NULL && lua_type(E->L,-2) == LUA_TSTRING) {
+            r = etf_131_encoder_cached_key(E);
+            if(r) return r;
+        } else {
+            lua_pushvalue(E->L,-2);
+            E->key = 1;
+            r = etf_131_encode(E);
+            if(r) return r;
+            lua_pop(E->L,1);
+        }
 
         E->key = 0;
         r = etf_131_encode(E);
@@ -2587,6 +3368,47 @@ static int etf_131_encoder_MAP_EXT(etf_131_encoder_state *E, int total) {
         lua_pop(E->L,1);
     }
 
+    if(patch) pack_uint32be(&E->out->data[start + 1],total);
+
+    return 0;
+}
+
+/* writes an ATOM_CACHE_REF for an atom while encoding a distribution
+ * message. returns 1 if the atom can't be referenced (the header is full,
+ * or another atom in this message uses the same cache entry), and has to
+ * be written as usual */
+static int etf_131_encoder_atom_ref(etf_131_encoder_state *E, const uint8_t *name, size_t len) {
+    etf_atom_cache *C = E->cache;
+    etf_atom_cache_ref *ref = NULL;
+    const char *current = NULL;
+    uint8_t buf[2];
+    size_t index;
+
+    index = etf_hash(name,len) & (ETF_ATOM_CACHE_SIZE - 1);
+
+    if(C->seen[index] == C->gen) {
+        ref = &C->refs[C->ref[index]];
+        current = ref->isnew ? (const char *)&C->names.data[ref->offset] : C->entry[index].name;
+        if(ref->len != len || memcmp(current,name,len) != 0) return 1;
+    } else {
+        if(C->nrefs == ETF_ATOM_CACHE_REFS) return 1;
+
+        ref = &C->refs[C->nrefs];
+        ref->index = (uint16_t)index;
+        ref->len = len;
+        ref->isnew = !(C->entry[index].name != NULL && C->entry[index].len == len &&
+                       memcmp(C->entry[index].name,name,len) == 0);
+        if(ref->isnew) {
+            ref->offset = C->names.len;
+            if(etf_buffer_append(&C->names,name,len)) return luaL_error(E->L,"out of memory");
+        }
+        C->seen[index] = C->gen;
+        C->ref[index] = (uint8_t)C->nrefs++;
+    }
+
+    buf[0] = _131_ATOM_CACHE_REF;
+    buf[1] = C->ref[index];
+    E->write(E,buf,2);
     return 0;
 }
 
@@ -2598,6 +3420,7 @@ static int etf_131_encoder_SMALL_ATOM_UTF8_EXT(etf_131_encoder_state *E) {
     data = (const uint8_t *)lua_tolstring(E->L,-1,&len);
 
     if(len > UINT8_MAX) return luaL_error(E->L,"atom length > max");
+    if(E->cache != NULL && etf_131_encoder_atom_ref(E,data,len) == 0) return 0;
 
     header[0] = _131_SMALL_ATOM_UTF8_EXT;
     header[1] = (uint8_t)len;
@@ -2615,6 +3438,7 @@ static int etf_131_encoder_ATOM_UTF8_EXT(etf_131_encoder_state *E) {
     data = (const uint8_t *)lua_tolstring(E->L,-1,&len);
 
     if(len > UINT16_MAX) return luaL_error(E->L,"atom length > max");
+    if(E->cache != NULL && etf_131_encoder_atom_ref(E,data,len) == 0) return 0;
 
     header[0] = _131_ATOM_UTF8_EXT;
     pack_uint16be(&header[1],(uint16_t)len);
@@ -2626,6 +3450,7 @@ static int etf_131_encoder_ATOM_UTF8_EXT(etf_131_encoder_state *E) {
 
 
 static int etf_131_encoder_TNIL(etf_131_encoder_state *E) {
+    if(E->cache != NULL && etf_131_encoder_atom_ref(E,&_131_atom_nil[2],3) == 0) return 0;
     E->write(E,_131_atom_nil,5);
     return 0;
 }
@@ -2633,6 +3458,10 @@ static int etf_131_encoder_TNIL(etf_131_encoder_state *E) {
 static int etf_131_encoder_TBOOLEAN(etf_131_encoder_state *E) {
     int b = lua_toboolean(E->L,-1);
 
+    if(E->cache != NULL) {
+        if(b && etf_131_encoder_atom_ref(E,&_131_atom_true[2],4) == 0) return 0;
+        if(!b && etf_131_encoder_atom_ref(E,&_131_atom_false[2],5) == 0) return 0;
+    }
     b ? E->write(E,_131_atom_true,6) : E->write(E,_131_atom_false,7);
     return 0;
 }
@@ -2641,7 +3470,7 @@ static int etf_131_encoder_TNUMBER(etf_131_encoder_state *E) {
     int ret;
     lua_Number f;
     lua_Integer n;
-    bigint t = BIGINT_INIT;
+    etf_integer t;
 
     if(!lua_isinteger(E->L,-1)) {
         f = lua_tonumber(E->L,-1);
@@ -2656,14 +3485,15 @@ static int etf_131_encoder_TNUMBER(etf_131_encoder_state *E) {
         return etf_131_encoder_INTEGER_EXT(E,(int32_t)n);
     }
 
-    if(bigint_from_i64(&t,(int64_t)n)) {
-        bigint_free(&t);
+    etf_integer_init(&t);
+    if(bigint_from_i64(&t.b,(int64_t)n)) {
+        bigint_free(&t.b);
         return luaL_error(E->L, "out of memory");
     }
 
-    t.sign = n < 0;
-    ret = etf_131_encoder_BIG_EXT(E,&t);
-    bigint_free(&t);
+    t.b.sign = n < 0;
+    ret = etf_131_encoder_BIG_EXT(E,&t.b);
+    bigint_free(&t.b);
     return ret;
 }
 
@@ -2672,87 +3502,145 @@ static int etf_131_encoder_TSTRING(etf_131_encoder_state *E) {
 }
 
 static int etf_131_encoder_TUSERDATA(etf_131_encoder_state *E) {
-    int idx;
-    int (*encode)(etf_131_encoder_state *) = NULL;
+    const etf_meta_slot *meta = NULL;
 
-    idx = lua_gettop(E->L);
-    lua_getuservalue(E->L,1);
-    lua_getfield(E->L,-1,"mt_map");
-    lua_getmetatable(E->L,-3);
-    lua_gettable(E->L,-2);
+    if(lua_getmetatable(E->L,-1) != 0) {
+        meta = etf_131_encoder_meta_find(E,lua_topointer(E->L,-1));
+        lua_pop(E->L,1);
+    }
 
-    if(lua_type(E->L,-1) != LUA_TLIGHTUSERDATA) {
+    if(meta == NULL || meta->shape != NULL) {
         return luaL_error(E->L, "Userdata value without corresponding encode function");
     }
 
-    encode = (int (*)(etf_131_encoder_state *)) lua_touserdata(E->L,-1);
-    lua_settop(E->L,idx);
-    return encode(E);
+    return meta->encode(E);
 }
 
 
-/* returns 1 iff all keys are integers > 0 and non-sparse 0 otherwise */
-static int is_array(lua_State *L, int *total) {
-    int i = 0;
-    int j = 0;
+/* returns 1 iff the keys of the table on top of the stack are exactly
+ * the integers 1..n, where n is a border of the table. Every key is an
+ * integer in 1..n and there are n of them, so there can't be any gaps */
+static int is_sequence(lua_State *L, size_t n) {
+    size_t count = 0;
+    lua_Number k;
 
     lua_pushnil(L);
     while(lua_next(L,-2)) {
-        i++;
-        /* calling lua_tointeger can technically mess with the value so we duplicate it */
-        lua_pushvalue(L,-2);
-
-        if(lua_type(L,-1) == LUA_TNUMBER &&
-           lua_isinteger(L,-1) &&
-           lua_tointeger(L,-1) == j + 1) {
-            j++;
+        /* lua_tonumber doesn't convert a number key in place, unlike
+         * lua_tolstring, so the key can be read directly */
+        if(lua_type(L,-2) != LUA_TNUMBER) {
+            lua_pop(L,2);
+            return 0;
         }
-        lua_pop(L,2);
+        k = lua_tonumber(L,-2);
+        if(!(k >= 1 && k <= (lua_Number)n && k == (lua_Number)(size_t)k)) {
+            lua_pop(L,2);
+            return 0;
+        }
+        count++;
+        lua_pop(L,1);
     }
-    *total = i;
 
-    return i == j;
+    return count == n;
 }
 
-static int etf_131_encoder_ATOM_EXT(etf_131_encoder_state *E) {
-    uint8_t header[3];
-    const uint8_t *data = NULL;
-    size_t len = 0;
+/* encodes the table on top of the stack as a list of 1..n while checking
+ * its keys, in a single walk for tables whose keys come out in order.
+ * Keys 1..n kept in the table's hash part (say, a table filled in from
+ * the end) are fetched afterwards. If any other key turns up, the output
+ * is rolled back and -1 is returned. Only for contiguous output (or
+ * counting) without a value_map function, so nothing observes the
+ * abandoned encoding */
+static int etf_131_encoder_strict_list(etf_131_encoder_state *E, size_t n) {
+    uint8_t header[5];
+    size_t start;
+    size_t count;
+    size_t done = 0;
+    size_t later = 0;
+    size_t i;
+    lua_Number k;
+    int r;
 
-    data = (const uint8_t *)lua_tolstring(E->L,-1,&len);
+    header[0] = _131_LIST_EXT;
+    pack_uint32be(&header[1],(uint32_t)n);
+    start = E->out->len;
+    count = E->count;
+    E->write(E,header,5);
 
-    if(len > UINT16_MAX) return luaL_error(E->L,"atom length > max");
+    lua_pushnil(E->L);
+    while(lua_next(E->L,-2)) {
+        if(lua_type(E->L,-2) != LUA_TNUMBER) goto notlist;
+        k = lua_tonumber(E->L,-2);
+        if(k == (lua_Number)(done + 1)) {
+            E->key = 0;
+            r = etf_131_encode(E);
+            if(r) return r;
+            done++;
+        } else if(k > (lua_Number)(done + 1) && k <= (lua_Number)n && k == (lua_Number)(size_t)k) {
+            later++;
+        } else {
+            goto notlist;
+        }
+        lua_pop(E->L,1);
+    }
 
-    header[0] = _131_ATOM_EXT;
-    pack_uint16be(&header[1],(uint16_t)len);
-    E->write(E,header,3);
-    E->write(E,data,len);
+    if(done + later != n) {
+        E->out->len = start;
+        E->count = count;
+        return -1;
+    }
+
+    for(i = done + 1; i <= n; i++) {
+        lua_rawgeti(E->L,-1,(int)i);
+        E->key = 0;
+        r = etf_131_encode(E);
+        lua_pop(E->L,1);
+        if(r) return r;
+    }
+
+    return etf_131_encoder_NIL_EXT(E);
 
+    notlist:
+    lua_pop(E->L,2);
+    E->out->len = start;
+    E->count = count;
+    return -1;
+}
+
+static int etf_is_ascii(const uint8_t *data, size_t len) {
+    while(len--) {
+        if(*data++ & 0x80) return 0;
+    }
+    return 1;
+}
+
+static int etf_131_encoder_atom(etf_131_encoder_state *E, const etf_atom_data *a) {
+    const uint8_t *name = etf_atom_name(a);
+
+    /* cached atoms are sent as UTF-8, which only matches Latin-1 for ASCII */
+    if(E->cache != NULL && (a->data[0] != _131_ATOM_EXT || etf_is_ascii(name,a->len)) &&
+       etf_131_encoder_atom_ref(E,name,a->len) == 0) {
+        return 0;
+    }
+
+    E->write(E,a->data,a->enclen);
     return 0;
 }
 
 static int etf_131_encoder_atom_mt(etf_131_encoder_state *E) {
     int r;
-    size_t len = 0;
-    uint8_t utf8 = 0;
-
-    lua_getfield(E->L,-1,"utf8");
-    utf8 = lua_toboolean(E->L,-1);
+    const etf_atom_data *a = NULL;
 
-    lua_getfield(E->L,-2,"atom");
-    len = lua_rawlen(E->L,-1);
-
-    if(len > 255) {
-        r = etf_131_encoder_ATOM_UTF8_EXT(E);
-    } else if(utf8) {
-        r = etf_131_encoder_SMALL_ATOM_UTF8_EXT(E);
-    } else {
-        r = etf_131_encoder_ATOM_EXT(E);
+    if(lua_type(E->L,-1) == LUA_TUSERDATA) {
+        return etf_131_encoder_atom(E,(const etf_atom_data *)lua_touserdata(E->L,-1));
     }
-    if(r != 0) return r;
 
-    lua_pop(E->L,2);
-    return 0;
+    if( (a = etf_toatom(E->L,-1)) == NULL) {
+        return luaL_error(E->L,"atom table without a valid atom field");
+    }
+    r = etf_131_encoder_atom(E,a);
+    lua_pop(E->L,1);
+    return r;
 }
 
 static int etf_131_encoder_export_mt(etf_131_encoder_state *E) {
@@ -2950,13 +3838,13 @@ static int etf_131_encoder_port_mt(etf_131_encoder_state *E) {
 
 
 static int etf_131_encoder_float_mt(etf_131_encoder_state *E) {
-    lua_Number f;
-
-    lua_getfield(E->L,-1,"float");
-    f = lua_tonumber(E->L,-1);
-    lua_pop(E->L,1);
+    double f = 0.0;
 
-    return etf_131_encoder_NEW_FLOAT_EXT(E,f);
+    if(lua_type(E->L,-1) == LUA_TUSERDATA) {
+        return etf_131_encoder_NEW_FLOAT_EXT(E,*(const double *)lua_touserdata(E->L,-1));
+    }
+    etf_tofloat(E->L,-1,&f);
+    return etf_131_encoder_NEW_FLOAT_EXT(E,(lua_Number)f);
 }
 
 static int etf_131_encoder_list_mt(etf_131_encoder_state *E) {
@@ -2964,9 +3852,7 @@ static int etf_131_encoder_list_mt(etf_131_encoder_state *E) {
 }
 
 static int etf_131_encoder_map_mt(etf_131_encoder_state *E) {
-    int total;
-    is_array(E->L, &total);
-    return etf_131_encoder_MAP_EXT(E, total);
+    return etf_131_encoder_MAP_EXT(E);
 }
 
 static int etf_131_encoder_tuple_mt(etf_131_encoder_state *E) {
@@ -2992,6 +3878,11 @@ static int etf_131_encoder_binary_mt(etf_131_encoder_state *E) {
     return r;
 }
 
+static int etf_131_encoder_raw_mt(etf_131_encoder_state *E) {
+    etf_raw *raw = (etf_raw *)lua_touserdata(E->L,-1);
+    return E->write(E,raw->data,raw->len);
+}
+
 static int etf_131_encoder_integer_mt(etf_131_encoder_state *E) {
     uint8_t tmp8;
     int32_t tmp32;
@@ -3141,47 +4032,191 @@ static inline int etf_testmeta(lua_State *L, const char *tname) {
 }
 
 
-static int etf_131_encoder_TTABLE(etf_131_encoder_state *E) {
-    int (*encode)(etf_131_encoder_state *) = NULL;
-    int total;
-    int array = 0;
+/* encodes a table with a registered shape as a map of its fields,
+ * fields set to nil are left out */
+static int etf_131_encoder_shape(etf_131_encoder_state *E, etf_shape *S) {
+    const etf_shape_field *field = NULL;
+    uint8_t header[5];
+    uint32_t total = 0;
+    size_t i;
+    int idx;
+    int r = 0;
+
+    idx = lua_gettop(E->L);
+    if(S->nfields > (size_t)(INT_MAX - idx - 2) || !lua_checkstack(E->L,(int)S->nfields + 2)) {
+        return luaL_error(E->L,"stack overflow");
+    }
+
+    /* a value_map function could replace the shape while it's in use,
+     * this stays set if an error is raised, which only delays freeing it */
+    S->busy++;
+
+    /* stack is: value, names, field values... */
+    lua_rawgeti(E->L,LUA_REGISTRYINDEX,S->names);
+    for(i = 0; i < S->nfields; i++) {
+        lua_rawgeti(E->L,idx + 1,(int)i + 1);
+        lua_rawget(E->L,idx);
+        if(!lua_isnil(E->L,-1)) total++;
+    }
+
+    header[0] = _131_MAP_EXT;
+    pack_uint32be(&header[1],total);
+    E->write(E,header,5);
+
+    for(i = 0; i < S->nfields; i++) {
+        if(lua_isnil(E->L,idx + 2 + (int)i)) continue;
+        field = &S->field[i];
+
+        E->write(E,field->key,field->keylen);
+        lua_pushvalue(E->L,idx + 2 + (int)i);
+        E->key = 0;
+
+        switch(field->type) {
+            case ETF_SHAPE_ATOM: {
+                if(lua_type(E->L,-1) != LUA_TSTRING) goto mismatch;
+                r = lua_rawlen(E->L,-1) > 255 ?
+                  etf_131_encoder_ATOM_UTF8_EXT(E) :
+                  etf_131_encoder_SMALL_ATOM_UTF8_EXT(E);
+                break;
+            }
+            case ETF_SHAPE_BINARY: {
+                if(lua_type(E->L,-1) != LUA_TSTRING) goto mismatch;
+                r = etf_131_encoder_BINARY_EXT(E);
+                break;
+            }
+            case ETF_SHAPE_STRING: {
+                if(lua_type(E->L,-1) != LUA_TSTRING) goto mismatch;
+                r = etf_131_encoder_STRING_EXT(E);
+                break;
+            }
+            case ETF_SHAPE_INTEGER: {
+                if(lua_type(E->L,-1) != LUA_TNUMBER || !lua_isinteger(E->L,-1)) goto mismatch;
+                r = etf_131_encoder_TNUMBER(E);
+                break;
+            }
+            case ETF_SHAPE_FLOAT: {
+                if(lua_type(E->L,-1) != LUA_TNUMBER) goto mismatch;
+                r = etf_131_encoder_NEW_FLOAT_EXT(E,lua_tonumber(E->L,-1));
+                break;
+            }
+            default: r = etf_131_encode(E); break;
+        }
+        if(r) return r;
+        lua_pop(E->L,1);
+    }
+
+    S->busy--;
+    lua_settop(E->L,idx);
+    return 0;
+
+    mismatch:
+    return luaL_error(E->L,"invalid value for shape field %s: %s",
+      field->name,lua_typename(E->L,lua_type(E->L,-1)));
+}
+
+static int etf_131_encoder_table(etf_131_encoder_state *E) {
+    const etf_meta_slot *meta = NULL;
+    size_t n;
+    int r;
 
     if(lua_getmetatable(E->L,-1) != 0) {
-        /* stack is: original value, metatable */
-        lua_getuservalue(E->L,1);
-        /* stack is: original value, metatable, uservalue */
-        lua_getfield(E->L,-1,"mt_map");
-        /* stack is: original value, metatable, uservalue, mt_map */
-        lua_replace(E->L,-2);
-        /* stack is: original value, metatable, mt_map */
-        lua_insert(E->L,lua_gettop(E->L) - 1);
-        /* stack is: original value, mt_map, metatable */
-        lua_gettable(E->L,-2);
-        /* stack is: original value, mt_map, lightuserdata */
-        if(lua_type(E->L,-1) == LUA_TLIGHTUSERDATA) {
-            encode = lua_touserdata(E->L,-1);
+        meta = etf_131_encoder_meta_find(E,lua_topointer(E->L,-1));
+        lua_pop(E->L,1);
+        if(meta != NULL) {
+            if(meta->shape != NULL) return etf_131_encoder_shape(E,meta->shape);
+            return meta->encode(E);
         }
-        lua_pop(E->L,2);
-        if(encode != NULL) return encode(E);
     }
 
     /* no explicit type set, use the following logic:
-     * is_array returns true if (and only if) all keys are
-     * sequential integers starting at 1.
+     * with strict detection, a table is an array if (and only if)
+     * all keys are sequential integers starting at 1.
      * So, { 'a', 'b', 'c' }        -- is an array
      *     { [1] = 'a', [3] = 'c' } -- is not an array
+     * The border (#t) is checked first, a table without one can't be
+     * an array, so maps are only walked while encoding them. Where the
+     * output can be rolled back, lists are checked while encoding them.
      */
 
-    array = is_array(E->L,&total);
-    if(total == 0) {
+    switch(E->arrays) {
+        case ETF_ARRAY_METATABLE: return etf_131_encoder_MAP_EXT(E);
+        case ETF_ARRAY_RAWLEN: {
+            n = lua_rawlen(E->L,-1);
+            if(n > 0) return etf_131_encoder_LIST_EXT(E, (int)n);
+            break;
+        }
+        default: {
+            n = lua_rawlen(E->L,-1);
+            if(n == 0) break;
+            if(E->default_map && (E->write == etf_131_encoder_write || E->write == etf_131_encoder_count)) {
+                r = etf_131_encoder_strict_list(E,n);
+                if(r != -1) return r;
+                break;
+            }
+            if(is_sequence(E->L,n)) return etf_131_encoder_LIST_EXT(E, (int)n);
+            break;
+        }
+    }
+
+    lua_pushnil(E->L);
+    if(lua_next(E->L,-2) == 0) {
         return etf_131_encoder_NIL_EXT(E);
     }
+    lua_pop(E->L,2);
+
+    return etf_131_encoder_MAP_EXT(E);
+}
+
+/* encodes a table, splicing in the cached encoding of memoized tables.
+ * A memoized table's encoding is captured the first time it's encoded
+ * into contiguous output (and not as a map key, where value_map may
+ * treat it differently) */
+static int etf_131_encoder_TTABLE(etf_131_encoder_state *E) {
+    const uint8_t *data = NULL;
+    size_t len = 0;
+    size_t start = 0;
+    int idx;
+    int r;
+
+    /* map keys and atom cache references encode differently, so
+     * neither may use or capture the cached bytes */
+    if(!E->memo || E->key || E->cache != NULL) return etf_131_encoder_table(E);
+
+    idx = lua_gettop(E->L);
+    lua_getuservalue(E->L,1);
+    lua_getfield(E->L,-1,"memo");
+    lua_pushvalue(E->L,idx);
+    lua_rawget(E->L,-2);
+
+    if(lua_type(E->L,-1) == LUA_TSTRING) {
+        data = (const uint8_t *)lua_tolstring(E->L,-1,&len);
+        if(E->refs && E->write == etf_131_encoder_write && len >= E->ref_threshold) {
+            r = etf_131_encoder_write_ref(E,data,len);
+        } else {
+            r = E->write(E,data,len);
+        }
+        lua_settop(E->L,idx);
+        return r;
+    }
 
-    if(array) {
-        return etf_131_encoder_LIST_EXT(E, total);
+    if(lua_isnil(E->L,-1) || E->refs || E->write != etf_131_encoder_write) {
+        lua_settop(E->L,idx);
+        return etf_131_encoder_table(E);
     }
 
-    return etf_131_encoder_MAP_EXT(E, total);
+    /* stack is: table, uservalue, memo, true */
+    lua_pop(E->L,1);
+    lua_pushvalue(E->L,idx);
+    start = E->out->len;
+    r = etf_131_encoder_table(E);
+    if(r) return r;
+
+    /* stack is: table, uservalue, memo, table */
+    lua_pushlstring(E->L,(const char *)&E->out->data[start],E->out->len - start);
+    lua_rawset(E->L,-3);
+    lua_settop(E->L,idx);
+
+    return 0;
 }
 
 #define ETFZLIB _131_ETFZLIB
@@ -3290,28 +4325,56 @@ etf_131_decode(etf_131_decoder_state *D) {
 #undef FUN_EXT
 #undef ATOM_CACHE_REF
 
+/* encodes a string as an atom if the rules say so */
+static int
+etf_131_encoder_TSTRING_rules(etf_131_encoder_state *E) {
+    const uint8_t *data = NULL;
+    size_t len = 0;
+
+    data = (const uint8_t *)lua_tolstring(E->L,-1,&len);
+
+    if( (E->key && E->keys_as_atoms) ||
+        (E->rules != NULL && etf_atom_rules_find(E->rules,data,len)) ) {
+        return len > 255 ? etf_131_encoder_ATOM_UTF8_EXT(E) : etf_131_encoder_SMALL_ATOM_UTF8_EXT(E);
+    }
+
+    return etf_131_encoder_TSTRING(E);
+}
+
 static int
 etf_131_encode(etf_131_encoder_state *E) {
     int type;
     int idx;
 
-    idx = lua_gettop(E->L);
-    lua_getuservalue(E->L,1);
-    lua_getfield(E->L,-1,"value_map");
-    lua_pushvalue(E->L,-3);
-    lua_pushboolean(E->L,E->key);
-    lua_call(E->L,2,1);
+    type = lua_type(E->L,-1);
 
-    lua_insert(E->L,idx);
-    lua_settop(E->L,idx);
+    if(E->default_map && (!E->key || type == LUA_TSTRING)) {
+        /* the default value_map returns values as-is, except booleans,
+         * which become atoms - TBOOLEAN writes those directly */
+    } else if(E->default_map && type == LUA_TNUMBER) {
+        /* same conversion as tostring(), the key is always a copy */
+        lua_tolstring(E->L,-1,NULL);
+        type = LUA_TSTRING;
+    } else {
+        idx = lua_gettop(E->L);
+        lua_getuservalue(E->L,1);
+        lua_getfield(E->L,-1,"value_map");
+        lua_pushvalue(E->L,-3);
+        lua_pushboolean(E->L,E->key);
+        lua_call(E->L,2,1);
 
-    type = lua_type(E->L,-1);
+        lua_insert(E->L,idx);
+        lua_settop(E->L,idx);
+
+        type = lua_type(E->L,-1);
+    }
 
     switch(type) {
         case LUA_TNUMBER: {
             return etf_131_encoder_TNUMBER(E);
         }
         case LUA_TSTRING: {
+            if(E->rules != NULL || E->keys_as_atoms) return etf_131_encoder_TSTRING_rules(E);
             return etf_131_encoder_TSTRING(E);
         }
         case LUA_TTABLE: {
@@ -3320,131 +4383,1673 @@ etf_131_encode(etf_131_encoder_state *E) {
         case LUA_TUSERDATA: {
             return etf_131_encoder_TUSERDATA(E);
         }
-        case LUA_TBOOLEAN: {
-            return etf_131_encoder_TBOOLEAN(E);
+        case LUA_TBOOLEAN: {
+            return etf_131_encoder_TBOOLEAN(E);
+        }
+        case LUA_TNIL: {
+            return etf_131_encoder_TNIL(E);
+        }
+        case LUA_TLIGHTUSERDATA: /* fall-through */
+        case LUA_TFUNCTION: /* fall-through */
+        case LUA_TTHREAD: /* fall-through */
+        default: break;
+    }
+
+    return luaL_error(E->L, "unimplemented lua type: %s",lua_typename(E->L,type));
+}
+
+/* decodes one complete term (version byte included), pushing the value */
+static int
+etf_131_decoder_run(etf_131_decoder_state *D, const uint8_t *data, size_t len) {
+    int ret;
+    uint8_t buffer = 0;
+
+    D->data = data;
+    D->len = len;
+    D->read = etf_131_decoder_read;
+    D->key = 0;
+    D->atoms = 0;
+
+    lua_getuservalue(D->L,1);
+    D->uv = lua_gettop(D->L);
+
+    if(D->rules != NULL) {
+        lua_getfield(D->L,D->uv,"rule_values");
+        D->consts = lua_gettop(D->L);
+    }
+
+    D->read(D,&buffer,1);
+    if(buffer != 131) {
+        return luaL_error(D->L,"invalid ETF version %d", buffer);
+    }
+
+    ret = etf_131_decode(D);
+
+    if(ret == 1 && D->len != 0) {
+        return luaL_error(D->L,"decoder did not consume all bytes, %d remaining",D->len);
+    }
+
+    return ret;
+}
+
+/* reads a {packet,N} length header */
+static size_t
+etf_131_decoder_packet_len(etf_131_decoder_state *D, const uint8_t *data) {
+    switch(D->packet) {
+        case 1: return data[0];
+        case 2: return unpack_uint16be(data);
+        case 4: return unpack_uint32be(data);
+        default: break;
+    }
+    return 0;
+}
+
+static int
+etf_131_decoder_decode(lua_State *L) {
+    etf_131_decoder_state *D = NULL;
+    const uint8_t *data = NULL;
+    size_t len = 0;
+    size_t plen = 0;
+
+    D = luaL_checkudata(L,1,etf_131_decoder_mt);
+    data = (const uint8_t *)luaL_checklstring(L,2,&len);
+
+    D->L = L;
+
+    if(D->packet) {
+        if(len < D->packet) {
+            return luaL_error(L,"incomplete {packet,%d} header",(int)D->packet);
+        }
+        plen = etf_131_decoder_packet_len(D,data);
+        data += D->packet;
+        len -= D->packet;
+        if(plen != len) {
+            return luaL_error(L,"packet length %d does not match data length %d",(int)plen,(int)len);
+        }
+    }
+
+    return etf_131_decoder_run(D,data,len);
+}
+
+/* decodes a single packet, called under lua_pcall by decode_packets
+ * with the decoder, a pointer to the packet, and its length */
+static int
+etf_131_decoder_decode_packet(lua_State *L) {
+    etf_131_decoder_state *D = (etf_131_decoder_state *)lua_touserdata(L,1);
+    const uint8_t *data = (const uint8_t *)lua_touserdata(L,2);
+    size_t len = (size_t)lua_tointeger(L,3);
+
+    lua_settop(L,1);
+    D->L = L;
+    return etf_131_decoder_run(D,data,len);
+}
+
+static int
+etf_131_decoder_decode_packets(lua_State *L) {
+    int n = 0;
+    int r;
+    etf_131_decoder_state *D = NULL;
+    etf_buffer *buf = NULL;
+    const uint8_t *data = NULL;
+    size_t len = 0;
+    size_t plen = 0;
+    size_t consumed = 0;
+
+    D = luaL_checkudata(L,1,etf_131_decoder_mt);
+    if(!D->packet) {
+        return luaL_error(L,"decoder was not created with a packet size");
+    }
+
+    if(lua_type(L,2) == LUA_TSTRING) {
+        data = (const uint8_t *)lua_tolstring(L,2,&len);
+    } else {
+        buf = etf_checkbuffer(L,2);
+        data = buf->data;
+        len = buf->len;
+        /* packets are decoded in place, an atom_map function mustn't be
+         * able to move or change the data underneath the decoder */
+        buf->locked = 1;
+    }
+    lua_settop(L,2);
+    lua_newtable(L);
+
+    while(len - consumed >= D->packet) {
+        plen = etf_131_decoder_packet_len(D,&data[consumed]);
+        if(len - consumed - D->packet < plen) break;
+
+        lua_pushcfunction(L,etf_131_decoder_decode_packet);
+        lua_pushvalue(L,1);
+        lua_pushlightuserdata(L,(void *)&data[consumed + D->packet]);
+        lua_pushinteger(L,(lua_Integer)plen);
+        r = lua_pcall(L,3,1,0);
+        D->L = L;
+        if(r != 0) {
+            /* hand back what was decoded so far, the bad packet is
+             * reported on the next call */
+            if(n > 0) break;
+            /* drop the bad packet so the stream doesn't stall on it */
+            if(buf != NULL) {
+                buf->locked = 0;
+                etf_buffer_consume(buf,consumed + D->packet + plen);
+            }
+            return lua_error(L);
+        }
+        lua_rawseti(L,3,++n);
+        consumed += D->packet + plen;
+    }
+    lua_settop(L,3);
+
+    /* drop the decoded packets, leaving any partial packet in the buffer */
+    if(buf != NULL) {
+        buf->locked = 0;
+        etf_buffer_consume(buf,consumed);
+    }
+
+    lua_pushinteger(L,(lua_Integer)consumed);
+    return 2;
+}
+
+/* reads the atom cache part of a distribution header into a new table
+ * of atom names, indexed by reference + 1, updating the cache (whose
+ * uservalue is at uv) with any new entries. The header length is
+ * stored in hlen */
+static int
+etf_131_decoder_dist_header(lua_State *L, etf_atom_cache *C, int uv, const uint8_t *data, size_t len, size_t *hlen) {
+    const uint8_t *flags = NULL;
+    size_t pos = 0;
+    size_t nrefs;
+    size_t index;
+    size_t n;
+    size_t i;
+    uint8_t half;
+    uint8_t longatoms;
+
+    if(len < 1) return luaL_error(L,"truncated distribution header");
+    nrefs = data[pos++];
+    lua_createtable(L,(int)nrefs,0);
+    if(nrefs == 0) {
+        *hlen = pos;
+        return 0;
+    }
+
+    if(len - pos < nrefs / 2 + 1) return luaL_error(L,"truncated distribution header");
+    flags = &data[pos];
+    pos += nrefs / 2 + 1;
+    longatoms = (flags[nrefs / 2] >> (4 * (nrefs & 1))) & 1;
+
+    for(i = 0; i < nrefs; i++) {
+        half = (flags[i / 2] >> (4 * (i & 1))) & 0x0F;
+        if(len - pos < 1) return luaL_error(L,"truncated distribution header");
+        index = ((size_t)(half & 7) << 8) | data[pos++];
+
+        if(half & 8) {
+            if(len - pos < (size_t)(longatoms ? 2 : 1)) return luaL_error(L,"truncated distribution header");
+            n = longatoms ? unpack_uint16be(&data[pos]) : data[pos];
+            pos += longatoms ? 2 : 1;
+            if(len - pos < n) return luaL_error(L,"truncated distribution header");
+
+            lua_pushlstring(L,(const char *)&data[pos],n);
+            C->entry[index].name = lua_tostring(L,-1);
+            C->entry[index].len = n;
+            lua_pushvalue(L,-1);
+            lua_rawseti(L,uv,(int)index + 1);
+            pos += n;
+        } else {
+            if(C->entry[index].name == NULL) {
+                return luaL_error(L,"reference to unset atom cache entry %d",(int)index);
+            }
+            lua_rawgeti(L,uv,(int)index + 1);
+        }
+        lua_rawseti(L,-2,(int)i + 1);
+    }
+
+    *hlen = pos;
+    return 0;
+}
+
+/* decodes the control message and optional message that follow a
+ * distribution header, using the atom names table on top of the stack */
+static int
+etf_131_decoder_dist_terms(etf_131_decoder_state *D, const uint8_t *data, size_t len) {
+    int n = 0;
+    int r;
+
+    D->atoms = lua_gettop(D->L);
+    D->data = data;
+    D->len = len;
+    D->read = etf_131_decoder_read;
+    D->key = 0;
+
+    lua_getuservalue(D->L,1);
+    D->uv = lua_gettop(D->L);
+
+    if(D->rules != NULL) {
+        lua_getfield(D->L,D->uv,"rule_values");
+        D->consts = lua_gettop(D->L);
+    }
+
+    while(n < 2 && D->len) {
+        D->key = 0;
+        if( (r = etf_131_decode(D)) != 1) return r;
+        lua_insert(D->L,D->atoms);
+        D->atoms++;
+        D->uv++;
+        if(D->rules != NULL) D->consts++;
+        n++;
+    }
+
+    if(n == 0) return luaL_error(D->L,"distribution message without a control message");
+    if(D->len != 0) {
+        return luaL_error(D->L,"decoder did not consume all bytes, %d remaining",D->len);
+    }
+
+    lua_settop(D->L,D->atoms - 1);
+    D->atoms = 0;
+    return n;
+}
+
+/* decoder:decode_dist(cache, data)
+ * decodes a distribution message, returning the control message and
+ * the message (if any). Fragments are collected in the cache, nothing
+ * is returned until the last fragment of a message arrives */
+static int
+etf_131_decoder_decode_dist(lua_State *L) {
+    etf_131_decoder_state *D = NULL;
+    etf_atom_cache *C = NULL;
+    const uint8_t *data = NULL;
+    size_t len = 0;
+    size_t plen = 0;
+    size_t pos = 0;
+    uint64_t fragid;
+    uint8_t next[8];
+    const char *expected = NULL;
+    size_t i;
+    size_t n;
+    int state;
+    int r;
+    luaL_Buffer b;
+
+    D = luaL_checkudata(L,1,etf_131_decoder_mt);
+    C = luaL_checkudata(L,2,etf_atom_cache_mt);
+    data = (const uint8_t *)luaL_checklstring(L,3,&len);
+    lua_settop(L,3);
+    lua_getuservalue(L,2);
+
+    D->L = L;
+
+    if(D->packet) {
+        if(len < D->packet) {
+            return luaL_error(L,"incomplete {packet,%d} header",(int)D->packet);
+        }
+        plen = etf_131_decoder_packet_len(D,data);
+        data += D->packet;
+        len -= D->packet;
+        if(plen != len) {
+            return luaL_error(L,"packet length %d does not match data length %d",(int)plen,(int)len);
+        }
+        /* an empty packet is a tick */
+        if(len == 0) return 0;
+    }
+
+    if(len < 2 || data[0] != 131) {
+        return luaL_error(L,"invalid distribution message");
+    }
+
+    switch(data[1]) {
+        case _131_DIST_HEADER: {
+            if( (r = etf_131_decoder_dist_header(L,C,4,&data[2],len - 2,&pos)) != 0) return r;
+            pos += 2;
+            return etf_131_decoder_dist_terms(D,&data[pos],len - pos);
+        }
+        case _131_DIST_FRAG_HEADER: /* fall-through */
+        case _131_DIST_FRAG_CONT: break;
+        default: return luaL_error(L,"invalid distribution header %d",(int)data[1]);
+    }
+
+    if(len < 18) return luaL_error(L,"truncated distribution header");
+    fragid = unpack_uint64be(&data[10]);
+    if(fragid == 0) return luaL_error(L,"invalid fragment id");
+
+    /* state for a fragmented message is { names, next, fragments... },
+     * in the cache's fragments table, keyed by sequence id. next is the
+     * id of the next fragment, as the 8 bytes it's sent as */
+    lua_getfield(L,4,"fragments");
+    if(lua_isnil(L,-1)) {
+        lua_pop(L,1);
+        lua_newtable(L);
+        lua_pushvalue(L,-1);
+        lua_setfield(L,4,"fragments");
+    }
+    lua_pushlstring(L,(const char *)&data[2],8);
+
+    if(data[1] == _131_DIST_FRAG_HEADER) {
+        if( (r = etf_131_decoder_dist_header(L,C,4,&data[18],len - 18,&pos)) != 0) return r;
+        pos += 18;
+        if(fragid == 1) {
+            return etf_131_decoder_dist_terms(D,&data[pos],len - pos);
+        }
+
+        /* a peer that starts messages without finishing them can't grow
+         * the state without bound, a restarted sequence replaces its state */
+        lua_pushvalue(L,-2);
+        lua_rawget(L,-4);
+        if(lua_isnil(L,-1)) {
+            if(C->pending >= ETF_DIST_MAX_PENDING) {
+                return luaL_error(L,"too many fragmented messages in progress");
+            }
+            C->pending++;
+        }
+        lua_pop(L,1);
+
+        /* fragid comes off the wire, let the table grow as fragments arrive */
+        lua_newtable(L);
+        lua_insert(L,-2);
+        lua_rawseti(L,-2,1);
+        pack_uint64be(next,fragid - 1);
+        lua_pushlstring(L,(const char *)next,8);
+        lua_rawseti(L,-2,2);
+        lua_pushlstring(L,(const char *)&data[pos],len - pos);
+        lua_rawseti(L,-2,3);
+        /* stack is: ..., fragments, sequence, state */
+        lua_rawset(L,-3);
+        return 0;
+    }
+
+    lua_pushvalue(L,-1);
+    lua_rawget(L,-3);
+    if(!lua_istable(L,-1)) {
+        return luaL_error(L,"fragment for unknown sequence");
+    }
+    lua_rawgeti(L,-1,2);
+    expected = lua_tolstring(L,-1,&n);
+    if(expected == NULL || n != 8 || memcmp(expected,&data[10],8) != 0) {
+        return luaL_error(L,"fragment out of order");
+    }
+    lua_pop(L,1);
+
+    /* stack is: ..., fragments, sequence, state */
+    i = lua_rawlen(L,-1);
+    lua_pushlstring(L,(const char *)&data[18],len - 18);
+    lua_rawseti(L,-2,(int)i + 1);
+
+    if(fragid > 1) {
+        pack_uint64be(next,fragid - 1);
+        lua_pushlstring(L,(const char *)next,8);
+        lua_rawseti(L,-2,2);
+        return 0;
+    }
+
+    /* last fragment, drop the state and decode the whole message */
+    lua_pushvalue(L,-2);
+    lua_pushnil(L);
+    lua_rawset(L,-5);
+    C->pending--;
+
+    state = lua_gettop(L);
+    n = lua_rawlen(L,state);
+    luaL_buffinit(L,&b);
+    for(i = 3; i <= n; i++) {
+        lua_rawgeti(L,state,(int)i);
+        luaL_addvalue(&b);
+    }
+    luaL_pushresult(&b);
+    lua_rawgeti(L,state,1);
+
+    data = (const uint8_t *)lua_tolstring(L,-2,&len);
+    return etf_131_decoder_dist_terms(D,data,len);
+}
+
+static int
+etf_buffer_new(lua_State *L) {
+    size_t n = 0;
+    etf_buffer *buf = NULL;
+
+    if(!lua_isnoneornil(L,1) && !etf_tosize(luaL_checknumber(L,1),&n)) {
+        return luaL_error(L,"invalid buffer size");
+    }
+
+    buf = (etf_buffer *)lua_newuserdata(L,sizeof(etf_buffer));
+    if(buf == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    buf->data = NULL;
+    buf->len = 0;
+    buf->alloc = 0;
+    buf->locked = 0;
+    luaL_setmetatable(L,etf_buffer_mt);
+
+    if(n > 0 && etf_buffer_reserve(buf,n)) {
+        return luaL_error(L,"out of memory");
+    }
+
+    return 1;
+}
+
+static int
+etf_buffer_reserve_method(lua_State *L) {
+    etf_buffer *buf = etf_checkbuffer(L,1);
+    size_t n;
+
+    if(!etf_tosize(luaL_checknumber(L,2),&n)) return luaL_error(L,"invalid buffer size");
+    if(etf_buffer_reserve(buf,n)) return luaL_error(L,"out of memory");
+    lua_settop(L,1);
+    return 1;
+}
+
+static int
+etf_buffer_append_method(lua_State *L) {
+    etf_buffer *buf = etf_checkbuffer(L,1);
+    size_t len = 0;
+    const char *data = luaL_checklstring(L,2,&len);
+
+    if(etf_buffer_append(buf,(const uint8_t *)data,len)) return luaL_error(L,"out of memory");
+    lua_settop(L,1);
+    return 1;
+}
+
+static int
+etf_buffer_clear(lua_State *L) {
+    etf_buffer *buf = etf_checkbuffer(L,1);
+    buf->len = 0;
+    lua_settop(L,1);
+    return 1;
+}
+
+static int
+etf_buffer_len(lua_State *L) {
+    etf_buffer *buf = (etf_buffer *)luaL_checkudata(L,1,etf_buffer_mt);
+    lua_pushinteger(L,(lua_Integer)buf->len);
+    return 1;
+}
+
+static int
+etf_buffer__tostring(lua_State *L) {
+    etf_buffer *buf = (etf_buffer *)luaL_checkudata(L,1,etf_buffer_mt);
+    lua_pushlstring(L,(const char *)buf->data,buf->len);
+    return 1;
+}
+
+static int
+etf_buffer__gc(lua_State *L) {
+    etf_buffer *buf = (etf_buffer *)luaL_checkudata(L,1,etf_buffer_mt);
+    etf_buffer_free(buf);
+    return 0;
+}
+
+/* reads the node atom of a pid, port or reference */
+static int
+etf_131_scan_atom(const uint8_t *data, size_t len, size_t *pos) {
+    size_t n;
+
+    if(*pos >= len) return 1;
+    switch(data[(*pos)++]) {
+        case _131_ATOM_EXT: /* fall-through */
+        case _131_ATOM_UTF8_EXT: {
+            if(len - *pos < 2) return 1;
+            n = 2 + unpack_uint16be(&data[*pos]);
+            break;
+        }
+        case _131_SMALL_ATOM_EXT: /* fall-through */
+        case _131_SMALL_ATOM_UTF8_EXT: {
+            if(len - *pos < 1) return 1;
+            n = 1 + data[*pos];
+            break;
+        }
+        default: return 1;
+    }
+    if(len - *pos < n) return 1;
+    *pos += n;
+    return 0;
+}
+
+/* checks that data holds exactly one complete term (without the version
+ * byte), without creating any Lua values. Nested terms are counted
+ * rather than recursed into. Returns NULL if the term is valid, or
+ * an error message */
+static const char *
+etf_131_scan(const uint8_t *data, size_t len) {
+    size_t pos = 0;
+    size_t pending = 1; /* terms left to read */
+    size_t n = 0;
+    size_t skip;
+
+    while(pending) {
+        pending--;
+        if(pos >= len) return "truncated term";
+
+        skip = 0;
+        switch(data[pos++]) {
+            case _131_NIL_EXT: break;
+            case _131_SMALL_INTEGER_EXT: skip = 1; break;
+            case _131_INTEGER_EXT: skip = 4; break;
+            case _131_NEW_FLOAT_EXT: skip = 8; break;
+            case _131_FLOAT_EXT: skip = 31; break;
+            case _131_ATOM_EXT: /* fall-through */
+            case _131_ATOM_UTF8_EXT: /* fall-through */
+            case _131_STRING_EXT: {
+                if(len - pos < 2) return "truncated term";
+                skip = 2 + unpack_uint16be(&data[pos]);
+                break;
+            }
+            case _131_SMALL_ATOM_EXT: /* fall-through */
+            case _131_SMALL_ATOM_UTF8_EXT: {
+                if(len - pos < 1) return "truncated term";
+                skip = 1 + data[pos];
+                break;
+            }
+            case _131_BINARY_EXT: {
+                if(len - pos < 4) return "truncated term";
+                skip = 4 + (size_t)unpack_uint32be(&data[pos]);
+                break;
+            }
+            case _131_BIT_BINARY_EXT: {
+                if(len - pos < 5) return "truncated term";
+                skip = 5 + (size_t)unpack_uint32be(&data[pos]);
+                break;
+            }
+            case _131_SMALL_BIG_EXT: {
+                if(len - pos < 1) return "truncated term";
+                skip = 2 + data[pos];
+                break;
+            }
+            case _131_LARGE_BIG_EXT: {
+                if(len - pos < 4) return "truncated term";
+                skip = 5 + (size_t)unpack_uint32be(&data[pos]);
+                break;
+            }
+            case _131_SMALL_TUPLE_EXT: {
+                if(len - pos < 1) return "truncated term";
+                n = data[pos];
+                skip = 1;
+                break;
+            }
+            case _131_LARGE_TUPLE_EXT: {
+                if(len - pos < 4) return "truncated term";
+                n = unpack_uint32be(&data[pos]);
+                skip = 4;
+                break;
+            }
+            case _131_LIST_EXT: {
+                if(len - pos < 4) return "truncated term";
+                n = (size_t)unpack_uint32be(&data[pos]) + 1; /* elements and the tail */
+                skip = 4;
+                break;
+            }
+            case _131_MAP_EXT: {
+                if(len - pos < 4) return "truncated term";
+                n = (size_t)unpack_uint32be(&data[pos]) * 2;
+                skip = 4;
+                break;
+            }
+            case _131_EXPORT_EXT: n = 3; break;
+            case _131_FUN_EXT: {
+                /* pid, module, index, uniq and the free variables */
+                if(len - pos < 4) return "truncated term";
+                n = (size_t)unpack_uint32be(&data[pos]) + 4;
+                skip = 4;
+                break;
+            }
+            case _131_NEW_FUN_EXT: {
+                /* size, arity, uniq, index and numfree, followed by
+                 * module, oldindex, olduniq, pid and the free variables */
+                if(len - pos < 29) return "truncated term";
+                n = (size_t)unpack_uint32be(&data[pos + 25]) + 4;
+                skip = 29;
+                break;
+            }
+            case _131_PID_EXT: {
+                if(etf_131_scan_atom(data,len,&pos)) return "invalid node";
+                skip = 9;
+                break;
+            }
+            case _131_NEW_PID_EXT: /* fall-through */
+            case _131_V4_PORT_EXT: {
+                if(etf_131_scan_atom(data,len,&pos)) return "invalid node";
+                skip = 12;
+                break;
+            }
+            case _131_PORT_EXT: /* fall-through */
+            case _131_REFERENCE_EXT: {
+                if(etf_131_scan_atom(data,len,&pos)) return "invalid node";
+                skip = 5;
+                break;
+            }
+            case _131_NEW_PORT_EXT: {
+                if(etf_131_scan_atom(data,len,&pos)) return "invalid node";
+                skip = 8;
+                break;
+            }
+            case _131_NEW_REFERENCE_EXT: /* fall-through */
+            case _131_NEWER_REFERENCE_EXT: {
+                if(len - pos < 2) return "truncated term";
+                skip = 4 * (size_t)unpack_uint16be(&data[pos]);
+                skip += data[pos - 1] == _131_NEW_REFERENCE_EXT ? 1 : 4;
+                pos += 2;
+                if(etf_131_scan_atom(data,len,&pos)) return "invalid node";
+                break;
+            }
+            case _131_ETFZLIB: return "compressed terms can't be embedded";
+            case _131_ATOM_CACHE_REF: return "atom cache references can't be embedded";
+            default: return "unknown tag";
+        }
+
+        if(len - pos < skip) return "truncated term";
+        pos += skip;
+
+        /* every term is at least one byte */
+        if(n > len - pos || pending > len - pos - n) return "truncated term";
+        pending += n;
+        n = 0;
+    }
+
+    if(pos != len) return "trailing bytes after term";
+    return NULL;
+}
+
+/* etf.raw(bytes)
+ * wraps an already-encoded term, with or without the version byte.
+ * the term is validated once here and copied as-is by the encoder */
+static int
+etf_raw_new(lua_State *L) {
+    etf_raw *raw = NULL;
+    const uint8_t *data = NULL;
+    const char *err = NULL;
+    size_t len = 0;
+
+    data = (const uint8_t *)luaL_checklstring(L,1,&len);
+    if(len > 0 && data[0] == 131) {
+        data++;
+        len--;
+    }
+
+    err = etf_131_scan(data,len);
+    if(err != NULL) return luaL_error(L,"invalid raw term: %s",err);
+
+    raw = (etf_raw *)lua_newuserdata(L,sizeof(etf_raw) + len);
+    if(raw == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    raw->len = len;
+    memcpy(raw->data,data,len);
+    luaL_setmetatable(L,etf_raw_mt);
+
+    return 1;
+}
+
+static int
+etf_raw_len(lua_State *L) {
+    etf_raw *raw = (etf_raw *)luaL_checkudata(L,1,etf_raw_mt);
+    lua_pushinteger(L,(lua_Integer)raw->len);
+    return 1;
+}
+
+/* returns the term with the version byte, ready for etf.decode */
+static int
+etf_raw__tostring(lua_State *L) {
+    etf_raw *raw = (etf_raw *)luaL_checkudata(L,1,etf_raw_mt);
+    luaL_Buffer b;
+
+    luaL_buffinit(L,&b);
+    luaL_addchar(&b,(char)131);
+    luaL_addlstring(&b,(const char *)raw->data,raw->len);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/* etf.atom_cache()
+ * an atom cache for one direction of a distribution connection, the
+ * cached atom names are anchored in the uservalue */
+static int
+etf_atom_cache_new(lua_State *L) {
+    etf_atom_cache *C = NULL;
+
+    C = (etf_atom_cache *)lua_newuserdata(L,sizeof(etf_atom_cache));
+    if(C == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    memset(C->entry,0,sizeof(C->entry));
+    memset(C->seen,0,sizeof(C->seen));
+    C->gen = 0;
+    C->nrefs = 0;
+    C->sequence = 0;
+    C->pending = 0;
+    C->names.data = NULL;
+    C->names.len = 0;
+    C->names.alloc = 0;
+    C->names.locked = 0;
+    C->header.data = NULL;
+    C->header.len = 0;
+    C->header.alloc = 0;
+    C->header.locked = 0;
+    luaL_setmetatable(L,etf_atom_cache_mt);
+
+    lua_createtable(L,0,1);
+    lua_setuservalue(L,-2);
+
+    return 1;
+}
+
+static int
+etf_atom_cache__gc(lua_State *L) {
+    etf_atom_cache *C = (etf_atom_cache *)luaL_checkudata(L,1,etf_atom_cache_mt);
+    etf_buffer_free(&C->names);
+    etf_buffer_free(&C->header);
+    return 0;
+}
+
+/* the deflate state is kept around and reset between calls, it's only
+ * re-initialized if the compression level changes */
+static int
+etf_131_encoder_deflate_begin(etf_131_encoder_state *E, int level) {
+    int r;
+
+    if(E->zlevel == level) return mz_deflateReset(&E->strm);
+
+    if(E->zlevel != ETF_NO_COMPRESSION) {
+        mz_deflateEnd(&E->strm);
+        E->zlevel = ETF_NO_COMPRESSION;
+    }
+
+    E->strm.zalloc = NULL;
+    E->strm.zfree = NULL;
+    E->strm.opaque = NULL;
+    if( (r = mz_deflateInit(&E->strm,level)) != 0) return r;
+    E->zlevel = level;
+    return 0;
+}
+
+/* writes a {packet,N} length prefix */
+static int
+etf_131_encoder_packet_header(etf_131_encoder_state *E, uint8_t *dest, size_t len) {
+    if(E->packet < 4 && len >= ((size_t)1 << (8 * E->packet))) {
+        return luaL_error(E->L,"encoded term too large for {packet,%d}",(int)E->packet);
+    }
+    if(len > UINT32_MAX) {
+        return luaL_error(E->L,"encoded term too large for {packet,%d}",(int)E->packet);
+    }
+    switch(E->packet) {
+        case 1: dest[0] = (uint8_t)len; break;
+        case 2: pack_uint16be(dest,(uint16_t)len); break;
+        case 4: pack_uint32be(dest,(uint32_t)len); break;
+        default: break;
+    }
+    return 0;
+}
+
+/* encodes the value at idx as a complete term (version byte included,
+ * along with any packet header), appending it to E->out */
+static int
+etf_131_encoder_run(etf_131_encoder_state *E, int idx) {
+    int r;
+    int compressLevel = 0;
+    uint8_t header[10];
+    size_t headerlen;
+    size_t start;
+    size_t reflen;
+    int top;
+    uint8_t *h;
+    lua_State *L = E->L;
+
+    E->key = 0;
+    start = E->out->len;
+    reflen = E->reflen;
+    headerlen = E->packet;
+    h = &header[headerlen];
+    h[0] = 131;
+    headerlen++;
+
+    compressLevel = E->compress;
+
+    if(compressLevel != ETF_NO_COMPRESSION) {
+        headerlen += 5;
+        h[1] = _131_ETFZLIB;
+    }
+
+    if(E->sink && (compressLevel != ETF_NO_COMPRESSION || E->packet)) {
+        if(compressLevel != ETF_NO_COMPRESSION && E->packet) {
+            return luaL_error(L,"compressed terms can't be streamed with a packet header");
+        }
+        /* output may already be flushed by the time we'd patch the
+         * header, so find the length up-front */
+        E->count = 0;
+        E->write = etf_131_encoder_count;
+        top = lua_gettop(L);
+        lua_pushvalue(L,idx);
+        if( (r = etf_131_encode(E)) != 0)  return r;
+        lua_settop(L,top);
+        E->key = 0;
+        if(compressLevel != ETF_NO_COMPRESSION) {
+            pack_uint32be(&h[2], (uint32_t)E->count);
+        } else {
+            etf_131_encoder_packet_header(E,header,E->count + 1);
+        }
+    }
+    /* otherwise lengths aren't known yet, we patch the header in at the end */
+
+    if(compressLevel == ETF_NO_COMPRESSION) {
+        E->write = E->sink ? etf_131_encoder_write_stream : etf_131_encoder_write;
+    } else {
+        if( (r = etf_131_encoder_deflate_begin(E,compressLevel)) != 0) {
+            return luaL_error(L,"error with deflateInit: %d",r);
+        }
+        E->write = etf_131_encoder_writez;
+    }
+
+    if(etf_buffer_append(E->out,header,headerlen)) {
+        return luaL_error(L,"out of memory");
+    }
+
+    top = lua_gettop(L);
+    lua_pushvalue(L,idx);
+
+    if( (r = etf_131_encode(E)) != 0)  return r;
+    lua_settop(L,top);
+
+    if(compressLevel != ETF_NO_COMPRESSION) {
+        do {
+            if( (r = etf_131_encoder_deflate_out(E)) != 0) return r;
+            r = mz_deflate(&E->strm, MZ_FINISH);
+            if(!(r == MZ_OK || r == MZ_STREAM_END)) {
+                return luaL_error(L,"error flushing compressed stream");
+            }
+            E->out->len = (size_t)(E->strm.next_out - E->out->data);
+        } while (r != MZ_STREAM_END);
+
+        if(E->sink) {
+            if(E->strm.total_in != E->count) {
+                return luaL_error(L,"value changed while encoding");
+            }
+        } else {
+            pack_uint32be(&h[2], (uint32_t)E->strm.total_in);
+        }
+    }
+
+    if(E->sink) {
+        if(E->packet && E->flushed + E->out->len != E->count + 1 + E->packet) {
+            return luaL_error(L,"value changed while encoding");
+        }
+        etf_131_encoder_flush(E);
+    } else {
+        if(E->packet) {
+            /* referenced binaries aren't in E->out but still count towards the length */
+            etf_131_encoder_packet_header(E,header,
+              E->out->len - start - E->packet + (E->reflen - reflen));
+        }
+        memcpy(&E->out->data[start],header,headerlen);
+    }
+
+    return 0;
+}
+
+/* clears per-call state, every entry point calls this first so nothing
+ * from a call that raised an error (a sink, a buffer, an atom cache)
+ * is picked up by the next one */
+static void
+etf_131_encoder_reset(etf_131_encoder_state *E, lua_State *L) {
+    E->L = L;
+    E->out = &E->arena;
+    E->sink = 0;
+    E->refs = 0;
+    E->cache = NULL;
+}
+
+static int
+etf_131_encoder_encode(lua_State *L) {
+    int r;
+    etf_131_encoder_state *E = NULL;
+
+    E = luaL_checkudata(L,1,etf_131_encoder_mt);
+    if(lua_isnone(L,2)) {
+        return luaL_error(L,"need value to encode");
+    }
+
+    etf_131_encoder_reset(E,L);
+    etf_buffer_shrink(&E->arena,E->arena_max);
+
+    if( (r = etf_131_encoder_run(E,2)) != 0) return r;
+
+    lua_pushlstring(L,(const char *)E->arena.data,E->arena.len);
+    etf_buffer_shrink(&E->arena,E->arena_max);
+
+    return 1;
+}
+
+static int
+etf_131_encoder_size(lua_State *L) {
+    int r;
+    etf_131_encoder_state *E = NULL;
+
+    E = luaL_checkudata(L,1,etf_131_encoder_mt);
+    if(lua_isnone(L,2)) {
+        return luaL_error(L,"need value to size");
+    }
+    lua_settop(L,2);
+
+    etf_131_encoder_reset(E,L);
+    E->key = 0;
+    E->count = 1 + E->packet; /* version byte and packet header */
+    E->write = etf_131_encoder_count;
+
+    if( (r = etf_131_encode(E)) != 0) return r;
+
+    lua_pushinteger(L,(lua_Integer)E->count);
+    return 1;
+}
+
+static int
+etf_131_encoder_encode_stream(lua_State *L) {
+    int r;
+    etf_131_encoder_state *E = NULL;
+
+    E = luaL_checkudata(L,1,etf_131_encoder_mt);
+    if(lua_isnone(L,2)) {
+        return luaL_error(L,"need value to encode");
+    }
+    lua_settop(L,4);
+
+    E->chunk = ETF_DEFAULT_CHUNK_LEN;
+    if(!lua_isnil(L,4)) {
+        if(!etf_tosize(luaL_checknumber(L,4),&E->chunk) || E->chunk < 1) {
+            return luaL_error(L,"invalid chunk size");
+        }
+    }
+
+    /* the sink is either a function, or an object with a write method (like a file) */
+    if(lua_isfunction(L,3)) {
+        lua_pushvalue(L,3);
+        lua_pushnil(L);
+        E->sink_self = 0;
+    } else if(!lua_isnil(L,3)) {
+        lua_getfield(L,3,"write");
+        if(!lua_isfunction(L,-1)) {
+            return luaL_error(L,"sink must be a function or have a write method");
+        }
+        lua_pushvalue(L,3);
+        E->sink_self = 1;
+    } else {
+        return luaL_error(L,"need a sink");
+    }
+
+    etf_131_encoder_reset(E,L);
+    E->sink = 5;
+    E->flushed = 0;
+    etf_buffer_shrink(&E->arena,E->arena_max);
+
+    if( (r = etf_131_encoder_run(E,2)) != 0) return r;
+    E->sink = 0;
+
+    etf_buffer_shrink(&E->arena,E->arena_max);
+
+    lua_pushinteger(L,(lua_Integer)E->flushed);
+    return 1;
+}
+
+/* encodes the value at idx into a list of segments, pushes the pin
+ * table (or nil) onto the stack */
+static int
+etf_131_encoder_run_segmented(etf_131_encoder_state *E, int idx) {
+    int r;
+
+    lua_pushnil(E->L);
+
+    etf_131_encoder_reset(E,E->L);
+    E->pins = lua_gettop(E->L);
+    E->npins = 0;
+    E->nsegs = 0;
+    E->segstart = 0;
+    E->refs = 1;
+    etf_buffer_shrink(&E->arena,E->arena_max);
+
+    r = etf_131_encoder_run(E,idx);
+    E->refs = 0;
+    E->cache = NULL;
+    if(r != 0) return r;
+
+    return etf_131_encoder_close_segment(E);
+}
+
+static int
+etf_131_encoder_encode_segments(lua_State *L) {
+    int r;
+    size_t i;
+    etf_131_encoder_state *E = NULL;
+
+    E = luaL_checkudata(L,1,etf_131_encoder_mt);
+    if(lua_isnone(L,2)) {
+        return luaL_error(L,"need value to encode");
+    }
+    lua_settop(L,2);
+
+    E->L = L;
+    if( (r = etf_131_encoder_run_segmented(E,2)) != 0) return r;
+
+    lua_createtable(L,(int)E->nsegs,0);
+    for(i=0;i<E->nsegs;i++) {
+        if(E->segs[i].ref != NULL) {
+            lua_rawgeti(L,E->pins,(int)E->segs[i].offset);
+        } else {
+            lua_pushlstring(L,(const char *)&E->arena.data[E->segs[i].offset],E->segs[i].len);
+        }
+        lua_rawseti(L,-2,(int)i+1);
+    }
+
+    etf_buffer_shrink(&E->arena,E->arena_max);
+
+    return 1;
+}
+
+#if defined(ETF_HAVE_WRITEV)
+/* writes out all segments with writev, handling partial writes. The
+ * number of bytes written is stored in written */
+static int
+etf_131_encoder_writev(etf_131_encoder_state *E, int fd, size_t *written) {
+    struct iovec iov[ETF_IOV_MAX];
+    const uint8_t *base;
+    size_t i = 0; /* first segment not fully written */
+    size_t skip = 0; /* bytes of segment i already written */
+    size_t total = 0;
+    size_t j;
+    size_t w;
+    ssize_t r;
+    int n;
+
+    while(i < E->nsegs) {
+        n = 0;
+        for(j = i; j < E->nsegs && n < ETF_IOV_MAX; j++, n++) {
+            base = E->segs[j].ref != NULL ? E->segs[j].ref : &E->out->data[E->segs[j].offset];
+            iov[n].iov_base = (void *)base;
+            iov[n].iov_len = E->segs[j].len;
+        }
+        iov[0].iov_base = (void *)(((const uint8_t *)iov[0].iov_base) + skip);
+        iov[0].iov_len -= skip;
+
+        r = writev(fd,iov,n);
+        if(r < 0) {
+            if(errno == EINTR) continue;
+            return luaL_error(E->L,"error writing to fd %d: %s",fd,strerror(errno));
+        }
+        total += (size_t)r;
+
+        w = (size_t)r;
+        while(w && i < E->nsegs) {
+            if(w >= E->segs[i].len - skip) {
+                w -= E->segs[i].len - skip;
+                skip = 0;
+                i++;
+            } else {
+                skip += w;
+                w = 0;
+            }
+        }
+    }
+
+    *written = total;
+    return 0;
+}
+#endif
+
+static int
+etf_131_encoder_encode_to_fd(lua_State *L) {
+#if defined(ETF_HAVE_WRITEV)
+    int r;
+    int fd;
+    FILE *f = NULL;
+    size_t total = 0;
+    etf_131_encoder_state *E = NULL;
+
+    E = luaL_checkudata(L,1,etf_131_encoder_mt);
+    if(lua_isnumber(L,2)) {
+        fd = (int)lua_tointeger(L,2);
+    } else {
+#if LUA_VERSION_NUM >= 502
+        /* closing a handle clears closef, the FILE pointer is left as-is */
+        luaL_Stream *p = (luaL_Stream *)luaL_checkudata(L,2,LUA_FILEHANDLE);
+        if(p->closef == NULL) return luaL_error(L,"attempt to use a closed file");
+        f = p->f;
+#else
+        f = *(FILE **)luaL_checkudata(L,2,LUA_FILEHANDLE);
+        if(f == NULL) return luaL_error(L,"attempt to use a closed file");
+#endif
+        /* make sure anything already buffered on the handle goes out first */
+        fflush(f);
+        fd = fileno(f);
+    }
+    if(lua_isnone(L,3)) {
+        return luaL_error(L,"need value to encode");
+    }
+    lua_settop(L,3);
+
+    E->L = L;
+    if( (r = etf_131_encoder_run_segmented(E,3)) != 0) return r;
+
+    if( (r = etf_131_encoder_writev(E,fd,&total)) != 0) return r;
+
+    etf_buffer_shrink(&E->arena,E->arena_max);
+
+    lua_pushinteger(L,(lua_Integer)total);
+    return 1;
+#else
+    return luaL_error(L,"encode_to_fd is not supported on this platform");
+#endif
+}
+
+static int
+etf_131_encoder_encode_many(lua_State *L) {
+    int r;
+    int concat;
+    size_t i;
+    size_t n;
+    etf_131_encoder_state *E = NULL;
+
+    E = luaL_checkudata(L,1,etf_131_encoder_mt);
+    luaL_checktype(L,2,LUA_TTABLE);
+    concat = lua_toboolean(L,3);
+    lua_settop(L,2);
+
+    n = lua_rawlen(L,2);
+
+    etf_131_encoder_reset(E,L);
+    etf_buffer_shrink(&E->arena,E->arena_max);
+
+    /* with concat, returns one string and an array of n + 1 offsets,
+     * value i is at str:sub(offsets[i], offsets[i+1] - 1) */
+    lua_createtable(L,(int)(n + concat),0);
+
+    for(i=1;i<=n;i++) {
+        if(concat) {
+            lua_pushinteger(L,(lua_Integer)(E->arena.len + 1));
+            lua_rawseti(L,3,(int)i);
+        } else {
+            E->arena.len = 0;
+        }
+
+        lua_rawgeti(L,2,(int)i);
+        if( (r = etf_131_encoder_run(E,4)) != 0) return r;
+
+        if(!concat) {
+            lua_pushlstring(L,(const char *)E->arena.data,E->arena.len);
+            lua_rawseti(L,3,(int)i);
+        }
+        lua_settop(L,3);
+    }
+
+    if(concat) {
+        lua_pushinteger(L,(lua_Integer)(E->arena.len + 1));
+        lua_rawseti(L,3,(int)n + 1);
+        lua_pushlstring(L,(const char *)E->arena.data,E->arena.len);
+        lua_insert(L,3);
+    }
+
+    etf_buffer_shrink(&E->arena,E->arena_max);
+
+    return concat ? 2 : 1;
+}
+
+/* builds the atom cache part of a distribution header (everything after
+ * the tag) for the message just encoded into C->header, then stores the
+ * new entries in the cache, whose uservalue is at uv */
+static int
+etf_131_encoder_dist_header(lua_State *L, etf_atom_cache *C, int uv) {
+    uint8_t flags[ETF_ATOM_CACHE_REFS / 2 + 1];
+    uint8_t buf[3];
+    etf_atom_cache_ref *ref = NULL;
+    uint8_t longatoms = 0;
+    size_t nflags;
+    size_t n;
+    size_t i;
+
+    C->header.len = 0;
+    buf[0] = (uint8_t)C->nrefs;
+    if(etf_buffer_append(&C->header,buf,1)) return luaL_error(L,"out of memory");
+    if(C->nrefs == 0) return 0;
+
+    for(i = 0; i < C->nrefs; i++) {
+        if(C->refs[i].isnew && C->refs[i].len > UINT8_MAX) longatoms = 1;
+    }
+
+    /* a half byte per reference (NewCacheEntryFlag and SegmentIndex), even
+     * references in the low half, followed by one for the LongAtoms flag */
+    nflags = C->nrefs / 2 + 1;
+    memset(flags,0,nflags);
+    for(i = 0; i < C->nrefs; i++) {
+        ref = &C->refs[i];
+        flags[i / 2] |= (uint8_t)(((ref->isnew ? 8 : 0) | (ref->index >> 8)) << (4 * (i & 1)));
+    }
+    flags[C->nrefs / 2] |= (uint8_t)(longatoms << (4 * (C->nrefs & 1)));
+    if(etf_buffer_append(&C->header,flags,nflags)) return luaL_error(L,"out of memory");
+
+    for(i = 0; i < C->nrefs; i++) {
+        ref = &C->refs[i];
+        buf[0] = (uint8_t)(ref->index & 0xFF);
+        n = 1;
+        if(ref->isnew) {
+            if(longatoms) {
+                pack_uint16be(&buf[1],(uint16_t)ref->len);
+                n = 3;
+            } else {
+                buf[1] = (uint8_t)ref->len;
+                n = 2;
+            }
         }
-        case LUA_TNIL: {
-            return etf_131_encoder_TNIL(E);
+        if(etf_buffer_append(&C->header,buf,n)) return luaL_error(L,"out of memory");
+        if(ref->isnew && etf_buffer_append(&C->header,&C->names.data[ref->offset],ref->len)) {
+            return luaL_error(L,"out of memory");
         }
-        case LUA_TLIGHTUSERDATA: /* fall-through */
-        case LUA_TFUNCTION: /* fall-through */
-        case LUA_TTHREAD: /* fall-through */
-        default: break;
     }
 
-    return luaL_error(E->L, "unimplemented lua type: %s",lua_typename(E->L,type));
+    for(i = 0; i < C->nrefs; i++) {
+        ref = &C->refs[i];
+        if(!ref->isnew) continue;
+        lua_pushlstring(L,(const char *)&C->names.data[ref->offset],ref->len);
+        C->entry[ref->index].name = lua_tostring(L,-1);
+        C->entry[ref->index].len = ref->len;
+        lua_rawseti(L,uv,ref->index + 1);
+    }
+
+    return 0;
 }
 
+/* pushes one distribution message (or fragment) as a string */
+static void
+etf_131_encoder_push_dist(etf_131_encoder_state *E, const uint8_t *head, size_t headlen,
+  const uint8_t *header, size_t headerlen, const uint8_t *data, size_t len) {
+    uint8_t packet[4];
+    luaL_Buffer b;
+
+    if(E->packet) {
+        etf_131_encoder_packet_header(E,packet,headlen + headerlen + len);
+    }
+
+    luaL_buffinit(E->L,&b);
+    luaL_addlstring(&b,(const char *)packet,E->packet);
+    luaL_addlstring(&b,(const char *)head,headlen);
+    luaL_addlstring(&b,(const char *)header,headerlen);
+    luaL_addlstring(&b,(const char *)data,len);
+    luaL_pushresult(&b);
+}
+
+/* encoder:encode_dist(cache, control[, message[, fragment_size]])
+ * encodes a distribution message, with atoms sent as atom cache
+ * references. With a fragment_size, returns an array of fragments */
 static int
-etf_131_decoder_decode(lua_State *L) {
-    int ret;
-    etf_131_decoder_state *D = NULL;
-    const uint8_t *data = NULL;
-    size_t len = 0;
-    uint8_t buffer = 0;
+etf_131_encoder_encode_dist(lua_State *L) {
+    etf_131_encoder_state *E = NULL;
+    etf_atom_cache *C = NULL;
+    uint8_t head[18];
+    size_t fragment = 0;
+    size_t nfrags;
+    size_t i;
+    int message;
+    int r;
 
-    D = luaL_checkudata(L,1,etf_131_decoder_mt);
-    data = (const uint8_t *)luaL_checklstring(L,2,&len);
+    E = luaL_checkudata(L,1,etf_131_encoder_mt);
+    C = luaL_checkudata(L,2,etf_atom_cache_mt);
+    if(lua_isnone(L,3)) {
+        return luaL_error(L,"need control message to encode");
+    }
+    message = !lua_isnoneornil(L,4);
+    if(!lua_isnoneornil(L,5)) {
+        if(!etf_tosize(luaL_checknumber(L,5),&fragment) || fragment < 1) {
+            return luaL_error(L,"invalid fragment size");
+        }
+    }
+    lua_settop(L,5);
+    lua_getuservalue(L,2);
 
-    D->L = L;
-    D->data = data;
-    D->len = len;
-    D->read = etf_131_decoder_read;
-    D->key = 0;
+    etf_131_encoder_reset(E,L);
+    etf_buffer_shrink(&E->arena,E->arena_max);
 
-    D->read(D,&buffer,1);
-    if(buffer != 131) {
-        return luaL_error(L,"invalid ETF version %d", buffer);
+    /* start a new message */
+    if(++C->gen == 0) {
+        memset(C->seen,0,sizeof(C->seen));
+        C->gen = 1;
     }
+    C->nrefs = 0;
+    C->names.len = 0;
 
-    ret = etf_131_decode(D);
+    /* with an atom cache the terms don't have version bytes */
+    E->cache = C;
+    E->write = etf_131_encoder_write;
+    for(i = 3; i <= (size_t)(message ? 4 : 3); i++) {
+        E->key = 0;
+        lua_pushvalue(L,(int)i);
+        if( (r = etf_131_encode(E)) != 0) return r;
+        lua_settop(L,6);
+    }
+    E->cache = NULL;
 
-    if(ret == 1 && D->len != 0) {
-        return luaL_error(L,"decoder did not consume all bytes, %d remaining",D->len);
+    if( (r = etf_131_encoder_dist_header(L,C,6)) != 0) return r;
+
+    head[0] = 131;
+    if(fragment == 0 || E->arena.len <= fragment) {
+        head[1] = _131_DIST_HEADER;
+        etf_131_encoder_push_dist(E,head,2,C->header.data,C->header.len,E->arena.data,E->arena.len);
+        if(fragment != 0) {
+            lua_createtable(L,1,0);
+            lua_insert(L,-2);
+            lua_rawseti(L,-2,1);
+        }
+        etf_buffer_shrink(&E->arena,E->arena_max);
+        return 1;
     }
 
-    return ret;
+    /* fragment ids count down to 1, the first fragment carries the header */
+    nfrags = (E->arena.len + fragment - 1) / fragment;
+    C->sequence++;
+    pack_uint64be(&head[2],C->sequence);
+
+    lua_createtable(L,(int)nfrags,0);
+    for(i = 0; i < nfrags; i++) {
+        head[1] = i == 0 ? _131_DIST_FRAG_HEADER : _131_DIST_FRAG_CONT;
+        pack_uint64be(&head[10],(uint64_t)(nfrags - i));
+        etf_131_encoder_push_dist(E,head,18,
+          C->header.data,i == 0 ? C->header.len : 0,
+          &E->arena.data[i * fragment],i == nfrags - 1 ? E->arena.len - i * fragment : fragment);
+        lua_rawseti(L,-2,(int)i + 1);
+    }
+
+    etf_buffer_shrink(&E->arena,E->arena_max);
+    return 1;
 }
 
 static int
-etf_131_encoder_encode(lua_State *L) {
+etf_131_encoder_encode_into_protected(lua_State *L) {
     int r;
-    int compressLevel = 0;
-    uint8_t header[6];
-    size_t headerlen = 1;
-    size_t i;
+    etf_131_encoder_state *E = (etf_131_encoder_state *)lua_touserdata(L,1);
+
+    etf_131_encoder_reset(E,L);
+    E->out = (etf_buffer *)lua_touserdata(L,2);
+
+    if( (r = etf_131_encoder_run(E,3)) != 0) return r;
+    return 0;
+}
+
+static int
+etf_131_encoder_encode_into(lua_State *L) {
     etf_131_encoder_state *E = NULL;
-    luaL_Buffer buffer;
+    etf_buffer *buf = NULL;
+    size_t start;
+    int r;
 
     E = luaL_checkudata(L,1,etf_131_encoder_mt);
-    if(lua_isnone(L,2)) {
+    buf = etf_checkbuffer(L,2);
+    if(lua_isnone(L,3)) {
         return luaL_error(L,"need value to encode");
     }
-    header[0] = 131;
+    lua_settop(L,3);
+    start = buf->len;
 
-    E->L = L;
-    E->key = 0;
+    /* run the encode in protected mode so a failure part-way through
+     * doesn't leave a partial term in the caller's buffer */
+    lua_pushcfunction(L,etf_131_encoder_encode_into_protected);
+    lua_insert(L,1);
+    r = lua_pcall(L,3,0,0);
+    /* don't hang on to the caller's buffer, it may be collected */
+    E->out = &E->arena;
+    if(r != 0) {
+        buf->len = start;
+        return lua_error(L);
+    }
+
+    lua_pushinteger(L,(lua_Integer)(buf->len - start));
+    return 1;
+}
+
+/* encoder:register_shape(mt, fields)
+ * compiles fields into an encode plan for tables with the metatable mt.
+ * each field is a name, or a table { name, key = 'atom'|'binary',
+ * type = 'atom'|'binary'|'string'|'integer'|'float' } */
+static int
+etf_131_encoder_register_shape(lua_State *L) {
+    static const char * const key_types[] = { "binary", "atom", NULL };
+    static const char * const value_types[] = { "any", "atom", "binary", "string", "integer", "float", NULL };
+    etf_131_encoder_state *E = luaL_checkudata(L,1,etf_131_encoder_mt);
+    const etf_meta_slot *meta = NULL;
+    etf_shape *old = NULL;
+    etf_shape **prev = NULL;
+    etf_shape *S = NULL;
+    etf_shape_field *field = NULL;
+    uint8_t *opts = NULL;
+    const char *name = NULL;
+    uint8_t *p = NULL;
+    size_t nfields = 0;
+    size_t namelen = 0;
+    size_t size = 0;
+    size_t i;
+    int names;
+    int atom;
+
+    luaL_checktype(L,2,LUA_TTABLE);
+    luaL_checktype(L,3,LUA_TTABLE);
+    lua_settop(L,3);
+
+    meta = etf_131_encoder_meta_find(E,lua_topointer(L,2));
+    if(meta != NULL && meta->shape == NULL) {
+        return luaL_error(L,"cannot register a shape for an etf metatable");
+    }
+
+    nfields = lua_rawlen(L,3);
+    if(nfields == 0) return luaL_error(L,"shape requires at least one field");
+    if(nfields > UINT32_MAX) return luaL_error(L,"too many fields");
+
+    /* first pass validates the fields, collects the names and options
+     * (key, type) and sizes the plan, so nothing can fail once the plan
+     * is allocated */
+    opts = (uint8_t *)lua_newuserdata(L,nfields * 2);
+    lua_newtable(L);
+    size = sizeof(etf_shape) + sizeof(etf_shape_field) * (nfields - 1);
+    for(i = 1; i <= nfields; i++) {
+        opts[(i - 1) * 2] = 0xff;
+        opts[(i - 1) * 2 + 1] = ETF_SHAPE_ANY;
+        lua_rawgeti(L,3,(int)i);
+        if(lua_istable(L,-1)) {
+            lua_getfield(L,-1,"key");
+            if(!lua_isnil(L,-1)) opts[(i - 1) * 2] = (uint8_t)luaL_checkoption(L,-1,NULL,key_types);
+            lua_getfield(L,-2,"type");
+            if(!lua_isnil(L,-1)) opts[(i - 1) * 2 + 1] = (uint8_t)luaL_checkoption(L,-1,NULL,value_types);
+            lua_pop(L,2);
+            lua_rawgeti(L,-1,1);
+            lua_replace(L,-2);
+        }
+        if(lua_type(L,-1) != LUA_TSTRING) {
+            return luaL_error(L,"invalid name for shape field %d",(int)i);
+        }
+        namelen = lua_rawlen(L,-1);
+        if(namelen > UINT16_MAX) return luaL_error(L,"shape field name too long");
+        size += (namelen + 1) + (namelen + 5);
+        lua_rawseti(L,5,(int)i);
+    }
 
+    /* anchor the metatable so its address stays unique */
     lua_getuservalue(L,1);
-    lua_getfield(L,-1,"compress");
-    compressLevel = (int)lua_tonumber(L,-1);
+    lua_getfield(L,-1,"shapes");
+    if(lua_isnil(L,-1)) {
+        lua_pop(L,1);
+        lua_newtable(L);
+        lua_pushvalue(L,-1);
+        lua_setfield(L,-3,"shapes");
+    }
+    lua_pushvalue(L,2);
+    lua_pushboolean(L,1);
+    lua_rawset(L,-3);
+    lua_settop(L,5);
+
+    names = luaL_ref(L,LUA_REGISTRYINDEX);
+    S = (etf_shape *)malloc(size);
+    if(S == NULL) {
+        luaL_unref(L,LUA_REGISTRYINDEX,names);
+        return luaL_error(L,"out of memory");
+    }
+    S->names = names;
+    S->busy = 0;
+    S->nfields = nfields;
+    p = (uint8_t *)&S->field[nfields];
+
+    lua_rawgeti(L,LUA_REGISTRYINDEX,names);
+    for(i = 0; i < nfields; i++) {
+        field = &S->field[i];
+        field->type = opts[i * 2 + 1];
+        atom = opts[i * 2] == 0xff ? -1 : opts[i * 2];
+
+        lua_rawgeti(L,-1,(int)i + 1);
+        name = lua_tolstring(L,-1,&namelen);
+
+        memcpy(p,name,namelen);
+        p[namelen] = 0;
+        field->name = (const char *)p;
+        field->namelen = namelen;
+        p += namelen + 1;
+
+        /* keys are encoded the way etf_131_encode would for a plain table */
+        if(atom == -1) {
+            atom = E->keys_as_atoms ||
+              (E->rules != NULL && etf_atom_rules_find(E->rules,(const uint8_t *)name,namelen));
+        }
+
+        field->key = p;
+        if(atom && namelen > 255) {
+            p[0] = _131_ATOM_UTF8_EXT;
+            pack_uint16be(&p[1],(uint16_t)namelen);
+            field->keylen = 3;
+        } else if(atom) {
+            p[0] = _131_SMALL_ATOM_UTF8_EXT;
+            p[1] = (uint8_t)namelen;
+            field->keylen = 2;
+        } else {
+            p[0] = _131_BINARY_EXT;
+            pack_uint32be(&p[1],(uint32_t)namelen);
+            field->keylen = 5;
+        }
+        memcpy(&p[field->keylen],name,namelen);
+        field->keylen += namelen;
+        p += field->keylen;
+
+        lua_pop(L,1);
+    }
     lua_pop(L,1);
 
-    if(compressLevel < -1 || compressLevel > 9) {
-        compressLevel = ETF_NO_COMPRESSION;
+    old = meta != NULL ? meta->shape : NULL;
+    if(etf_131_encoder_meta_add(E,lua_topointer(L,2),NULL,S)) {
+        luaL_unref(L,LUA_REGISTRYINDEX,S->names);
+        free(S);
+        return luaL_error(L,"out of memory");
     }
+    S->next = E->shapes;
+    E->shapes = S;
 
-    if(compressLevel == ETF_NO_COMPRESSION) {
-      E->write = etf_131_encoder_write;
-    } else {
-      E->strm.zalloc = NULL;
-      E->strm.zfree = NULL;
-      E->strm.opaque = NULL;
-      if( (r = mz_deflateInit(&E->strm,compressLevel)) != 0) {
-          return luaL_error(L,"error with deflateInit: %d",r);
-      }
-      E->write = etf_131_encoder_writez;
+    /* the replaced plan is freed, unless it's being encoded right now */
+    if(old != NULL && old->busy == 0) {
+        for(prev = &E->shapes; *prev != old; prev = &(*prev)->next);
+        *prev = old->next;
+        luaL_unref(L,LUA_REGISTRYINDEX,old->names);
+        free(old);
     }
 
-    lua_newtable(L);
-    E->strtable = lua_gettop(L);
-    E->strcount = 0; /* we'll replace the header string at the end */
-    lua_pushliteral(L,"");
-    lua_rawseti(L,E->strtable,++E->strcount);
+    return 0;
+}
+
+/* returns the memo table from the uservalue, creating it if create is set */
+static int
+etf_131_encoder_memo_table(lua_State *L, int create) {
+    lua_getuservalue(L,1);
+    lua_getfield(L,-1,"memo");
+    if(lua_isnil(L,-1) && create) {
+        lua_pop(L,1);
+        lua_newtable(L);
+        lua_newtable(L);
+        lua_pushliteral(L,"k");
+        lua_setfield(L,-2,"__mode");
+        lua_setmetatable(L,-2);
+        lua_pushvalue(L,-1);
+        lua_setfield(L,-3,"memo");
+    }
+    lua_replace(L,-2);
+    return lua_istable(L,-1);
+}
+
+/* encoder:memoize(tbl)
+ * caches the encoding of tbl the next time it's encoded */
+static int
+etf_131_encoder_memoize(lua_State *L) {
+    etf_131_encoder_state *E = luaL_checkudata(L,1,etf_131_encoder_mt);
+    luaL_checktype(L,2,LUA_TTABLE);
+    lua_settop(L,2);
 
+    etf_131_encoder_memo_table(L,1);
     lua_pushvalue(L,2);
+    lua_rawget(L,-2);
+    if(lua_isnil(L,-1)) {
+        lua_pushvalue(L,2);
+        lua_pushboolean(L,1);
+        lua_rawset(L,-4);
+    }
+    E->memo = 1;
 
-    if( (r = etf_131_encode(E)) != 0)  return r;
+    return 0;
+}
 
-    if(compressLevel != ETF_NO_COMPRESSION) {
-        header[1] = _131_ETFZLIB;
-        pack_uint32be(&header[2], (uint32_t)E->strm.total_in);
+/* encoder:invalidate([tbl])
+ * drops the cached encoding of tbl (or of every memoized table), it's
+ * captured again the next time the table is encoded */
+static int
+etf_131_encoder_invalidate(lua_State *L) {
+    luaL_checkudata(L,1,etf_131_encoder_mt);
+    if(!lua_isnoneornil(L,2)) luaL_checktype(L,2,LUA_TTABLE);
+    lua_settop(L,2);
 
-        headerlen = 6;
-        do {
-            E->strm.avail_out = ETF_BUFFER_LEN;
-            E->strm.next_out = E->z;
-            r = mz_deflate(&E->strm, MZ_FINISH);
-            if(!(r == MZ_OK || r == MZ_STREAM_END)) {
-                return luaL_error(L,"error flushing compressed stream");
-            }
-            lua_pushlstring(E->L,(const char *)E->z,ETF_BUFFER_LEN - E->strm.avail_out);
-            lua_rawseti(L,E->strtable,++E->strcount);
-        } while (r != MZ_STREAM_END);
-        mz_deflateEnd(&E->strm);
-    }
+    if(!etf_131_encoder_memo_table(L,0)) return 0;
 
-    lua_pushlstring(L,(const char *)header,headerlen);
-    lua_rawseti(L,E->strtable,1);
+    if(lua_istable(L,2)) {
+        lua_pushvalue(L,2);
+        lua_rawget(L,3);
+        if(!lua_isnil(L,-1)) {
+            lua_pushvalue(L,2);
+            lua_pushboolean(L,1);
+            lua_rawset(L,3);
+        }
+        return 0;
+    }
 
-    luaL_buffinit(L,&buffer);
-    for(i=1;i<=E->strcount;i++) {
-        lua_rawgeti(L,E->strtable,i);
-        luaL_addvalue(&buffer);
+    lua_pushnil(L);
+    while(lua_next(L,3)) {
+        lua_pop(L,1);
+        lua_pushvalue(L,-1);
+        lua_pushboolean(L,1);
+        lua_rawset(L,3);
     }
-    luaL_pushresult(&buffer);
 
-    return 1;
+    return 0;
+}
+
+static int
+etf_131_encoder__gc(lua_State *L) {
+    etf_131_encoder_state *E = luaL_checkudata(L,1,etf_131_encoder_mt);
+    etf_shape *S = NULL;
+    etf_buffer_free(&E->arena);
+    if(E->metas != NULL) {
+        free(E->metas);
+        E->metas = NULL;
+    }
+    if(E->keys != NULL) {
+        free(E->keys);
+        E->keys = NULL;
+    }
+    while(E->shapes != NULL) {
+        S = E->shapes;
+        E->shapes = S->next;
+        luaL_unref(L,LUA_REGISTRYINDEX,S->names);
+        free(S);
+    }
+    if(E->segs != NULL) {
+        free(E->segs);
+        E->segs = NULL;
+        E->segalloc = 0;
+    }
+    if(E->zlevel != ETF_NO_COMPRESSION) {
+        mz_deflateEnd(&E->strm);
+        E->zlevel = ETF_NO_COMPRESSION;
+    }
+    return 0;
 }
 
 static int
@@ -3463,7 +6068,8 @@ etf_port(lua_State *L) {
 
     lua_getfield(L,1,"node");
     type = lua_type(L,-1);
-    if(type == LUA_TTABLE && etf_testmeta(L, etf_atom_mt)) {
+    if(etf_toatom(L,-1) != NULL) {
+        lua_replace(L,-2);
         len = 0;
     } else if(type == LUA_TSTRING) {
         len = lua_rawlen(L,-1);
@@ -3523,7 +6129,8 @@ etf_export(lua_State *L) {
 
     lua_getfield(L,1,"module");
     type = lua_type(L,-1);
-    if(type == LUA_TTABLE && etf_testmeta(L, etf_atom_mt)) {
+    if(etf_toatom(L,-1) != NULL) {
+        lua_replace(L,-2);
         len = 0;
     } else if(type == LUA_TSTRING) {
         len = lua_rawlen(L,-1);
@@ -3541,7 +6148,8 @@ etf_export(lua_State *L) {
 
     lua_getfield(L,1,"function");
     type = lua_type(L,-1);
-    if(type == LUA_TTABLE && etf_testmeta(L, etf_atom_mt)) {
+    if(etf_toatom(L,-1) != NULL) {
+        lua_replace(L,-2);
         len = 0;
     } else if(type == LUA_TSTRING) {
         len = lua_rawlen(L,-1);
@@ -3600,7 +6208,8 @@ etf_pid(lua_State *L) {
     if(type == LUA_TNIL) {
         return luaL_error(L,"field 'module' is missing");
     }
-    else if(type == LUA_TTABLE && etf_testmeta(L, etf_atom_mt)) {
+    else if(etf_toatom(L,-1) != NULL) {
+        lua_replace(L,-2);
         len = 0;
     } else if(type == LUA_TSTRING) {
         len = lua_rawlen(L,-1);
@@ -3668,7 +6277,8 @@ etf_reference(lua_State *L) {
 
     lua_getfield(L,1,"node");
     type = lua_type(L,-1);
-    if(type == LUA_TTABLE && etf_testmeta(L, etf_atom_mt)) {
+    if(etf_toatom(L,-1) != NULL) {
+        lua_replace(L,-2);
         len = 0;
     } else if(type == LUA_TSTRING) {
         len = lua_rawlen(L,-1);
@@ -3795,7 +6405,9 @@ etf_131_atom_map(lua_State *L) {
 static int
 etf_131_decoder_new(lua_State *L) {
     int64_t *t = NULL;
+    int i;
     int type;
+    lua_Number above;
 
     etf_131_decoder_state *D = (etf_131_decoder_state *)lua_newuserdata(L,sizeof(etf_131_decoder_state));
 
@@ -3806,13 +6418,27 @@ etf_131_decoder_new(lua_State *L) {
 
     D->force_bigint = 0;
     D->force_float = 0;
+    D->packet = 0;
+    D->default_map = 1;
+    D->rules = NULL;
+    D->consts = 0;
+    D->uv = 0;
+    D->atoms = 0;
 
     lua_newtable(L);
 
+    for(i = 0; etf_131_decoder_metas[i] != NULL; i++) {
+        luaL_getmetatable(L,etf_131_decoder_metas[i]);
+        lua_rawseti(L,-2,i+1);
+    }
+
     lua_pushvalue(L,lua_upvalueindex(5));
     lua_pushcclosure(L, etf_131_atom_map_default, 1);
     lua_setfield(L, -2, "atom_map");
 
+    lua_getfield(L,lua_upvalueindex(5),"nil");
+    lua_setfield(L, -2, "null");
+
     if(lua_istable(L,1)) {
         lua_getfield(L,1,"use_integer");
         type = lua_type(L,-1);
@@ -3832,14 +6458,31 @@ etf_131_decoder_new(lua_State *L) {
         }
         lua_pop(L,1);
 
+        lua_getfield(L,1,"packet");
+        type = lua_type(L,-1);
+        if(type == LUA_TNUMBER) {
+            switch(lua_tointeger(L,-1)) {
+                case 0: /* fall-through */
+                case 1: /* fall-through */
+                case 2: /* fall-through */
+                case 4: D->packet = (uint8_t)lua_tointeger(L,-1); break;
+                default: return luaL_error(L,"unsupported value for packet");
+            }
+        } else if(type != LUA_TNIL) {
+            return luaL_error(L,"unsupported value for packet");
+        }
+        lua_pop(L,1);
+
         lua_getfield(L,1,"atom_map");
         type = lua_type(L,-1);
 
         if(type == LUA_TTABLE) {
             lua_pushcclosure(L, etf_131_atom_map,1);
             lua_setfield(L,-2,"atom_map");
+            D->default_map = 0;
         } else if(type == LUA_TFUNCTION) {
             lua_setfield(L,-2,"atom_map");
+            D->default_map = 0;
         } else if(type != LUA_TNIL) {
             return luaL_error(L,"unsupported value for atom_map");
         } else {
@@ -3855,6 +6498,37 @@ etf_131_decoder_new(lua_State *L) {
     t = lua_touserdata(L,lua_upvalueindex(4));
     D->i_max = *t;
 
+    if(lua_istable(L,1)) {
+        lua_getfield(L,1,"rules");
+        if(lua_istable(L,-1)) {
+            lua_getfield(L,-1,"integers_above");
+            if(lua_isnumber(L,-1)) {
+                above = lua_tonumber(L,-1);
+                if(above < 0) return luaL_error(L,"invalid integers_above rule");
+                if(above < (lua_Number)D->i_max) {
+                    D->i_max = (int64_t)above;
+                    D->i_min = -D->i_max;
+                }
+            } else if(!lua_isnil(L,-1)) {
+                return luaL_error(L,"invalid integers_above rule");
+            }
+            lua_pop(L,1);
+
+            lua_getfield(L,-1,"atoms");
+            if(lua_istable(L,-1)) {
+                lua_getuservalue(L,-3);
+                D->rules = etf_atom_rules_compile(L,lua_gettop(L) - 1,lua_gettop(L),1);
+                lua_pop(L,1);
+            } else if(!lua_isnil(L,-1)) {
+                return luaL_error(L,"invalid atoms rule");
+            }
+            lua_pop(L,1);
+        } else if(!lua_isnil(L,-1)) {
+            return luaL_error(L,"invalid rules value");
+        }
+        lua_pop(L,1);
+    }
+
     return 1;
 }
 
@@ -3939,19 +6613,72 @@ etf_131_default_value_map(lua_State *L) {
 
 static int
 etf_131_encoder_new(lua_State *L) {
+    static const char * const array_detection[] = { "strict", "rawlen", "metatable", NULL };
     lua_Number c;
+    int i;
+    size_t keys = 0;
+    int has_keys = 0;
+    size_t n;
     etf_131_encoder_state *E = (etf_131_encoder_state *)lua_newuserdata(L,sizeof(etf_131_encoder_state));
 
     if(E == NULL) {
         return luaL_error(L,"out of memory");
     }
+    E->arena.data = NULL;
+    E->arena.len = 0;
+    E->arena.alloc = 0;
+    E->arena.locked = 0;
+    E->out = &E->arena;
+    E->arena_max = ETF_DEFAULT_ARENA_MAX;
+    E->count = 0;
+    E->compress = ETF_NO_COMPRESSION;
+    E->packet = 0;
+    E->default_map = 1;
+    E->keys_as_atoms = 0;
+    E->arrays = ETF_ARRAY_STRICT;
+    E->memo = 0;
+    E->rules = NULL;
+    E->reflen = 0;
+    E->zlevel = ETF_NO_COMPRESSION;
+    E->sink = 0;
+    E->sink_self = 0;
+    E->chunk = ETF_DEFAULT_CHUNK_LEN;
+    E->flushed = 0;
+    E->segs = NULL;
+    E->nsegs = 0;
+    E->segalloc = 0;
+    E->segstart = 0;
+    E->pins = 0;
+    E->npins = 0;
+    E->ref_threshold = ETF_DEFAULT_REF_THRESHOLD;
+    E->refs = 0;
+    E->cache = NULL;
+    E->metas = NULL;
+    E->metamask = ETF_META_SLOTS - 1;
+    E->nmetas = 0;
+    E->shapes = NULL;
+    E->keys = NULL;
+    E->keymask = 0;
     luaL_setmetatable(L,etf_131_encoder_mt);
 
+    E->metas = (etf_meta_slot *)calloc(ETF_META_SLOTS,sizeof(etf_meta_slot));
+    if(E->metas == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+
     lua_newtable(L);
-    lua_pushinteger(L, ETF_NO_COMPRESSION);
-    lua_setfield(L, -2, "compress");
 
+    /* the metatables are anchored in the registry, mt_map is kept
+     * in the uservalue to anchor them alongside the encoder */
     lua_pushvalue(L,lua_upvalueindex(3));
+    lua_pushnil(L);
+    while(lua_next(L,-2)) {
+        if(etf_131_encoder_meta_add(E,lua_topointer(L,-2),
+          (int (*)(etf_131_encoder_state *))lua_touserdata(L,-1),NULL)) {
+            return luaL_error(L,"out of memory");
+        }
+        lua_pop(L,1);
+    }
     lua_setfield(L,-2,"mt_map");
 
     lua_pushvalue(L,lua_upvalueindex(1));
@@ -3961,33 +6688,112 @@ etf_131_encoder_new(lua_State *L) {
 
     if(lua_istable(L,1)) {
         lua_getfield(L,1,"compress");
-        if(lua_isnil(L,-1)) {
-            lua_pop(L,1);
-        } else if(lua_isnumber(L,-1)) {
+        if(lua_isnumber(L,-1)) {
             c = lua_tointeger(L,-1);
             if(c < -1 || c > 9) return luaL_error(L,"invalid compression level");
-            lua_setfield(L,-2,"compress");
+            E->compress = (int)c;
         } else if(lua_isboolean(L,-1)) {
             if(lua_toboolean(L,-1)) {
-                lua_pushinteger(L,-1);
-                lua_setfield(L,-3,"compress");
+                E->compress = -1;
             }
-            lua_pop(L,1);
-        } else {
+        } else if(!lua_isnil(L,-1)) {
             return luaL_error(L,"invalid compression value");
         }
+        lua_pop(L,1);
+
+        lua_getfield(L,1,"packet");
+        if(!lua_isnil(L,-1)) {
+            c = lua_isnumber(L,-1) ? lua_tonumber(L,-1) : -1;
+            if(!(c == 0 || c == 1 || c == 2 || c == 4)) return luaL_error(L,"invalid packet size");
+            E->packet = (uint8_t)c;
+        }
+        lua_pop(L,1);
+
+        lua_getfield(L,1,"arena_max");
+        if(lua_isnumber(L,-1)) {
+            if(!etf_tosize(lua_tonumber(L,-1),&E->arena_max)) {
+                return luaL_error(L,"invalid arena_max value");
+            }
+        } else if(!lua_isnil(L,-1)) {
+            return luaL_error(L,"invalid arena_max value");
+        }
+        lua_pop(L,1);
+
+        lua_getfield(L,1,"ref_threshold");
+        if(lua_isnumber(L,-1)) {
+            if(!etf_tosize(lua_tonumber(L,-1),&E->ref_threshold)) {
+                return luaL_error(L,"invalid ref_threshold value");
+            }
+        } else if(!lua_isnil(L,-1)) {
+            return luaL_error(L,"invalid ref_threshold value");
+        }
+        lua_pop(L,1);
+
+        lua_getfield(L,1,"rules");
+        if(lua_istable(L,-1)) {
+            lua_getfield(L,-1,"keys_as_atoms");
+            E->keys_as_atoms = (uint8_t)lua_toboolean(L,-1);
+            lua_pop(L,1);
+
+            lua_getfield(L,-1,"atoms");
+            if(lua_istable(L,-1)) {
+                E->rules = etf_atom_rules_compile(L,lua_gettop(L),lua_gettop(L) - 2,0);
+            } else if(!lua_isnil(L,-1)) {
+                return luaL_error(L,"invalid atoms rule");
+            }
+            lua_pop(L,1);
+        } else if(!lua_isnil(L,-1)) {
+            return luaL_error(L,"invalid rules value");
+        }
+        lua_pop(L,1);
+
+        lua_getfield(L,1,"array_detection");
+        if(!lua_isnil(L,-1)) {
+            for(i = 0; array_detection[i] != NULL; i++) {
+                if(lua_type(L,-1) == LUA_TSTRING && strcmp(lua_tostring(L,-1),array_detection[i]) == 0) break;
+            }
+            if(array_detection[i] == NULL) return luaL_error(L,"invalid array_detection value");
+            E->arrays = (uint8_t)i;
+        }
+        lua_pop(L,1);
+
+        lua_getfield(L,1,"key_cache");
+        if(lua_isnumber(L,-1)) {
+            if(!etf_tosize(lua_tonumber(L,-1),&keys) || keys > ETF_MAX_KEY_CACHE) {
+                return luaL_error(L,"invalid key_cache value");
+            }
+            has_keys = 1;
+        } else if(!lua_isnil(L,-1)) {
+            return luaL_error(L,"invalid key_cache value");
+        }
+        lua_pop(L,1);
 
         lua_getfield(L,1,"value_map");
         if(lua_istable(L,-1)) {
             lua_pushcclosure(L, etf_131_table_value_map, 1);
             lua_setfield(L, -2, "value_map");
+            E->default_map = 0;
         } else if(lua_isfunction(L,-1)) {
             lua_setfield(L, -2, "value_map");
+            E->default_map = 0;
         } else {
             lua_pop(L,1);
         }
     }
 
+    /* a custom value_map might not map keys the same way every time,
+     * so it only gets a key cache when asked for one */
+    if(!has_keys) keys = E->default_map ? ETF_DEFAULT_KEY_CACHE : 0;
+    if(keys > 0) {
+        n = 1;
+        while(n < keys) n <<= 1;
+        E->keys = (etf_key_slot *)calloc(n,sizeof(etf_key_slot));
+        if(E->keys == NULL) return luaL_error(L,"out of memory");
+        E->keymask = n - 1;
+        lua_createtable(L,(int)n,0);
+        lua_setfield(L,-2,"key_cache");
+    }
+
     lua_setuservalue(L,-2);
 
     return 1;
@@ -4083,12 +6889,14 @@ static const struct luaL_Reg etf_float_metamethods[] = {
     { "__eq",       etf_float__eq       },
     { "__lt",       etf_float__lt       },
     { "__le",       etf_float__le       },
+    { "__index",    etf_float__index    },
     { NULL,         NULL                },
 };
 
 static const struct luaL_Reg etf_atom_metamethods[] = {
     { "__tostring", etf_atom__tostring },
     { "__eq",       etf_atom__eq       },
+    { "__index",    etf_atom__index    },
     { NULL,         NULL                 },
 };
 
@@ -4104,13 +6912,47 @@ static const struct luaL_Reg etf_binary_metamethods[] = {
     { NULL,         NULL                 },
 };
 
+static const struct luaL_Reg etf_buffer_metamethods[] = {
+    { "__len",      etf_buffer_len       },
+    { "__tostring", etf_buffer__tostring },
+    { "__gc",       etf_buffer__gc       },
+    { NULL,         NULL                 },
+};
+
+static const struct luaL_Reg etf_raw_metamethods[] = {
+    { "__len",      etf_raw_len       },
+    { "__tostring", etf_raw__tostring },
+    { NULL,         NULL              },
+};
+
+static const struct luaL_Reg etf_buffer_methods[] = {
+    { "reserve",  etf_buffer_reserve_method },
+    { "append",   etf_buffer_append_method  },
+    { "clear",    etf_buffer_clear          },
+    { "len",      etf_buffer_len            },
+    { "tostring", etf_buffer__tostring      },
+    { NULL,       NULL                      },
+};
+
 static const struct luaL_Reg etf_131_decoder_methods[] = {
     { "decode", etf_131_decoder_decode },
+    { "decode_packets", etf_131_decoder_decode_packets },
+    { "decode_dist", etf_131_decoder_decode_dist },
     { NULL, NULL },
 };
 
 static const struct luaL_Reg etf_131_encoder_methods[] = {
     { "encode", etf_131_encoder_encode },
+    { "encode_into", etf_131_encoder_encode_into },
+    { "size", etf_131_encoder_size },
+    { "encode_stream", etf_131_encoder_encode_stream },
+    { "encode_to_fd", etf_131_encoder_encode_to_fd },
+    { "encode_segments", etf_131_encoder_encode_segments },
+    { "encode_many", etf_131_encoder_encode_many },
+    { "register_shape", etf_131_encoder_register_shape },
+    { "encode_dist", etf_131_encoder_encode_dist },
+    { "memoize", etf_131_encoder_memoize },
+    { "invalidate", etf_131_encoder_invalidate },
     { NULL, NULL },
 };
 
@@ -4153,6 +6995,7 @@ static const etf_encoder_mt_rec etf_131_encoder_metas[] = {
     { etf_atom_mt,      (int (*)(void *))etf_131_encoder_atom_mt },
     { etf_string_mt,    (int (*)(void *))etf_131_encoder_string_mt },
     { etf_binary_mt,    (int (*)(void *))etf_131_encoder_binary_mt },
+    { etf_raw_mt,       (int (*)(void *))etf_131_encoder_raw_mt },
     { NULL, NULL },
 };
 
@@ -4166,6 +7009,9 @@ static const struct luaL_Reg etf_functions[] = {
     { "list", etf_list },
     { "map", etf_map },
     { "tuple", etf_tuple },
+    { "buffer", etf_buffer_new },
+    { "raw", etf_raw_new },
+    { "atom_cache", etf_atom_cache_new },
     { NULL, NULL },
 };
 
@@ -4221,6 +7067,8 @@ int luaopen_etf(lua_State *L) {
         lua_newtable(L);
         luaL_setfuncs(L,etf_131_encoder_methods,0);
         lua_setfield(L,-2,"__index");
+        lua_pushcfunction(L,etf_131_encoder__gc);
+        lua_setfield(L,-2,"__gc");
         lua_pushstring(L,etf_131_encoder_mt);
         lua_setfield(L,-2,"__name");
     }
@@ -4233,6 +7081,21 @@ int luaopen_etf(lua_State *L) {
     }
     lua_setfield(L,-2,"atom_mt");
 
+    /* etf.atom always returns the same userdata for a name, as long as
+     * it's still referenced */
+    for(i = 0; i < 2; i++) {
+        lua_getfield(L,LUA_REGISTRYINDEX,i ? etf_atom_latin1_pool : etf_atom_pool);
+        if(lua_isnil(L,-1)) {
+            lua_newtable(L);
+            lua_createtable(L,0,1);
+            lua_pushliteral(L,"v");
+            lua_setfield(L,-2,"__mode");
+            lua_setmetatable(L,-2);
+            lua_setfield(L,LUA_REGISTRYINDEX,i ? etf_atom_latin1_pool : etf_atom_pool);
+        }
+        lua_pop(L,1);
+    }
+
     if(luaL_newmetatable(L,etf_string_mt)) {
         luaL_setfuncs(L,etf_string_metamethods,0);
         lua_pushstring(L,etf_string_mt);
@@ -4247,6 +7110,31 @@ int luaopen_etf(lua_State *L) {
     }
     lua_setfield(L,-2,"binary_mt");
 
+    if(luaL_newmetatable(L,etf_buffer_mt)) {
+        luaL_setfuncs(L,etf_buffer_metamethods,0);
+        lua_newtable(L);
+        luaL_setfuncs(L,etf_buffer_methods,0);
+        lua_setfield(L,-2,"__index");
+        lua_pushstring(L,etf_buffer_mt);
+        lua_setfield(L,-2,"__name");
+    }
+    lua_setfield(L,-2,"buffer_mt");
+
+    if(luaL_newmetatable(L,etf_raw_mt)) {
+        luaL_setfuncs(L,etf_raw_metamethods,0);
+        lua_pushstring(L,etf_raw_mt);
+        lua_setfield(L,-2,"__name");
+    }
+    lua_setfield(L,-2,"raw_mt");
+
+    if(luaL_newmetatable(L,etf_atom_cache_mt)) {
+        lua_pushcfunction(L,etf_atom_cache__gc);
+        lua_setfield(L,-2,"__gc");
+        lua_pushstring(L,etf_atom_cache_mt);
+        lua_setfield(L,-2,"__name");
+    }
+    lua_setfield(L,-2,"atom_cache_mt");
+
     if(luaL_newmetatable(L,etf_port_mt)) {
         lua_pushstring(L,etf_port_mt);
         lua_setfield(L,-2,"__name");
@@ -4444,21 +7332,11 @@ int luaopen_etf(lua_State *L) {
     /* create our value -> atom mapping for booleans */
     lua_newtable(L);
     lua_pushboolean(L,1);
-    lua_newtable(L);
-    lua_pushstring(L,"true");
-    lua_setfield(L,-2,"atom");
-    lua_pushboolean(L,1);
-    lua_setfield(L,-2,"utf8");
-    luaL_setmetatable(L,etf_atom_mt);
+    etf_pushatom(L,"true",4,1);
     lua_settable(L,-3);
 
     lua_pushboolean(L,0);
-    lua_newtable(L);
-    lua_pushstring(L,"false");
-    lua_setfield(L,-2,"atom");
-    lua_pushboolean(L,1);
-    lua_setfield(L,-2,"utf8");
-    luaL_setmetatable(L,etf_atom_mt);
+    etf_pushatom(L,"false",5,1);
     lua_settable(L,-3);
 
     lua_getglobal(L,"tostring");
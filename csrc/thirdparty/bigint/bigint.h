@@ -95,6 +95,9 @@ typedef struct bigint {
      * .... why? */
 #else
     bigint_word *words;
+    /* non-zero when words is storage provided with bigint_init_storage,
+     * it's copied to the heap when it needs to grow and never freed */
+    size_t fixed;
 #endif
 } bigint;
 
@@ -118,6 +121,13 @@ void bigint_init(bigint* b);
 BIGINT_API
 void bigint_free(bigint* b);
 
+#ifndef BIGINT_NO_MALLOC
+/* initializes b to use the given words (alloc words long) until it
+ * outgrows them */
+BIGINT_API
+void bigint_init_storage(bigint* b, bigint_word* words, size_t alloc);
+#endif
+
 BIGINT_API
 int bigint_copy(bigint* b, const bigint* a);
 
@@ -242,6 +252,35 @@ void bigint_div_mod_word(bigint* numerator, bigint_word* remainder, bigint_word
 
 #define BIGINT_BLOCK_SIZE 8
 
+/* operands of at least this many words are multiplied
+ * with Karatsuba instead of the schoolbook method, must be >= 4 */
+#ifndef BIGINT_KARATSUBA_THRESHOLD
+#define BIGINT_KARATSUBA_THRESHOLD 32
+#endif
+
+/* decimal conversion works BIGINT_DEC_DIGITS digits at a time, using the
+ * largest power of 10 that fits in half a word (for bigint_div_mod_word) */
+#if BIGINT_WORD_WIDTH == 8
+#define BIGINT_DEC_CHUNK 1000000000
+#define BIGINT_DEC_DIGITS 9
+#elif BIGINT_WORD_WIDTH == 4
+#define BIGINT_DEC_CHUNK 10000
+#define BIGINT_DEC_DIGITS 4
+#elif BIGINT_WORD_WIDTH == 2
+#define BIGINT_DEC_CHUNK 100
+#define BIGINT_DEC_DIGITS 2
+#else
+#define BIGINT_DEC_CHUNK 10
+#define BIGINT_DEC_DIGITS 1
+#endif
+
+/* decimal strings longer than this many digits are converted by
+ * splitting them around powers of 10, in up to BIGINT_DEC_LEVELS levels */
+#ifndef BIGINT_DEC_THRESHOLD
+#define BIGINT_DEC_THRESHOLD 200
+#endif
+#define BIGINT_DEC_LEVELS 32
+
 #if __GNUC__ > 4 || \
    (__GNUC__ == 4 && __GNUC_MINOR__ >= 5)
 #define BIGINT_UNREACHABLE __builtin_unreachable()
@@ -343,13 +382,9 @@ static size_t bigint_len_string_base8(const bigint* b);
 static size_t bigint_len_string_base2(const bigint* b);
 
 BIGINT_NONNULL1
-static size_t bigint_to_string_base16(char* str, size_t len, bigint* b);
+static size_t bigint_to_string_pow2(char* str, size_t len, const bigint* b, unsigned int bits);
 BIGINT_NONNULL1
 static size_t bigint_to_string_base10(char* str, size_t len, bigint* b);
-BIGINT_NONNULL1
-static size_t bigint_to_string_base8(char* str, size_t len, bigint* b);
-BIGINT_NONNULL1
-static size_t bigint_to_string_base2(char* str, size_t len, bigint* b);
 
 static
 void bigint_reset(bigint* b) {
@@ -368,13 +403,22 @@ int bigint_resize(bigint* b, size_t size) {
     if(alloc * BIGINT_WORD_SIZE > BIGINT_DEFAULT_LIMIT) return BIGINT_ENOMEM;
 #else
     size_t alloc = ((size + BIGINT_BLOCK_SIZE-1)) & -BIGINT_BLOCK_SIZE;
+    bigint_word *words;
 #endif
 
     if(alloc * BIGINT_WORD_SIZE > b->limit) return BIGINT_ELIMIT;
 
 #ifndef BIGINT_NO_MALLOC
-    if(b->alloc < alloc) {
-        if(b->words != NULL) {
+    /* heap allocations are always a multiple of the block size, so this
+     * only differs from checking alloc for fixed storage */
+    if(b->alloc < size) {
+        if(b->fixed) {
+            words = (bigint_word *)malloc(alloc * BIGINT_WORD_SIZE);
+            if(words == NULL) return BIGINT_ENOMEM;
+            memcpy(words,b->words,b->alloc * BIGINT_WORD_SIZE);
+            b->words = words;
+            b->fixed = 0;
+        } else if(b->words != NULL) {
             b->words = (bigint_word *)realloc(b->words,alloc * BIGINT_WORD_SIZE);
         } else {
             b->words = (bigint_word *)malloc(alloc * BIGINT_WORD_SIZE);
@@ -388,7 +432,12 @@ int bigint_resize(bigint* b, size_t size) {
     if(b->size > size) { /* shrinking */
         b->words[size] = 0;
     } else if(b->size < size) { /* growing */
+#ifdef BIGINT_NO_MALLOC
         b->words[b->size] = 0;
+#else
+        /* clear anything left over from a previous, longer value */
+        memset(&b->words[b->size],0,(size - b->size) * BIGINT_WORD_SIZE);
+#endif
     }
 
     b->size = size;
@@ -568,43 +617,6 @@ static bigint_word bigint_word_mul(bigint_word *a, bigint_word b) {
 #endif
 }
 
-#if defined(BIGINT_SINGLE_WORD_ONLY) || !defined(BIGINT_WORD_MUL_DOUBLE)
-#define BIGINT_WORD_MUL_CONST(x) \
-static inline bigint_word bigint_word_mul_const_ ## x (bigint_word *a) { \
-    bigint_word a_hi, b_hi, a_lo, b_lo, tmp, res_lo, res_hi; \
-    a_hi = (*a) >> BIGINT_HALF_WORD_BIT; \
-    a_lo = (*a) & BIGINT_HALF_WORD_MASK; \
-    b_hi = ((bigint_word)x) >> BIGINT_HALF_WORD_BIT; \
-    b_lo = ((bigint_word)x) & BIGINT_HALF_WORD_MASK; \
-    res_lo = a_lo * b_lo; \
-    res_hi = a_hi * b_hi; \
-    tmp = a_hi * b_lo; \
-    res_hi += bigint_word_add(&res_lo,tmp << BIGINT_HALF_WORD_BIT); \
-    res_hi += (tmp >> BIGINT_HALF_WORD_BIT); \
-    tmp = a_lo * b_hi; \
-    res_hi += bigint_word_add(&res_lo,tmp << BIGINT_HALF_WORD_BIT); \
-    res_hi += (tmp >> BIGINT_HALF_WORD_BIT); \
-    *a = res_lo; \
-    return res_hi; \
-}
-#elif defined(BIGINT_DWORD_TYPE)
-#define BIGINT_WORD_MUL_CONST(x) \
-static inline bigint_word bigint_word_mul_const_ ## x (bigint_word *a) { \
-    BIGINT_DWORD_TYPE res = *a; \
-    res *= x; \
-    *a = res & BIGINT_WORD_MASK; \
-    res >>= BIGINT_WORD_BIT; \
-    return res; \
-}
-#else
-#define BIGINT_WORD_MUL_CONST(x) \
-static inline bigint_word bigint_word_mul_const_ ## x (bigint_word *a) { \
-    return bigint_word_mul_double(a,x);
-}
-#endif
-
-BIGINT_WORD_MUL_CONST(10)
-
 static int bigint_add_word(bigint* a, bigint_word val) {
     int r;
     size_t i = 0;
@@ -778,26 +790,6 @@ int bigint_rshift_overwrite(bigint* c, size_t bits) {
     return 0;
 }
 
-#define BIGINT_RSHIFT_OVERWRITE_SMALL(x) \
-static inline void bigint_rshift_overwrite_small_ ## x (bigint* c) { \
-    size_t i; \
-    bigint_word lo, hi; \
-    i = 0; \
-    lo = hi = c->words[0]; \
-    while(i < c->size - 1) { \
-        hi = c->words[i + 1]; \
-        c->words[i] = (hi << (BIGINT_WORD_BIT - x)) | lo >> x; \
-        lo = hi; \
-        i++; \
-    } \
-    c->words[i] = lo >> x; \
-    bigint_truncate(c); \
-}
-
-BIGINT_RSHIFT_OVERWRITE_SMALL(4)
-BIGINT_RSHIFT_OVERWRITE_SMALL(3)
-BIGINT_RSHIFT_OVERWRITE_SMALL(1)
-
 BIGINT_API
 int bigint_rshift(bigint* c, const bigint* a, size_t bits) {
     int r;
@@ -805,44 +797,204 @@ int bigint_rshift(bigint* c, const bigint* a, size_t bits) {
     return bigint_rshift_overwrite(c,bits);
 }
 
-static
-int bigint_mul_long(bigint* c, const bigint* a, const bigint* b) {
-    int r;
-    size_t expanded;
-    size_t ia, ib;
-    bigint_word carry;
+/* r[i] += a[i] * w for i in [0,n), returns the carry out of r[n-1] */
+static bigint_word bigint_words_muladd(bigint_word* r, const bigint_word* a, size_t n, bigint_word w) {
+    size_t i;
+    bigint_word carry = 0;
 #if defined(BIGINT_SINGLE_WORD_ONLY) || !defined(BIGINT_DWORD_TYPE)
     bigint_word lo, hi;
 #else
     BIGINT_DWORD_TYPE res;
 #endif
 
-    expanded = a->size + b->size + 1;
-
-    if( (r = bigint_resize(c, expanded)) != 0) return r;
-    c->sign = a->sign ^ b->sign;
-
-    for(ib = 0; ib < b->size; ib++) {
-        carry = 0;
-        for(ia = 0; ia < a->size; ia++) {
+    for(i = 0; i < n; i++) {
 #if defined(BIGINT_SINGLE_WORD_ONLY) || !defined(BIGINT_DWORD_TYPE)
-            lo = a->words[ia];
-            hi = bigint_word_mul(&lo,b->words[ib]);
-            hi += bigint_word_add(&lo,c->words[ia+ib]);
-            hi += bigint_word_add(&lo,carry);
-            c->words[ia + ib] = lo;
-            carry = hi;
+        lo = a[i];
+        hi = bigint_word_mul(&lo,w);
+        hi += bigint_word_add(&lo,r[i]);
+        hi += bigint_word_add(&lo,carry);
+        r[i] = lo;
+        carry = hi;
 #else
-            res = a->words[ia];
-            res *= b->words[ib];
-            res += c->words[ia + ib];
-            res += carry;
-            c->words[ia + ib] = res & BIGINT_WORD_MASK;
-            carry = res >> BIGINT_WORD_BIT;
+        res = a[i];
+        res *= w;
+        res += r[i];
+        res += carry;
+        r[i] = res & BIGINT_WORD_MASK;
+        carry = res >> BIGINT_WORD_BIT;
 #endif
+    }
+    return carry;
+}
+
+#ifndef BIGINT_NO_MALLOC
+/* r = a + b, where an >= bn, returns the carry. r may be a */
+static bigint_word bigint_words_add(bigint_word* r, const bigint_word* a, size_t an, const bigint_word* b, size_t bn) {
+    size_t i;
+    bigint_word carry = 0;
+    bigint_word t;
+
+    for(i = 0; i < bn; i++) {
+        t = a[i];
+        carry = bigint_word_add(&t,carry);
+        carry += bigint_word_add(&t,b[i]);
+        r[i] = t;
+    }
+    for(; i < an; i++) {
+        t = a[i];
+        carry = bigint_word_add(&t,carry);
+        r[i] = t;
+    }
+    return carry;
+}
+
+/* r = a - b, where an >= bn, returns the borrow. r may be a */
+static bigint_word bigint_words_sub(bigint_word* r, const bigint_word* a, size_t an, const bigint_word* b, size_t bn) {
+    size_t i;
+    bigint_word borrow = 0;
+    bigint_word t;
+
+    for(i = 0; i < bn; i++) {
+        t = a[i];
+        borrow = bigint_word_sub(&t,borrow);
+        borrow += bigint_word_sub(&t,b[i]);
+        r[i] = t;
+    }
+    for(; i < an; i++) {
+        t = a[i];
+        borrow = bigint_word_sub(&t,borrow);
+        r[i] = t;
+    }
+    return borrow;
+}
+#endif
+
+/* schoolbook multiplication, r[0..an+bn) = a * b. r must not overlap a or b */
+static void bigint_words_mul_basecase(bigint_word* r, const bigint_word* a, size_t an, const bigint_word* b, size_t bn) {
+    size_t i;
+
+    memset(r,0,an * BIGINT_WORD_SIZE);
+    for(i = 0; i < bn; i++) {
+        r[i + an] = bigint_words_muladd(&r[i], a, an, b[i]);
+    }
+}
+
+#ifndef BIGINT_NO_MALLOC
+/* Karatsuba multiplication, r[0..2n) = a * b with a and b both n words long.
+ * Splitting each operand into a low half of m words and a high half of
+ * n - m words, a * b = z2 * W^2m + z1 * W^m + z0 where
+ *   z0 = a0 * b0
+ *   z2 = a1 * b1
+ *   z1 = (a0 + a1) * (b0 + b1) - z0 - z2
+ * s is scratch space of at least bigint_words_karatsuba_scratch(n) words */
+static void bigint_words_karatsuba(bigint_word* r, const bigint_word* a, const bigint_word* b, size_t n, bigint_word* s) {
+    size_t m, h;
+    bigint_word* sa;
+    bigint_word* sb;
+    bigint_word* z1;
+    bigint_word* next;
+
+    if(n < BIGINT_KARATSUBA_THRESHOLD) {
+        bigint_words_mul_basecase(r, a, n, b, n);
+        return;
+    }
+
+    m = (n + 1) / 2;
+    h = n - m;
+
+    sa = s;
+    sb = sa + (m + 1);
+    z1 = sb + (m + 1);
+    next = z1 + 2 * (m + 1);
+
+    sa[m] = bigint_words_add(sa, a, m, &a[m], h);
+    sb[m] = bigint_words_add(sb, b, m, &b[m], h);
+
+    bigint_words_karatsuba(r, a, b, m, next);
+    bigint_words_karatsuba(&r[2 * m], &a[m], &b[m], h, next);
+    bigint_words_karatsuba(z1, sa, sb, m + 1, next);
+
+    bigint_words_sub(z1, z1, 2 * (m + 1), r, 2 * m);
+    bigint_words_sub(z1, z1, 2 * (m + 1), &r[2 * m], 2 * h);
+
+    /* z1 < W^(n+1), the words above that are zero */
+    bigint_words_add(&r[m], &r[m], 2 * n - m, z1, n + 1 < 2 * n - m ? n + 1 : 2 * n - m);
+}
+
+static size_t bigint_words_karatsuba_scratch(size_t n) {
+    size_t m;
+    size_t total = 0;
+
+    while(n >= BIGINT_KARATSUBA_THRESHOLD) {
+        m = (n + 1) / 2;
+        total += 4 * (m + 1);
+        n = m + 1;
+    }
+    return total;
+}
+#endif
+
+/* r[0..an+bn) = a * b. r must not overlap a or b */
+static int bigint_words_mul(bigint_word* r, const bigint_word* a, size_t an, const bigint_word* b, size_t bn) {
+#ifndef BIGINT_NO_MALLOC
+    int ret;
+    size_t off;
+    size_t len;
+    bigint_word* p;
+    bigint_word* s;
+    const bigint_word* t;
+
+    if(an < bn) {
+        t = a; a = b; b = t;
+        len = an; an = bn; bn = len;
+    }
+
+    if(bn >= BIGINT_KARATSUBA_THRESHOLD) {
+        /* the longer operand is multiplied in bn-word slices, with
+         * the final short slice handled recursively */
+        p = (bigint_word *)malloc((2 * bn + bigint_words_karatsuba_scratch(bn)) * BIGINT_WORD_SIZE);
+        if(p == NULL) return BIGINT_ENOMEM;
+        s = p + 2 * bn;
+
+        if(an == bn) {
+            bigint_words_karatsuba(r, a, b, bn, s);
+            free(p);
+            return 0;
         }
-        c->words[ib + a->size] = carry;
+
+        memset(r,0,(an + bn) * BIGINT_WORD_SIZE);
+        for(off = 0; off < an; off += bn) {
+            len = an - off < bn ? an - off : bn;
+            if(len == bn) {
+                bigint_words_karatsuba(p, &a[off], b, bn, s);
+            } else if( (ret = bigint_words_mul(p, b, bn, &a[off], len)) != 0) {
+                free(p);
+                return ret;
+            }
+            bigint_words_add(&r[off], &r[off], an + bn - off, p, len + bn);
+        }
+
+        free(p);
+        return 0;
     }
+#endif
+
+    bigint_words_mul_basecase(r, a, an, b, bn);
+    return 0;
+}
+
+static
+int bigint_mul_long(bigint* c, const bigint* a, const bigint* b) {
+    int r;
+
+    if(a->size == 0 || b->size == 0) {
+        c->sign = 0;
+        return bigint_resize(c, 0);
+    }
+
+    if( (r = bigint_resize(c, a->size + b->size)) != 0) return r;
+    if( (r = bigint_words_mul(c->words, a->words, a->size, b->words, b->size)) != 0) return r;
+    c->sign = a->sign ^ b->sign;
 
     bigint_truncate(c);
     return 0;
@@ -874,140 +1026,186 @@ static int bigint_mul_word(bigint* a, bigint_word val) {
     return 0;
 }
 
-#define BIGINT_MUL_CONST(x) \
-static inline int bigint_mul_const_ ## x (bigint* a) { \
-    int r; \
-    size_t i = 0; \
-    bigint_word carry = 0; \
-    bigint_word c = 0; \
-    for(i=0;i<a->size;i++) { \
-        c = bigint_word_mul_const_ ## x (&a->words[i]); \
-        c += bigint_word_add(&a->words[i],carry); \
-        carry = c; \
-    } \
-    if(carry) { \
-        if( (r = bigint_append(a, carry)) != 0) return r; \
-    } \
-    bigint_truncate(a); \
-    return 0; \
+/* value of a hex/decimal/octal/binary digit, 16 for anything else */
+static unsigned int bigint_digit_value(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 16;
 }
 
-BIGINT_MUL_CONST(10)
+/* parses digits of a power-of-two base (2^bits), placing each digit's bits
+ * directly instead of shifting the whole value per digit */
+static int bigint_from_string_pow2(bigint* b, const char* str, size_t len, unsigned int bits) {
+    size_t i, n, pos, w, o;
+    bigint_word d;
+    int r;
+
+    for(n = 0; n < len && str[n]; n++) {
+        if(bigint_digit_value(str[n]) >= (1U << bits)) return BIGINT_EINVAL;
+    }
+    len = n;
+
+    while(len && *str == '0') {
+        str++;
+        len--;
+    }
+
+    bigint_reset(b);
+    if(len == 0) return 0;
+    if(len / CHAR_BIT > b->limit) return BIGINT_ELIMIT;
+
+    n = (len * bits + BIGINT_WORD_BIT - 1) / BIGINT_WORD_BIT;
+    if( (r = bigint_resize(b,n)) != 0) return r;
+    memset(b->words,0,n * BIGINT_WORD_SIZE);
+
+    for(i = 0; i < len; i++) {
+        d = bigint_digit_value(str[len - 1 - i]);
+        pos = i * bits;
+        w = pos / BIGINT_WORD_BIT;
+        o = pos % BIGINT_WORD_BIT;
+        b->words[w] |= d << o;
+        if(o + bits > BIGINT_WORD_BIT) {
+            b->words[w + 1] |= d >> (BIGINT_WORD_BIT - o);
+        }
+    }
+
+    bigint_truncate(b);
+    return 0;
+}
 
 /* does NOT accept a string with a leading 0x - that's handled in
  * bigint_from_string. does NOT parse a leading +/-, also handled
  * in bigint_from_string */
 static int bigint_from_string_base16(bigint* b, const char* str, size_t len) {
+    return bigint_from_string_pow2(b,str,len,4);
+}
+
+/* reads len decimal digits, BIGINT_DEC_DIGITS at a time */
+static int bigint_from_string_base10_chunks(bigint* b, const char* str, size_t len) {
     bigint_word word;
     size_t i = 0;
+    size_t n;
     int r;
 
-    while(i < len && str[i]) {
-        if( (r = bigint_lshift_overwrite(b,4)) != 0) return r;
-        switch(str[i]) {
-            case '0': word = 0; break;
-            case '1': word = 1; break;
-            case '2': word = 2; break;
-            case '3': word = 3; break;
-            case '4': word = 4; break;
-            case '5': word = 5; break;
-            case '6': word = 6; break;
-            case '7': word = 7; break;
-            case '8': word = 8; break;
-            case '9': word = 9; break;
-            case 'A': word = 10; break;
-            case 'a': word = 10; break;
-            case 'B': word = 11; break;
-            case 'b': word = 11; break;
-            case 'C': word = 12; break;
-            case 'c': word = 12; break;
-            case 'D': word = 13; break;
-            case 'd': word = 13; break;
-            case 'E': word = 14; break;
-            case 'e': word = 14; break;
-            case 'F': word = 15; break;
-            case 'f': word = 15; break;
-            default: return BIGINT_EINVAL;
+    bigint_reset(b);
+
+    n = len % BIGINT_DEC_DIGITS;
+    if(n == 0) n = BIGINT_DEC_DIGITS;
+
+    while(i < len) {
+        word = 0;
+        while(n--) {
+            word = word * 10 + (bigint_word)(str[i++] - '0');
         }
+        if( (r = bigint_mul_word(b,BIGINT_DEC_CHUNK)) != 0) return r;
         if( (r = bigint_add_word(b,word)) != 0) return r;
-        i++;
+        n = BIGINT_DEC_DIGITS;
     }
 
     return 0;
 }
 
-/* does NOT parse a leading +/-, handled in bigint_from_string */
-static int bigint_from_string_base10(bigint* b, const char* str, size_t len) {
-    bigint_word word;
-    size_t i = 0;
+#ifndef BIGINT_NO_MALLOC
+/* the number of squarings needed so pows[level-1] is the largest power
+ * 10^(BIGINT_DEC_DIGITS * 2^k) with fewer than len digits */
+static size_t bigint_dec_levels(size_t len) {
+    size_t levels = 0;
+    while(levels < BIGINT_DEC_LEVELS && ((size_t)BIGINT_DEC_DIGITS << levels) < len) levels++;
+    return levels;
+}
+
+/* pows[i] = 10^(BIGINT_DEC_DIGITS * 2^i) */
+static int bigint_dec_pows(bigint* pows, size_t levels, size_t limit) {
+    size_t i;
     int r;
 
-    while(i < len && str[i]) {
-        if( (r = bigint_mul_const_10(b)) != 0) return r;
-        switch(str[i]) {
-            case '0': word = 0; break;
-            case '1': word = 1; break;
-            case '2': word = 2; break;
-            case '3': word = 3; break;
-            case '4': word = 4; break;
-            case '5': word = 5; break;
-            case '6': word = 6; break;
-            case '7': word = 7; break;
-            case '8': word = 8; break;
-            case '9': word = 9; break;
-            default: return BIGINT_EINVAL;
+    for(i = 0; i < levels; i++) {
+        pows[i].limit = limit;
+        if(i == 0) {
+            r = bigint_from_word(&pows[i],BIGINT_DEC_CHUNK);
+        } else {
+            r = bigint_mul(&pows[i],&pows[i-1],&pows[i-1]);
         }
-        if( (r = bigint_add_word(b,word)) != 0) return r;
-        i++;
+        if(r) return r;
     }
-
     return 0;
 }
 
-/* does NOT parse a leading +/-, handled in bigint_from_string */
-static int bigint_from_string_base8(bigint* b, const char* str, size_t len) {
-    bigint_word word;
-    size_t i = 0;
+/* splits the digits into high and low halves around a power of 10 and
+ * combines them as high * 10^low + low, so the large multiplications
+ * can use Karatsuba */
+static int bigint_from_string_base10_rec(bigint* b, const char* str, size_t len, const bigint* pows, size_t level) {
+    size_t low;
     int r;
+    bigint hi = BIGINT_INIT;
 
-    while(i < len && str[i]) {
-        if( (r = bigint_lshift_overwrite(b,3)) != 0) return r;
-        switch(str[i]) {
-            case '0': word = 0; break;
-            case '1': word = 1; break;
-            case '2': word = 2; break;
-            case '3': word = 3; break;
-            case '4': word = 4; break;
-            case '5': word = 5; break;
-            case '6': word = 6; break;
-            case '7': word = 7; break;
-            default: return BIGINT_EINVAL;
-        }
-        if( (r = bigint_add_word(b,word)) != 0) return r;
-        i++;
+    while(level && ((size_t)BIGINT_DEC_DIGITS << (level - 1)) >= len) level--;
+    if(level == 0 || len <= BIGINT_DEC_THRESHOLD) {
+        return bigint_from_string_base10_chunks(b,str,len);
     }
+    low = (size_t)BIGINT_DEC_DIGITS << (level - 1);
 
-    return 0;
+    hi.limit = pows[level - 1].limit;
+    if( (r = bigint_from_string_base10_rec(&hi, str, len - low, pows, level)) != 0) goto cleanup;
+    if( (r = bigint_from_string_base10_rec(b, &str[len - low], low, pows, level - 1)) != 0) goto cleanup;
+    if( (r = bigint_mul(&hi, &hi, &pows[level - 1])) != 0) goto cleanup;
+    r = bigint_add_unsigned(b, &hi);
+
+    cleanup:
+    bigint_free(&hi);
+    return r;
 }
+#endif
 
 /* does NOT parse a leading +/-, handled in bigint_from_string */
-static int bigint_from_string_base2(bigint* b, const char* str, size_t len) {
-    bigint_word word;
-    size_t i = 0;
+static int bigint_from_string_base10(bigint* b, const char* str, size_t len) {
+    size_t n;
+#ifndef BIGINT_NO_MALLOC
+    size_t i, levels;
     int r;
+    bigint pows[BIGINT_DEC_LEVELS];
+#endif
 
-    while(i < len && str[i]) {
-        if( (r = bigint_lshift_overwrite(b,1)) != 0) return r;
-        switch(str[i]) {
-            case '0': word = 0; break;
-            case '1': word = 1; break;
-            default: return BIGINT_EINVAL;
-        }
-        if( (r = bigint_add_word(b,word)) != 0) return r;
-        i++;
+    for(n = 0; n < len && str[n]; n++) {
+        if(bigint_digit_value(str[n]) >= 10) return BIGINT_EINVAL;
     }
+    len = n;
 
-    return 0;
+    while(len && *str == '0') {
+        str++;
+        len--;
+    }
+
+#ifndef BIGINT_NO_MALLOC
+    if(len > BIGINT_DEC_THRESHOLD) {
+        /* more digits than fit in the limit can be rejected up front,
+         * each byte holds less than 3 digits */
+        if(len / 3 > b->limit) return BIGINT_ELIMIT;
+
+        levels = bigint_dec_levels(len);
+        for(i = 0; i < levels; i++) bigint_init(&pows[i]);
+
+        /* intermediate products can be a word over the final size */
+        r = bigint_dec_pows(pows, levels, b->limit + BIGINT_BLOCK_SIZE * BIGINT_WORD_SIZE);
+        if(r == 0) r = bigint_from_string_base10_rec(b, str, len, pows, levels);
+
+        for(i = 0; i < levels; i++) bigint_free(&pows[i]);
+        return r;
+    }
+#endif
+
+    return bigint_from_string_base10_chunks(b,str,len);
+}
+
+/* does NOT parse a leading +/-, handled in bigint_from_string */
+static int bigint_from_string_base8(bigint* b, const char* str, size_t len) {
+    return bigint_from_string_pow2(b,str,len,3);
+}
+
+/* does NOT parse a leading +/-, handled in bigint_from_string */
+static int bigint_from_string_base2(bigint* b, const char* str, size_t len) {
+    return bigint_from_string_pow2(b,str,len,1);
 }
 
 static int bigint_from_string_base0(bigint* b, const char* str, size_t len) {
@@ -1129,7 +1327,7 @@ BIGINT_API
 void bigint_free(bigint* b) {
     bigint_reset(b);
 #ifndef BIGINT_NO_MALLOC
-    if(b->alloc != 0) {
+    if(b->alloc != 0 && !b->fixed) {
         free(b->words);
         b->words = NULL;
         b->alloc = 0;
@@ -1137,6 +1335,18 @@ void bigint_free(bigint* b) {
 #endif
 }
 
+#ifndef BIGINT_NO_MALLOC
+BIGINT_API
+void bigint_init_storage(bigint* b, bigint_word* words, size_t alloc) {
+    *b = *BIGINT_ZERO;
+    b->limit = BIGINT_DEFAULT_LIMIT;
+    b->words = words;
+    b->alloc = alloc;
+    b->fixed = 1;
+    if(alloc) words[0] = 0;
+}
+#endif
+
 BIGINT_API
 int bigint_copy(bigint *dest, const bigint *src) {
     int r;
@@ -1265,7 +1475,7 @@ int bigint_from_i32(bigint* b, int32_t val) {
 BIGINT_API
 int bigint_from_i64(bigint* b, int64_t val) {
     int r;
-    uint64_t uval = val < 0 ? -val : val;
+    uint64_t uval = val < 0 ? -(uint64_t)val : (uint64_t)val;
 
     r = bigint_from_u64(b, uval);
     if(r) return r;
@@ -1547,6 +1757,112 @@ void bigint_div_mod_ ## x (bigint* numerator, bigint_word* remainder) { \
 
 BIGINT_DIV_MOD_WORD(10)
 
+#if defined(BIGINT_DWORD_TYPE) && !defined(BIGINT_SINGLE_WORD_ONLY) && !defined(BIGINT_NO_MALLOC)
+#define BIGINT_DIV_KNUTH
+/* Knuth's Algorithm D (TAOCP vol. 2, 4.3.1), one quotient word per step.
+ * u is the m+n word numerator, v the n word denominator with a non-zero
+ * top word, both normalized into temporaries so the top bit of v is set */
+static int bigint_div_mod_knuth(bigint* quo, bigint* rem, const bigint* numerator, const bigint* denominator) {
+    int r;
+    size_t i, j, m, n, s;
+    bigint_word qhat, borrow, carry, lo;
+    bigint_word *u, *v, *q;
+    BIGINT_DWORD_TYPE num, rhat, p;
+
+    bigint un = BIGINT_INIT;
+    bigint vn = BIGINT_INIT;
+
+    n = denominator->size;
+    m = numerator->size - n;
+    s = BIGINT_WORD_BIT - bigint_word_bitlength(denominator->words[n - 1]);
+
+    /* the normalized numerator gets an extra top word */
+    un.limit = numerator->limit + BIGINT_BLOCK_SIZE * BIGINT_WORD_SIZE;
+    vn.limit = denominator->limit;
+    quo->limit = numerator->limit;
+
+    if( (r = bigint_resize(&un, numerator->size + 1)) != 0) goto cleanup;
+    if( (r = bigint_resize(&vn, n)) != 0) goto cleanup;
+    if( (r = bigint_resize(quo, m + 1)) != 0) goto cleanup;
+
+    u = un.words;
+    v = vn.words;
+    q = quo->words;
+
+    if(s) {
+        for(i = n - 1; i > 0; i--) {
+            v[i] = (denominator->words[i] << s) | (denominator->words[i-1] >> (BIGINT_WORD_BIT - s));
+        }
+        v[0] = denominator->words[0] << s;
+        u[m + n] = numerator->words[m + n - 1] >> (BIGINT_WORD_BIT - s);
+        for(i = m + n - 1; i > 0; i--) {
+            u[i] = (numerator->words[i] << s) | (numerator->words[i-1] >> (BIGINT_WORD_BIT - s));
+        }
+        u[0] = numerator->words[0] << s;
+    } else {
+        memcpy(v,denominator->words,n * BIGINT_WORD_SIZE);
+        memcpy(u,numerator->words,(m + n) * BIGINT_WORD_SIZE);
+        u[m + n] = 0;
+    }
+
+    j = m + 1;
+    while(j-- > 0) {
+        /* estimate the quotient word from the top two words of the
+         * remainder, it's at most 2 too large after the correction */
+        num = ((BIGINT_DWORD_TYPE)u[j + n] << BIGINT_WORD_BIT) | u[j + n - 1];
+        if(u[j + n] >= v[n - 1]) {
+            qhat = BIGINT_WORD_MASK;
+            rhat = num - (BIGINT_DWORD_TYPE)qhat * v[n - 1];
+        } else {
+            qhat = num / v[n - 1];
+            rhat = num % v[n - 1];
+        }
+        while(n > 1 && rhat <= BIGINT_WORD_MASK &&
+          (BIGINT_DWORD_TYPE)qhat * v[n - 2] > ((rhat << BIGINT_WORD_BIT) | u[j + n - 2])) {
+            qhat--;
+            rhat += v[n - 1];
+        }
+
+        /* u[j..j+n] -= qhat * v */
+        borrow = 0;
+        for(i = 0; i < n; i++) {
+            p = (BIGINT_DWORD_TYPE)qhat * v[i] + borrow;
+            lo = p & BIGINT_WORD_MASK;
+            borrow = p >> BIGINT_WORD_BIT;
+            borrow += bigint_word_sub(&u[i + j], lo);
+        }
+
+        if(bigint_word_sub(&u[j + n], borrow)) {
+            /* qhat was one too large, add v back */
+            qhat--;
+            carry = bigint_words_add(&u[j], &u[j], n, v, n);
+            u[j + n] += carry;
+        }
+
+        q[j] = qhat;
+    }
+
+    /* the remainder is in the low n words, undo the normalization */
+    if( (r = bigint_resize(rem, n)) != 0) goto cleanup;
+    if(s) {
+        for(i = 0; i < n - 1; i++) {
+            rem->words[i] = (u[i] >> s) | (u[i + 1] << (BIGINT_WORD_BIT - s));
+        }
+        rem->words[n - 1] = u[n - 1] >> s;
+    } else {
+        memcpy(rem->words,u,n * BIGINT_WORD_SIZE);
+    }
+
+    bigint_truncate(quo);
+    bigint_truncate(rem);
+
+    cleanup:
+    bigint_free(&un);
+    bigint_free(&vn);
+    return r;
+}
+#endif
+
 BIGINT_API
 int bigint_div_mod(bigint* quotient, bigint* remainder, const bigint* numerator, const bigint* denominator) {
     int r;
@@ -1556,6 +1872,14 @@ int bigint_div_mod(bigint* quotient, bigint* remainder, const bigint* numerator,
     bigint rem = BIGINT_INIT;
     bigint den = BIGINT_INIT;
 
+#ifdef BIGINT_DIV_KNUTH
+    if(denominator->size != 0 && bigint_cmp_abs(numerator,denominator) >= 0) {
+        if( (r = bigint_div_mod_knuth(&quo, &rem, numerator, denominator)) != 0) goto cleanup;
+        rem.limit = numerator->limit;
+        goto done;
+    }
+#endif
+
     if( (r = bigint_copy(&rem, numerator)) != 0) goto cleanup;
     if( (r = bigint_copy(&den, denominator)) != 0) goto cleanup;
 
@@ -1572,8 +1896,11 @@ int bigint_div_mod(bigint* quotient, bigint* remainder, const bigint* numerator,
         }
     }
 
-    quo.sign = numerator->sign ^ denominator->sign;
-    rem.sign = numerator->sign;
+#ifdef BIGINT_DIV_KNUTH
+    done:
+#endif
+    quo.sign = quo.size && (numerator->sign ^ denominator->sign);
+    rem.sign = rem.size && numerator->sign;
 
     if( (r = bigint_copy(quotient, &quo)) != 0) goto cleanup;
     if( (r = bigint_copy(remainder, &rem)) != 0) goto cleanup;
@@ -1631,95 +1958,128 @@ static size_t bigint_len_string_base2(const bigint* b) {
 
 static const char* const bigint_alphabet = "0123456789abcdef";
 
-BIGINT_NONNULL1
-static size_t bigint_to_string_base16(char* str, size_t len, bigint* b) {
-    size_t u = 0;
+/* writes the digits of a power-of-two base (2^bits) straight from the
+ * words, when len is too short the lowest digits are dropped */
+static size_t bigint_to_string_pow2(char* str, size_t len, const bigint* b, unsigned int bits) {
+    size_t i, n, skip, pos, w, o;
+    bigint_word d;
 
     if(b->size == 0) {
         str[0] = '0';
         return 1;
     }
 
-    while( (u = bigint_len_string_base16(b)) > len) {
-        bigint_rshift_overwrite_small_4(b);
-    }
-    len = u;
+    n = (bigint_bitlength(b) + bits - 1) / bits;
+    skip = n > len ? n - len : 0;
+    n -= skip;
 
-    while(b->size) {
-        str[--u] = bigint_alphabet[b->words[0] & 0x0F];
-        bigint_rshift_overwrite_small_4(b);
+    for(i = 0; i < n; i++) {
+        pos = (skip + i) * bits;
+        w = pos / BIGINT_WORD_BIT;
+        o = pos % BIGINT_WORD_BIT;
+        d = b->words[w] >> o;
+        if(o + bits > BIGINT_WORD_BIT && w + 1 < b->size) {
+            d |= b->words[w + 1] << (BIGINT_WORD_BIT - o);
+        }
+        str[n - 1 - i] = bigint_alphabet[d & ((1U << bits) - 1)];
     }
 
-    return len;
+    return n;
 }
 
-BIGINT_NONNULL1
-static size_t bigint_to_string_base10(char* str, size_t len, bigint* b) {
+/* writes b (which is consumed) as exactly len digits, zero-padded,
+ * BIGINT_DEC_DIGITS at a time. b must be less than 10^len */
+static void bigint_to_string_base10_chunks(char* str, size_t len, bigint* b) {
     bigint_word rem;
-    size_t u = 0;
+    size_t i;
 
-    if(b->size == 0) {
-        str[0] = '0';
-        return 1;
+    while(b->size) {
+        bigint_div_mod_word(b,&rem,BIGINT_DEC_CHUNK);
+        for(i = 0; i < BIGINT_DEC_DIGITS && len; i++) {
+            str[--len] = bigint_alphabet[rem % 10];
+            rem /= 10;
+        }
     }
+    while(len) str[--len] = '0';
+}
 
-    while( (u = bigint_len_string_base10(b)) > len) {
-        bigint_div_mod_10(b,&rem);
-    }
-    len = u;
+#ifndef BIGINT_NO_MALLOC
+/* writes b as exactly len digits, zero-padded, by splitting it around
+ * a power of 10 into high and low halves. b is consumed */
+static int bigint_to_string_base10_rec(char* str, size_t len, bigint* b, const bigint* pows, size_t level) {
+    size_t low;
+    int r;
+    bigint quo = BIGINT_INIT;
+    bigint rem = BIGINT_INIT;
 
-    while(b->size) {
-        bigint_div_mod_10(b,&rem);
-        str[--u] = bigint_alphabet[rem];
+    while(level && ((size_t)BIGINT_DEC_DIGITS << (level - 1)) >= len) level--;
+    if(level == 0 || len <= BIGINT_DEC_THRESHOLD) {
+        bigint_to_string_base10_chunks(str,len,b);
+        return 0;
     }
+    low = (size_t)BIGINT_DEC_DIGITS << (level - 1);
 
-    if(u) {
-        memmove(&str[0],&str[u],len-u);
-        len -= u;
+    if(bigint_cmp_abs(b,&pows[level - 1]) < 0) {
+        memset(str,'0',len - low);
+        return bigint_to_string_base10_rec(&str[len - low], low, b, pows, level - 1);
     }
 
-    return len;
+    quo.limit = rem.limit = b->limit;
+    if( (r = bigint_div_mod(&quo, &rem, b, &pows[level - 1])) != 0) goto cleanup;
+    if( (r = bigint_to_string_base10_rec(&str[len - low], low, &rem, pows, level - 1)) != 0) goto cleanup;
+    r = bigint_to_string_base10_rec(str, len - low, &quo, pows, level);
+
+    cleanup:
+    bigint_free(&quo);
+    bigint_free(&rem);
+    return r;
 }
+#endif
 
 BIGINT_NONNULL1
-static size_t bigint_to_string_base8(char* str, size_t len, bigint* b) {
+static size_t bigint_to_string_base10(char* str, size_t len, bigint* b) {
+    bigint_word rem;
     size_t u = 0;
+#ifndef BIGINT_NO_MALLOC
+    size_t i, levels;
+    int r;
+    bigint pows[BIGINT_DEC_LEVELS];
+#endif
 
     if(b->size == 0) {
         str[0] = '0';
         return 1;
     }
 
-    while( (u = bigint_len_string_base8(b)) > len) {
-        bigint_rshift_overwrite_small_3(b);
+    /* only the leading digits fit, drop digits until they do */
+    while( (u = bigint_len_string_base10(b)) > len) {
+        bigint_div_mod_10(b,&rem);
     }
     len = u;
 
-    while(b->size) {
-        str[--u] = bigint_alphabet[b->words[0] & 0x07];
-        bigint_rshift_overwrite_small_3(b);
-    }
-
-    return len;
-}
-
-BIGINT_NONNULL1
-static size_t bigint_to_string_base2(char* str, size_t len, bigint* b) {
-    size_t u = 0;
+#ifndef BIGINT_NO_MALLOC
+    if(len > BIGINT_DEC_THRESHOLD) {
+        levels = bigint_dec_levels(len);
+        for(i = 0; i < levels; i++) bigint_init(&pows[i]);
 
-    if(b->size == 0) {
-        str[0] = '0';
-        return 1;
-    }
+        r = bigint_dec_pows(pows, levels, b->limit + BIGINT_BLOCK_SIZE * BIGINT_WORD_SIZE);
+        if(r == 0) r = bigint_to_string_base10_rec(str, len, b, pows, levels);
 
-    while( (u = bigint_bitlength(b)) > len) {
-        bigint_rshift_overwrite_small_1(b);
+        for(i = 0; i < levels; i++) bigint_free(&pows[i]);
+        if(r) return 0;
+    } else {
+        bigint_to_string_base10_chunks(str, len, b);
     }
-    len = u;
+#else
+    bigint_to_string_base10_chunks(str, len, b);
+#endif
 
-    while(b->size) {
-        str[--u] = bigint_alphabet[b->words[0] & 0x01];
-        bigint_rshift_overwrite_small_1(b);
+    /* the length estimate can be one digit over */
+    u = 0;
+    while(u + 1 < len && str[u] == '0') u++;
+    if(u) {
+        memmove(&str[0],&str[u],len-u);
+        len -= u;
     }
 
     return len;
@@ -1782,17 +2142,20 @@ size_t bigint_to_string(char* str, size_t len, const bigint* b, unsigned int bas
     }
     if(len == 0) return u;
 
-    /* TODO can this copy be avoided? */
-    if( (r = bigint_copy(&tmp,b)) != 0) return 0;
     switch(base) {
-        case 2: res = bigint_to_string_base2(str,len,&tmp); break;
-        case 8: res = bigint_to_string_base8(str,len,&tmp); break;
+        case 2: res = bigint_to_string_pow2(str,len,b,1); break;
+        case 8: res = bigint_to_string_pow2(str,len,b,3); break;
         case 0: /* fall-through */
-        case 10: res = bigint_to_string_base10(str,len,&tmp); break;
-        case 16: res = bigint_to_string_base16(str,len,&tmp); break;
+        case 10: {
+            /* base 10 conversion consumes its input */
+            if( (r = bigint_copy(&tmp,b)) != 0) return 0;
+            res = bigint_to_string_base10(str,len,&tmp);
+            bigint_free(&tmp);
+            break;
+        }
+        case 16: res = bigint_to_string_pow2(str,len,b,4); break;
         default: break;
     }
-    bigint_free(&tmp);
 
     if(res != 0) res += u;
     return res;
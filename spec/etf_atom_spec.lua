@@ -9,10 +9,9 @@ describe('atom', function()
 
   it('allows creating atoms', function()
     local a = etf.atom('a')
-    assert.are.same({
-      atom = 'a',
-      utf8 = true,
-    },a)
+    assert.is_userdata(a)
+    assert.are.equal('a',a.atom)
+    assert.is_true(a.utf8)
     local mt = debug.getmetatable(a)
     assert.are.same(etf.atom_mt,mt)
   end)
@@ -25,10 +24,8 @@ describe('atom', function()
 
   it('automatically calls tostring', function()
     local a = etf.atom(5)
-    assert.are.same({
-      atom = '5',
-      utf8 = true,
-    },a)
+    assert.are.equal('5',a.atom)
+    assert.is_true(a.utf8)
     local mt = debug.getmetatable(a)
     assert.are.same(etf.atom_mt,mt)
   end)
@@ -44,6 +41,46 @@ describe('atom', function()
     local c = etf.atom('false')
     assert.is_true(a == b)
     assert.is_false(a == c)
+    assert.is_true(etf.atom('true',false) == a)
+  end)
+
+  it('interns atoms', function()
+    assert.are.equal(rawequal(etf.atom('ok'),etf.atom('ok')),true)
+    assert.are.equal(rawequal(etf.atom('ok'),etf.atom('error')),false)
+    assert.are.equal(rawequal(etf.atom('ok'),etf.atom('ok',false)),false)
+    assert.are.equal(rawequal(etf.atom('nil'),etf.null),true)
+    assert.is_false(etf.atom('ok',false).utf8)
+  end)
+
+  it('encodes interned atoms', function()
+    assert.are.equal('\131\119\2ok',etf.encode(etf.atom('ok')))
+    assert.are.equal('\131\100\0\2ok',etf.encode(etf.atom('ok',false)))
+    assert.are.equal('\131\118\1\0' .. string.rep('a',256),etf.encode(etf.atom(string.rep('a',256))))
+  end)
+
+  it('encodes tables with the atom metatable', function()
+    assert.are.equal('\131\119\2ok',etf.encode(setmetatable({ atom = 'ok', utf8 = true },etf.atom_mt)))
+    assert.are.equal('\131\100\0\2ok',etf.encode(setmetatable({ atom = 'ok' },etf.atom_mt)))
+    assert.has_error(function()
+      etf.encode(setmetatable({},etf.atom_mt))
+    end)
+  end)
+
+  it('accepts tables with the atom metatable', function()
+    local a = setmetatable({ atom = 'nonode@nohost' },etf.atom_mt)
+    local b = setmetatable({ atom = 'nonode@nohost' },etf.atom_mt)
+    assert.are.same('nonode@nohost',tostring(a))
+    assert.is_nil(a.other)
+    assert.is_true(a == b)
+    assert.are.equal(etf.atom('nonode@nohost',false),etf.atom(a))
+    assert.is_true(etf.atom(a) == etf.atom('nonode@nohost'))
+
+    local pid = etf.pid({ node = a, id = 1, serial = 2, creation = 3 })
+    assert.are.equal(etf.atom('nonode@nohost',false),pid.node)
+    assert.are.same(etf.encode(etf.pid({ node = etf.atom('nonode@nohost',false), id = 1, serial = 2, creation = 3 })),
+      etf.encode(pid))
+    local port = etf.port({ node = a, id = 1, creation = 3 })
+    assert.are.equal(etf.atom('nonode@nohost',false),port.node)
   end)
 
 end)
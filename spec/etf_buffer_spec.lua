@@ -0,0 +1,109 @@
+require('busted.runner')()
+
+local etf = require'etf'
+
+describe('etf.buffer', function()
+  it('is a function', function()
+    assert.is_function(etf.buffer)
+  end)
+
+  it('creates buffers', function()
+    local buf = etf.buffer()
+    assert.is.userdata(buf)
+    assert.are.same('etf.buffer',debug.getmetatable(buf).__name)
+    assert.are.same(0,buf:len())
+    assert.are.same('',buf:tostring())
+  end)
+
+  it('accepts an initial size', function()
+    local buf = etf.buffer(1024)
+    assert.are.same(0,buf:len())
+  end)
+
+  it('rejects invalid sizes', function()
+    assert.has_error(function()
+      etf.buffer(-1)
+    end)
+    assert.has_error(function()
+      etf.buffer():reserve(-1)
+    end)
+    assert.has_error(function()
+      etf.buffer(1.5)
+    end)
+    assert.has_error(function()
+      etf.buffer():reserve(1/0)
+    end)
+    assert.has_error(function()
+      etf.buffer():reserve(0/0)
+    end)
+  end)
+
+  it('supports reserve and clear', function()
+    local enc = etf.encoder()
+    local buf = etf.buffer()
+    assert.are.equal(buf,buf:reserve(100))
+    enc:encode_into(buf,1)
+    assert.are.same(3,buf:len())
+    assert.are.equal(buf,buf:clear())
+    assert.are.same(0,buf:len())
+    assert.are.same('',tostring(buf))
+  end)
+
+  describe('encoder:encode_into', function()
+    it('appends encoded terms', function()
+      local enc = etf.encoder()
+      local buf = etf.buffer()
+      assert.are.same(3,enc:encode_into(buf,1))
+      assert.are.same(7,enc:encode_into(buf,'a'))
+      assert.are.same(enc:encode(1) .. enc:encode('a'),tostring(buf))
+      assert.are.same(10,buf:len())
+    end)
+
+    it('appends compressed terms', function()
+      local enc = etf.encoder({ compress = true })
+      local buf = etf.buffer()
+      enc:encode_into(buf,1)
+      local first = buf:len()
+      enc:encode_into(buf,'hello')
+      local str = buf:tostring()
+      assert.are.same(1,etf.decode(string.sub(str,1,first)))
+      assert.are.same('hello',etf.decode(string.sub(str,first+1)))
+    end)
+
+    it('leaves the buffer untouched on error', function()
+      local enc = etf.encoder()
+      local buf = etf.buffer()
+      enc:encode_into(buf,1)
+      assert.has_error(function()
+        enc:encode_into(buf,{ 1, 2, function() end })
+      end)
+      assert.are.same(enc:encode(1),tostring(buf))
+    end)
+
+    it('does not keep using the buffer afterwards', function()
+      local enc = etf.encoder()
+      local map = { a = 1, b = 'two', c = { d = 3 } }
+      do
+        local buf = etf.buffer()
+        enc:encode_into(buf,map)
+        buf = etf.buffer()
+        assert.has_error(function()
+          enc:encode_into(buf,{ 1, print })
+        end)
+      end
+      collectgarbage()
+      collectgarbage()
+      assert.are.same(#enc:encode(map),enc:size(map))
+    end)
+
+    it('requires a buffer', function()
+      local enc = etf.encoder()
+      assert.has_error(function()
+        enc:encode_into('hello',1)
+      end)
+      assert.has_error(function()
+        enc:encode_into(etf.buffer())
+      end)
+    end)
+  end)
+end)
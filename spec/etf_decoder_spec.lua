@@ -55,6 +55,11 @@ describe('etf.decoder', function()
       assert.are.same(res,dec:decode(bin))
     end)
 
+    it('ZLIB-compressed data that inflates beyond one buffer', function()
+      local res = string.rep('abc',10000)
+      assert.are.same(res,dec:decode(etf.encode(res,{ compress = 9 })))
+    end)
+
 
     it('ATOM_CACHE_REF as nil', function()
       local bin = '\131\82\1'
@@ -383,6 +388,24 @@ describe('etf.decoder', function()
     end)
 
     describe('LARGE_BIG_EXT', function()
+      it('round-trips thousands of bytes', function()
+        local digits = {}
+        for i=1,3000 do
+          digits[i] = string.char((i * 7) % 256)
+        end
+        digits[3000] = '\1'
+        local bin = '\131\111\0\0\11\184\1' .. table.concat(digits)
+        local val = dec:decode(bin)
+        assert.are.same(etf.integer_mt,debug.getmetatable(val))
+        assert.are.same(bin,etf.encode(val))
+        assert.are.same(tostring(val),tostring(dec:decode(etf.encode(val,{ compress = 9 }))))
+      end)
+
+      it('ignores leading zero bytes', function()
+        local bin = '\131\111\0\0\1\4\0' .. '\1' .. string.rep('\0',259)
+        assert.are.same(1,dec:decode(bin))
+      end)
+
       it('1', function()
         local bin = table.concat({
           '\131\111',
@@ -804,4 +827,42 @@ describe('etf.decoder', function()
     end)
   end)
 
+  describe('default atom_map', function()
+    local map = { ['true'] = true, ['false'] = false, ['nil'] = etf.null }
+    local function atom_map(str, is_key)
+      if is_key then return str end
+      local v = map[str]
+      if v == nil then return str end
+      return v
+    end
+
+    local fast = etf.decoder()
+    local slow = etf.decoder({ atom_map = atom_map })
+
+    local bin = etf.encode({
+      a = true, b = false, c = etf.null, d = etf.atom('hello'),
+      e = { etf.atom('true'), etf.atom('nil'), etf.atom('atomwithalongname') },
+      f = etf.map({ [etf.atom('true')] = 1, [etf.atom('nil')] = 2 }),
+    })
+
+    it('matches an equivalent Lua atom_map', function()
+      assert.are.same(slow:decode(bin),fast:decode(bin))
+    end)
+
+    it('decodes special atoms', function()
+      local val = fast:decode(bin)
+      assert.are.same(true,val.a)
+      assert.are.same(false,val.b)
+      assert.are.equal(etf.null,val.c)
+      assert.are.same('hello',val.d)
+      assert.are.same(1,val.f['true'])
+      assert.are.same(2,val.f['nil'])
+    end)
+
+    it('matches with compressed data', function()
+      local cbin = etf.encode(etf.decode(bin),{ compress = true })
+      assert.are.same(slow:decode(cbin),fast:decode(cbin))
+    end)
+  end)
+
 end)
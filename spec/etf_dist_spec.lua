@@ -0,0 +1,241 @@
+require('busted.runner')()
+
+local etf = require'etf'
+
+local function atoms(n)
+  local t = {}
+  for i=1,n do
+    t[i] = etf.atom('atom_' .. i)
+  end
+  return etf.tuple(t)
+end
+
+describe('distribution messages', function()
+  describe('encoder:encode_dist', function()
+    it('should round-trip a control message and message', function()
+      local enc = etf.encoder()
+      local dec = etf.decoder()
+      local out_cache = etf.atom_cache()
+      local in_cache = etf.atom_cache()
+      local control = etf.tuple({ 6, '', etf.atom('net_kernel') })
+      local message = etf.tuple({ etf.atom('is_auth'), true, false, 5 })
+
+      local msg = enc:encode_dist(out_cache,control,message)
+      assert.are.equal('\131\68',msg:sub(1,2))
+      local c, m = dec:decode_dist(in_cache,msg)
+      assert.are.same(dec:decode(enc:encode(control)),c)
+      assert.are.same(dec:decode(enc:encode(message)),m)
+    end)
+
+    it('should return only the control message when there is no message', function()
+      local enc = etf.encoder()
+      local dec = etf.decoder()
+      local msg = enc:encode_dist(etf.atom_cache(),etf.tuple({ 1, etf.atom('a') }))
+      local c, m = dec:decode_dist(etf.atom_cache(),msg)
+      assert.are.same(dec:decode(enc:encode(etf.tuple({ 1, etf.atom('a') }))),c)
+      assert.is_nil(m)
+      assert.are.equal(1,select('#',dec:decode_dist(etf.atom_cache(),msg)))
+    end)
+
+    it('should only send new atoms once', function()
+      local enc = etf.encoder()
+      local dec = etf.decoder()
+      local out_cache = etf.atom_cache()
+      local in_cache = etf.atom_cache()
+      local control = etf.tuple({ 2, '', etf.atom('some_registered_name') })
+
+      local first = enc:encode_dist(out_cache,control,'hello')
+      local second = enc:encode_dist(out_cache,control,'hello')
+      assert.is_true(#second < #first)
+      assert.is_nil(second:find('some_registered_name',1,true))
+
+      local c1, m1 = dec:decode_dist(in_cache,first)
+      local c2, m2 = dec:decode_dist(in_cache,second)
+      assert.are.same(c1,c2)
+      assert.are.equal('hello',m1)
+      assert.are.equal('hello',m2)
+    end)
+
+    it('should fall back to plain atoms when the header is full', function()
+      local enc = etf.encoder()
+      local dec = etf.decoder()
+      local control = atoms(300)
+      local msg = enc:encode_dist(etf.atom_cache(),control)
+      assert.are.equal(255,msg:byte(3))
+      local c = dec:decode_dist(etf.atom_cache(),msg)
+      assert.are.same(dec:decode(enc:encode(control)),c)
+    end)
+
+    it('should encode node names in pids as references', function()
+      local enc = etf.encoder()
+      local dec = etf.decoder()
+      local out_cache = etf.atom_cache()
+      local in_cache = etf.atom_cache()
+      local pid = etf.pid({ node = 'nonode@noname', id = 5, serial = 2, creation = 1 })
+      local control = etf.tuple({ 2, '', pid })
+
+      local first = enc:encode_dist(out_cache,control)
+      local second = enc:encode_dist(out_cache,control)
+      assert.is_nil(second:find('nonode@noname',1,true))
+      assert.are.same(pid,dec:decode_dist(in_cache,first)[3])
+      assert.are.same(pid,dec:decode_dist(in_cache,second)[3])
+    end)
+
+    it('should not update the cache when encoding fails', function()
+      local enc = etf.encoder()
+      local dec = etf.decoder()
+      local out_cache = etf.atom_cache()
+      local in_cache = etf.atom_cache()
+
+      assert.has_error(function()
+        enc:encode_dist(out_cache,etf.tuple({ etf.atom('lost'), print }))
+      end)
+      local msg = enc:encode_dist(out_cache,etf.tuple({ etf.atom('lost') }))
+      assert.is_truthy(msg:find('lost',1,true))
+      assert.are.same(dec:decode(enc:encode(etf.tuple({ etf.atom('lost') }))),
+        dec:decode_dist(in_cache,msg))
+    end)
+
+    it('should not leave the atom cache in use after a failure', function()
+      local enc = etf.encoder()
+      local dec = etf.decoder()
+
+      assert.has_error(function()
+        enc:encode_dist(etf.atom_cache(),etf.tuple({ etf.atom('hello'), print }))
+      end)
+      collectgarbage()
+      collectgarbage()
+      local segs = enc:encode_segments(etf.atom('hello'))
+      assert.are.same(enc:encode(etf.atom('hello')),table.concat(segs))
+      assert.are.same('hello',dec:decode(table.concat(segs)))
+    end)
+
+    it('should split messages into fragments', function()
+      local enc = etf.encoder()
+      local dec = etf.decoder()
+      local out_cache = etf.atom_cache()
+      local in_cache = etf.atom_cache()
+      local control = etf.tuple({ 2, '', etf.atom('name') })
+      local message = string.rep('x',100)
+
+      local frags = enc:encode_dist(out_cache,control,message,16)
+      assert.is_true(#frags > 1)
+      assert.are.equal('\131\69',frags[1]:sub(1,2))
+      for i=2,#frags do
+        assert.are.equal('\131\70',frags[i]:sub(1,2))
+        assert.are.equal(frags[1]:sub(3,10),frags[i]:sub(3,10))
+      end
+      assert.are.equal('\0\0\0\0\0\0\0\1',frags[#frags]:sub(11,18))
+
+      for i=1,#frags-1 do
+        assert.are.equal(0,select('#',dec:decode_dist(in_cache,frags[i])))
+      end
+      local c, m = dec:decode_dist(in_cache,frags[#frags])
+      assert.are.same(dec:decode(enc:encode(control)),c)
+      assert.are.equal(message,m)
+
+      local single = enc:encode_dist(out_cache,control,'y',32)
+      assert.are.equal(1,#single)
+      assert.are.equal('\131\68',single[1]:sub(1,2))
+    end)
+
+    it('should reject invalid fragment sizes', function()
+      local enc = etf.encoder()
+      for _, size in ipairs({ 0, 1.5, 1/0, 0/0 }) do
+        assert.has_error(function()
+          enc:encode_dist(etf.atom_cache(),etf.tuple({ 1 }),'hello',size)
+        end)
+      end
+    end)
+
+    it('should use the packet header', function()
+      local enc = etf.encoder({ packet = 4 })
+      local dec = etf.decoder({ packet = 4 })
+      local msg = enc:encode_dist(etf.atom_cache(),etf.tuple({ etf.atom('a') }))
+      assert.are.equal('\0\0',msg:sub(1,2))
+      assert.are.equal(#msg - 4,msg:byte(3) * 256 + msg:byte(4))
+      assert.are.same({'a'},dec:decode_dist(etf.atom_cache(),msg))
+      assert.are.equal(0,select('#',dec:decode_dist(etf.atom_cache(),'\0\0\0\0')))
+    end)
+  end)
+
+  describe('decoder:decode_dist', function()
+    it('should decode atom cache references', function()
+      local dec = etf.decoder()
+      local cache = etf.atom_cache()
+      -- one new entry, segment 0, internal index 5
+      local first = '\131\68\1\8\5\3' .. 'foo' .. '\104\1\82\0'
+      local second = '\131\68\1\0\5\104\1\82\0'
+      assert.are.same({'foo'},dec:decode_dist(cache,first))
+      assert.are.same({'foo'},dec:decode_dist(cache,second))
+    end)
+
+    it('should decode long atoms', function()
+      local dec = etf.decoder()
+      local name = string.rep('a',300)
+      local msg = '\131\68\1\24\5\1\44' .. name .. '\104\1\82\0'
+      assert.are.same({name},dec:decode_dist(etf.atom_cache(),msg))
+    end)
+
+    it('should reject references to unset entries', function()
+      local dec = etf.decoder()
+      assert.has_error(function()
+        dec:decode_dist(etf.atom_cache(),'\131\68\1\0\5\104\1\82\0')
+      end)
+      assert.has_error(function()
+        dec:decode_dist(etf.atom_cache(),'\131\68\0\104\1\82\0')
+      end)
+    end)
+
+    it('should not preallocate for large fragment ids', function()
+      local dec = etf.decoder()
+      local cache = etf.atom_cache()
+      assert.is_nil(dec:decode_dist(cache,'\131\69\0\0\0\0\0\0\0\1\0\0\0\0\127\255\255\240\0\97\1'))
+      assert.has_error(function()
+        dec:decode_dist(cache,'\131\70\0\0\0\0\0\0\0\1\0\0\0\0\0\0\0\1\97\2')
+      end)
+    end)
+
+    it('should compare fragment ids exactly', function()
+      local dec = etf.decoder()
+      local cache = etf.atom_cache()
+      -- starts at 2^53 + 2, so 2^53 + 1 is next, which a double can't tell from 2^53
+      dec:decode_dist(cache,'\131\69\0\0\0\0\0\0\0\1\0\32\0\0\0\0\0\2\0\97\1')
+      assert.has_error(function()
+        dec:decode_dist(cache,'\131\70\0\0\0\0\0\0\0\1\0\32\0\0\0\0\0\0\97\2')
+      end)
+      assert.is_nil(dec:decode_dist(cache,'\131\70\0\0\0\0\0\0\0\1\0\32\0\0\0\0\0\1\97\2'))
+    end)
+
+    it('should limit the number of unfinished fragmented messages', function()
+      local dec = etf.decoder()
+      local cache = etf.atom_cache()
+      local function header(seq)
+        return '\131\69\0\0\0\0\0\0\0' .. string.char(seq) .. '\0\0\0\0\0\0\0\2\0\97\1'
+      end
+      for seq=1,64 do
+        dec:decode_dist(cache,header(seq))
+      end
+      -- restarting a sequence doesn't count against the limit
+      dec:decode_dist(cache,header(1))
+      assert.has_error(function()
+        dec:decode_dist(cache,header(65))
+      end)
+      -- finishing one makes room for another
+      local values = { dec:decode_dist(cache,'\131\70\0\0\0\0\0\0\0\1\0\0\0\0\0\0\0\1\97\2') }
+      assert.are.same({ 1, 2 },values)
+      dec:decode_dist(cache,header(65))
+    end)
+
+    it('should reject out of order fragments', function()
+      local enc = etf.encoder()
+      local dec = etf.decoder()
+      local frags = enc:encode_dist(etf.atom_cache(),etf.tuple({ 1 }),string.rep('x',100),16)
+      local cache = etf.atom_cache()
+      dec:decode_dist(cache,frags[1])
+      assert.has_error(function()
+        dec:decode_dist(cache,frags[3])
+      end)
+    end)
+  end)
+end)
@@ -680,6 +680,738 @@ describe('etf.encoder', function()
     end)
   end)
 
-end)
+  describe('arena', function()
+    it('reuses the encoder across calls', function()
+      local enc = etf.encoder()
+      local big = string.rep('a',100000)
+      assert.are.same(big,etf.decode(enc:encode(big)))
+      assert.are.same('\131\97\1',enc:encode(1))
+      assert.are.same(big,etf.decode(enc:encode(big)))
+    end)
+
+    it('reuses compression state across calls', function()
+      local enc = etf.encoder({ compress = true })
+      for _=1,3 do
+        local comp = enc:encode('hello')
+        assert.are.same(string.sub(comp,1,2),'\131\80')
+        assert.are.same('hello',etf.decode(comp))
+      end
+    end)
+
+    it('accepts an arena_max', function()
+      local enc = etf.encoder({ arena_max = 0 })
+      local big = string.rep('a',100000)
+      assert.are.same(big,etf.decode(enc:encode(big)))
+      assert.are.same('\131\97\1',enc:encode(1))
+    end)
+
+    it('rejects invalid arena_max values', function()
+      assert.has_error(function()
+        etf.encoder({ arena_max = -1 })
+      end)
+      assert.has_error(function()
+        etf.encoder({ arena_max = 'hi there' })
+      end)
+      assert.has_error(function()
+        etf.encoder({ arena_max = 1.5 })
+      end)
+      assert.has_error(function()
+        etf.encoder({ arena_max = 1/0 })
+      end)
+      assert.has_error(function()
+        etf.encoder({ arena_max = 0/0 })
+      end)
+    end)
+  end)
+
+  describe('size', function()
+    local enc = etf.encoder()
+
+    it('matches the encoded length', function()
+      local values = {
+        nil, true, false, 0, 255, -255, 1255, 1.5, 'hello',
+        string.rep('a',5000), {}, { 1, 2, 3 }, { a = 1, b = { c = 'd' } },
+        etf.integer('123456789012345678901234567890'),
+        etf.atom('hello'), etf.string('hi'), etf.binary('hi'),
+        etf.tuple({ 1, 'a', etf.atom('b') }),
+        etf.list({ 1, 2 }), etf.map({ x = 1 }),
+        etf.float(2.5),
+      }
+      for i=1,21 do
+        assert.are.same(#enc:encode(values[i]),enc:size(values[i]))
+      end
+    end)
+
+    it('reports the uncompressed size for compressed encoders', function()
+      local comp = etf.encoder({ compress = true })
+      local value = string.rep('a',5000)
+      assert.are.same(#enc:encode(value),comp:size(value))
+    end)
+
+    it('requires a value', function()
+      assert.has_error(function()
+        enc:size()
+      end)
+    end)
+
+    it('produces the same errors as encode', function()
+      assert.has_error(function()
+        enc:size(function() end)
+      end)
+    end)
+  end)
+
+  describe('encode_stream', function()
+    local function collector()
+      local chunks = {}
+      return chunks, function(chunk)
+        chunks[#chunks+1] = chunk
+      end
+    end
+
+    it('passes the encoded term to a function', function()
+      local enc = etf.encoder()
+      local value = { a = 1, b = { 1, 2, 3 }, c = 'hello' }
+      local chunks, sink = collector()
+      local total = enc:encode_stream(value,sink)
+      assert.are.same(enc:encode(value),table.concat(chunks))
+      assert.are.same(#enc:encode(value),total)
+    end)
+
+    it('does not keep the sink after an error', function()
+      local enc = etf.encoder()
+      local value = { string.rep('a',1000), string.rep('b',1000) }
+      local chunks, sink = collector()
+      assert.has_error(function()
+        enc:encode_stream({ string.rep('a',1000), print },sink,100)
+      end)
+      local n = #chunks
+      assert.are.same(etf.encoder():encode(value),enc:encode(value))
+      assert.are.same(#etf.encoder():encode(value),enc:size(value))
+      assert.are.same(etf.encoder():encode(value),table.concat(enc:encode_segments(value)))
+      assert.are.same(n,#chunks)
+    end)
+
+    it('flushes fixed-size chunks', function()
+      local enc = etf.encoder()
+      local value = { string.rep('a',1000), string.rep('b',1000) }
+      local chunks, sink = collector()
+      enc:encode_stream(value,sink,100)
+      assert.are.same(enc:encode(value),table.concat(chunks))
+      for i=1,#chunks - 1 do
+        assert.are.same(100,#chunks[i])
+      end
+      assert.is_true(#chunks[#chunks] <= 100)
+    end)
+
+    it('streams compressed terms', function()
+      local enc = etf.encoder({ compress = true })
+      local value = { string.rep('abc',10000), 1, 2, 3 }
+      local chunks, sink = collector()
+      enc:encode_stream(value,sink,64)
+      local str = table.concat(chunks)
+      assert.are.same(string.sub(str,1,2),'\131\80')
+      assert.are.same(value,etf.decode(str))
+      assert.are.same(enc:encode(value),str)
+    end)
+
+    it('keeps compressed chunks to the chunk size', function()
+      local enc = etf.encoder({ compress = 1 })
+      local value = {}
+      for i=1,5000 do value[i] = { i, tostring(i * 7919) } end
+      -- grow the arena first, deflate shouldn't be handed all of it
+      enc:encode(value)
+      local chunks, sink = collector()
+      enc:encode_stream(value,sink,100)
+      assert.are.same(value,etf.decode(table.concat(chunks)))
+      for i=1,#chunks - 1 do
+        assert.are.same(100,#chunks[i])
+      end
+      assert.is_true(#chunks[#chunks] <= 100)
+    end)
+
+    it('accepts objects with a write method', function()
+      local enc = etf.encoder()
+      local file = { data = {} }
+      function file:write(chunk)
+        self.data[#self.data+1] = chunk
+        return self
+      end
+      enc:encode_stream('hello',file)
+      assert.are.same(enc:encode('hello'),table.concat(file.data))
+    end)
+
+    it('raises errors from write methods', function()
+      local enc = etf.encoder()
+      local file = {}
+      function file:write()
+        return nil, 'disk full'
+      end
+      assert.has_error(function()
+        enc:encode_stream('hello',file)
+      end)
+    end)
+
+    it('rejects invalid arguments', function()
+      local enc = etf.encoder()
+      assert.has_error(function()
+        enc:encode_stream('hello')
+      end)
+      assert.has_error(function()
+        enc:encode_stream('hello',{})
+      end)
+      assert.has_error(function()
+        enc:encode_stream('hello',function() end,0)
+      end)
+      assert.has_error(function()
+        enc:encode_stream('hello',function() end,1.5)
+      end)
+      assert.has_error(function()
+        enc:encode_stream('hello',function() end,1/0)
+      end)
+    end)
+
+    it('leaves the encoder usable after an error', function()
+      local enc = etf.encoder()
+      assert.has_error(function()
+        enc:encode_stream({ function() end },function() end)
+      end)
+      assert.are.same('\131\97\1',enc:encode(1))
+    end)
+  end)
+
+  describe('encode_to_fd', function()
+    local function readback(f)
+      f:seek('set')
+      local data = f:read('*a')
+      f:close()
+      return data
+    end
+
+    it('writes the encoded term to a file handle', function()
+      local enc = etf.encoder()
+      local value = { a = 1, b = { 1, 2, 3 }, c = 'hello' }
+      local f = io.tmpfile()
+      assert.are.same(#enc:encode(value),enc:encode_to_fd(f,value))
+      assert.are.same(enc:encode(value),readback(f))
+    end)
+
+    it('writes large binaries without copying them', function()
+      local enc = etf.encoder()
+      local big = string.rep('a',100000)
+      local value = { big, 'small', big .. 'b', 1 }
+      local f = io.tmpfile()
+      enc:encode_to_fd(f,value)
+      assert.are.same(enc:encode(value),readback(f))
+    end)
+
+    it('flushes data already buffered on the handle', function()
+      local enc = etf.encoder()
+      local f = io.tmpfile()
+      f:write('prefix')
+      enc:encode_to_fd(f,'hello')
+      assert.are.same('prefix' .. enc:encode('hello'),readback(f))
+    end)
+
+    it('writes compressed terms', function()
+      local enc = etf.encoder({ compress = true })
+      local value = string.rep('abc',100000)
+      local f = io.tmpfile()
+      enc:encode_to_fd(f,value)
+      assert.are.same(value,etf.decode(readback(f)))
+    end)
+
+    it('rejects closed files', function()
+      local enc = etf.encoder()
+      local f = io.tmpfile()
+      f:close()
+      assert.has_error(function()
+        enc:encode_to_fd(f,'hello')
+      end)
+    end)
+  end)
+
+  describe('encode_segments', function()
+    it('returns an array of strings', function()
+      local enc = etf.encoder()
+      local value = { a = 1, b = { 1, 2, 3 }, c = 'hello' }
+      local segs = enc:encode_segments(value)
+      assert.is_table(segs)
+      assert.are.same(enc:encode(value),table.concat(segs))
+    end)
+
+    it('references binaries over the threshold', function()
+      local enc = etf.encoder({ ref_threshold = 10 })
+      local big = string.rep('a',100)
+      local value = { 'small', big, 1, big }
+      local segs = enc:encode_segments(value)
+      assert.are.same(enc:encode(value),table.concat(segs))
+      local refs = 0
+      for _, seg in ipairs(segs) do
+        if seg == big then refs = refs + 1 end
+      end
+      assert.are.same(2,refs)
+    end)
+
+    it('does not reference binaries when compressing', function()
+      local enc = etf.encoder({ ref_threshold = 10, compress = true })
+      local big = string.rep('a',100)
+      local segs = enc:encode_segments(big)
+      assert.are.same(1,#segs)
+      assert.are.same(big,etf.decode(segs[1]))
+    end)
+
+    it('rejects invalid ref_threshold values', function()
+      assert.has_error(function()
+        etf.encoder({ ref_threshold = -1 })
+      end)
+      assert.has_error(function()
+        etf.encoder({ ref_threshold = 'hi there' })
+      end)
+      assert.has_error(function()
+        etf.encoder({ ref_threshold = 1.5 })
+      end)
+      assert.has_error(function()
+        etf.encoder({ ref_threshold = 1/0 })
+      end)
+      assert.has_error(function()
+        etf.encoder({ ref_threshold = 0/0 })
+      end)
+    end)
+  end)
+
+  describe('encode_many', function()
+    local values = { 1, 'hello', { a = 1 }, { 1, 2, 3 }, etf.atom('ok') }
+
+    it('returns an array of strings', function()
+      local enc = etf.encoder()
+      local res = enc:encode_many(values)
+      assert.are.same(#values,#res)
+      for i=1,#values do
+        assert.are.same(enc:encode(values[i]),res[i])
+      end
+    end)
+
+    it('returns one string plus offsets', function()
+      local enc = etf.encoder()
+      local str, offsets = enc:encode_many(values,true)
+      assert.are.same(#values + 1,#offsets)
+      assert.are.same(#str + 1,offsets[#offsets])
+      for i=1,#values do
+        assert.are.same(enc:encode(values[i]),string.sub(str,offsets[i],offsets[i+1]-1))
+      end
+    end)
+
+    it('works with compression', function()
+      local enc = etf.encoder({ compress = true })
+      local str, offsets = enc:encode_many(values,true)
+      for i=1,#values do
+        assert.are.same(etf.decode(enc:encode(values[i])),etf.decode(string.sub(str,offsets[i],offsets[i+1]-1)))
+      end
+    end)
+
+    it('handles empty arrays', function()
+      local enc = etf.encoder()
+      assert.are.same({},enc:encode_many({}))
+      local str, offsets = enc:encode_many({},true)
+      assert.are.same('',str)
+      assert.are.same({ 1 },offsets)
+    end)
+
+    it('requires a table', function()
+      local enc = etf.encoder()
+      assert.has_error(function()
+        enc:encode_many('hello')
+      end)
+    end)
+  end)
+
+  describe('default value_map', function()
+    local function value_map(val, is_key)
+      if is_key then return tostring(val) end
+      if type(val) == 'boolean' then return etf.atom(tostring(val)) end
+      return val
+    end
+
+    it('matches an equivalent Lua value_map', function()
+      local fast = etf.encoder()
+      local slow = etf.encoder({ value_map = value_map })
+      local values = {
+        true, false, 1, 1.5, 'str', { 1, 2, true },
+        { [1] = 'a', [3] = 'c' }, { [1.5] = 'x' }, { [true] = false },
+        { nested = { deeper = { true, false } } },
+      }
+      for i=1,#values do
+        assert.are.same(slow:encode(values[i]),fast:encode(values[i]))
+      end
+    end)
+  end)
+
+  describe('metatable dispatch', function()
+    it('encodes etf types by metatable', function()
+      local enc = etf.encoder()
+      local value = etf.tuple({
+        etf.list({ 1, 2 }), etf.map({ a = 1 }), etf.atom('ok'),
+        etf.string('str'), etf.binary('bin'), etf.integer(5), etf.float(1.5),
+      })
+      assert.are.same(etf.encode(value),enc:encode(value))
+      assert.are.same(enc:encode(value),enc:encode(value))
+    end)
+
+    it('treats other metatables as plain tables', function()
+      local enc = etf.encoder()
+      local value = setmetatable({ 1, 2, 3 }, { __index = {} })
+      assert.are.same(enc:encode({ 1, 2, 3 }),enc:encode(value))
+    end)
+
+    it('rejects unknown userdata', function()
+      local enc = etf.encoder()
+      assert.has_error(function()
+        enc:encode(io.stdout)
+      end,'Userdata value without corresponding encode function')
+    end)
+  end)
+
+  describe('register_shape', function()
+    local User = {}
+
+    local function user(t)
+      return setmetatable(t,User)
+    end
+
+    it('encodes the registered fields as a map', function()
+      local enc = etf.encoder()
+      enc:register_shape(User,{ 'id', 'name' })
+      local val = user({ id = 5, name = 'bob', extra = true })
+      assert.are.same({ id = 5, name = 'bob' },etf.decode(enc:encode(val)))
+      assert.are.same(etf.encode({ id = 5 }),enc:encode(user({ id = 5 })))
+    end)
+
+    it('leaves out nil fields', function()
+      local enc = etf.encoder()
+      enc:register_shape(User,{ 'id', 'name' })
+      assert.are.same(etf.encode({ name = 'bob' }),enc:encode(user({ name = 'bob' })))
+    end)
+
+    it('supports atom keys and typed values', function()
+      local enc = etf.encoder()
+      enc:register_shape(User,{
+        { 'status', key = 'atom', type = 'atom' },
+        { 'score', type = 'float' },
+        { 'level', type = 'integer' },
+        { 'tag', type = 'string' },
+      })
+      local bin = enc:encode(user({ status = 'online', score = 2, level = 3, tag = 'x' }))
+      local expected = etf.encode(etf.map({
+        [etf.atom('status')] = etf.atom('online'),
+        score = etf.float(2),
+        level = 3,
+        tag = etf.string('x'),
+      }))
+      assert.are.same(etf.decode(expected),etf.decode(bin))
+    end)
+
+    it('follows the keys_as_atoms rule', function()
+      local enc = etf.encoder({ rules = { keys_as_atoms = true } })
+      enc:register_shape(User,{ 'id' })
+      assert.are.same(enc:encode({ id = 1 }),enc:encode(user({ id = 1 })))
+    end)
+
+    it('encodes nested shapes', function()
+      local enc = etf.encoder()
+      enc:register_shape(User,{ 'id', 'friends' })
+      local val = user({ id = 1, friends = { user({ id = 2 }), user({ id = 3 }) } })
+      assert.are.same({ id = 1, friends = { { id = 2 }, { id = 3 } } },etf.decode(enc:encode(val)))
+    end)
+
+    it('rejects values of the wrong type', function()
+      local enc = etf.encoder()
+      enc:register_shape(User,{ { 'id', type = 'integer' } })
+      assert.has_error(function()
+        enc:encode(user({ id = 'one' }))
+      end)
+    end)
+
+    it('rejects etf metatables', function()
+      local enc = etf.encoder()
+      assert.has_error(function()
+        enc:register_shape(etf.tuple_mt,{ 'id' })
+      end)
+    end)
+
+    it('keeps the previous shape when a field is invalid', function()
+      local enc = etf.encoder()
+      enc:register_shape(User,{ 'id' })
+      assert.has_error(function()
+        enc:register_shape(User,{ 'id', { 'name', type = 'bogus' } })
+      end)
+      assert.has_error(function()
+        enc:register_shape(User,{ { 'id', key = 'bogus' } })
+      end)
+      assert.are.same(etf.encode({ id = 1 }),enc:encode(user({ id = 1, name = 'bob' })))
+    end)
+
+    it('replaces a shape registered again', function()
+      local enc = etf.encoder()
+      for _=1,3 do
+        enc:register_shape(User,{ 'id' })
+      end
+      enc:register_shape(User,{ 'name' })
+      assert.are.same(etf.encode({ name = 'bob' }),enc:encode(user({ id = 1, name = 'bob' })))
+    end)
+
+    it('allows replacing a shape while it is encoded', function()
+      local enc
+      enc = etf.encoder({ value_map = function(v)
+        if v == 'swap' then enc:register_shape(User,{ 'name' }) end
+        return v
+      end })
+      enc:register_shape(User,{ 'a', 'b', 'c' })
+      local val = user({ a = 'swap', b = 2, c = 3, name = 'bob' })
+      assert.are.same({ a = 'swap', b = 2, c = 3 },etf.decode(enc:encode(val)))
+      assert.are.same({ name = 'bob' },etf.decode(enc:encode(val)))
+    end)
+
+    it('does not affect other encoders', function()
+      local enc = etf.encoder()
+      enc:register_shape(User,{ 'id' })
+      local val = user({ id = 1, name = 'bob' })
+      assert.are.same({ id = 1, name = 'bob' },etf.decode(etf.encoder():encode(val)))
+    end)
+  end)
+
+  describe('key_cache', function()
+    local values = {
+      { id = 1, name = 'a', nested = { id = 2, name = 'b' } },
+      { id = 3, name = 'c', [1.5] = true },
+      etf.map({ id = 4, [etf.atom('ok')] = 1 }),
+    }
+
+    it('produces the same output as an uncached encoder', function()
+      local cached = etf.encoder()
+      local plain = etf.encoder({ key_cache = 0 })
+      for _=1,2 do
+        for i=1,#values do
+          assert.are.same(plain:encode(values[i]),cached:encode(values[i]))
+        end
+      end
+    end)
+
+    it('uses cached keys with other outputs', function()
+      local cached = etf.encoder({ compress = true })
+      local plain = etf.encoder({ compress = true, key_cache = 0 })
+      local zcached = etf.encoder()
+      zcached:encode(values[1])
+      assert.are.same(plain:encode(values[1]),cached:encode(values[1]))
+      assert.are.same(#zcached:encode(values[1]),zcached:size(values[1]))
+      local parts = {}
+      zcached:encode_stream(values[1],function(str) parts[#parts+1] = str end,4)
+      assert.are.same(zcached:encode(values[1]),table.concat(parts))
+    end)
+
+    it('follows the rules', function()
+      local cached = etf.encoder({ rules = { keys_as_atoms = true }, key_cache = 4 })
+      local plain = etf.encoder({ rules = { keys_as_atoms = true }, key_cache = 0 })
+      for i=1,#values do
+        assert.are.same(plain:encode(values[i]),cached:encode(values[i]))
+        assert.are.same(plain:encode(values[i]),cached:encode(values[i]))
+      end
+    end)
+
+    it('survives garbage collection of keys', function()
+      local cached = etf.encoder({ key_cache = 2 })
+      local plain = etf.encoder({ key_cache = 0 })
+      for i=1,200 do
+        local val = { ['key' .. i] = i, ['other' .. i % 3] = i }
+        assert.are.same(plain:encode(val),cached:encode(val))
+        if i % 50 == 0 then collectgarbage() end
+      end
+    end)
 
+    it('is off by default with a custom value_map', function()
+      local calls = 0
+      local enc = etf.encoder({ value_map = function(val, is_key)
+        if is_key then calls = calls + 1 end
+        return val
+      end })
+      enc:encode({ a = 1 })
+      enc:encode({ a = 1 })
+      assert.are.same(2,calls)
+    end)
+
+    it('can be enabled with a custom value_map', function()
+      local calls = 0
+      local enc = etf.encoder({ key_cache = 16, value_map = function(val, is_key)
+        if is_key then calls = calls + 1 end
+        return val
+      end })
+      enc:encode({ a = 1 })
+      enc:encode({ a = 1 })
+      assert.are.same(1,calls)
+    end)
+
+    it('rejects invalid values', function()
+      assert.has_error(function()
+        etf.encoder({ key_cache = -1 })
+      end)
+      assert.has_error(function()
+        etf.encoder({ key_cache = 'big' })
+      end)
+      assert.has_error(function()
+        etf.encoder({ key_cache = 1.5 })
+      end)
+      assert.has_error(function()
+        etf.encoder({ key_cache = 0/0 })
+      end)
+      assert.has_error(function()
+        etf.encoder({ key_cache = 65537 })
+      end)
+      assert.has_no_error(function()
+        etf.encoder({ key_cache = 65536 })
+      end)
+    end)
+  end)
+
+  describe('array_detection', function()
+    local function holes()
+      local t = { 'a', 'b', 'c' }
+      t[2] = nil
+      return t
+    end
+
+    it('defaults to strict', function()
+      local enc = etf.encoder()
+      assert.are.same(etf.encode(etf.list({ 'a', 'b' })),enc:encode({ 'a', 'b' }))
+      assert.are.same(etf.encode(etf.map({ [1] = 'a', [3] = 'c' })),enc:encode({ [1] = 'a', [3] = 'c' }))
+      assert.are.same(etf.encode(etf.map({ 'a', x = 1 })),enc:encode({ 'a', x = 1 }))
+      assert.are.same(etf.encode(etf.map(holes())),enc:encode(holes()))
+      assert.are.same(etf.encode(etf.list({})),enc:encode({}))
+    end)
 
+    it('detects sequences regardless of insertion order', function()
+      local enc = etf.encoder()
+      local t = {}
+      t[3] = 'c'
+      t[2] = 'b'
+      t[1] = 'a'
+      assert.are.same(etf.encode(etf.list({ 'a', 'b', 'c' })),enc:encode(t))
+    end)
+
+    it('rolls back a list that turns out to be a map', function()
+      local enc = etf.encoder()
+      local nested = { { 1, 2, { 'x' } }, { 3, 4 }, [2.5] = 'y' }
+      local t = {}
+      t[3] = 'c'
+      t.x = 1
+      t[2] = 'b'
+      t[1] = 'a'
+      t[0] = 'z'
+      local v = { nested, t, { 1, 2, 3, [-1] = true } }
+      local expected = {
+        { ['1'] = { 1, 2, { 'x' } }, ['2'] = { 3, 4 }, ['2.5'] = 'y' },
+        { ['0'] = 'z', ['1'] = 'a', ['2'] = 'b', ['3'] = 'c', x = 1 },
+        { ['1'] = 1, ['2'] = 2, ['3'] = 3, ['-1'] = true },
+      }
+      assert.are.same(expected,etf.decode(enc:encode(v)))
+      assert.are.same(expected,etf.decode(table.concat(enc:encode_segments(v))))
+      assert.are.same(#enc:encode(v),enc:size(v))
+    end)
+
+    it('can trust the length operator', function()
+      local enc = etf.encoder({ array_detection = 'rawlen' })
+      assert.are.same(etf.encode(etf.list({ 'a', 'b' })),enc:encode({ 'a', 'b', x = 1 }))
+      assert.are.same(etf.encode(etf.map({ x = 1 })),enc:encode({ x = 1 }))
+      assert.are.same(etf.encode(etf.list({})),enc:encode({}))
+    end)
+
+    it('can require etf.list for lists', function()
+      local enc = etf.encoder({ array_detection = 'metatable' })
+      assert.are.same(etf.encode(etf.map({ 'a', 'b' })),enc:encode({ 'a', 'b' }))
+      assert.are.same(etf.encode(etf.list({ 'a', 'b' })),enc:encode(etf.list({ 'a', 'b' })))
+      assert.are.same(etf.encode(etf.map({})),enc:encode({}))
+    end)
+
+    it('counts map pairs with non-contiguous output', function()
+      local enc = etf.encoder()
+      local val = { a = 1, b = { c = 2, d = 3 } }
+      local parts = {}
+      enc:encode_stream(val,function(str) parts[#parts+1] = str end,2)
+      assert.are.same(enc:encode(val),table.concat(parts))
+      assert.are.same(val,etf.decode(etf.encoder({ compress = true }):encode(val)))
+    end)
+
+    it('rejects invalid values', function()
+      assert.has_error(function()
+        etf.encoder({ array_detection = 'sometimes' })
+      end,'invalid array_detection value')
+    end)
+  end)
+
+  describe('memoize', function()
+    it('reuses the encoding of a memoized table', function()
+      local enc = etf.encoder()
+      local guild = { id = 1, name = 'guild' }
+      enc:memoize(guild)
+      local first = enc:encode({ guild = guild, n = 1 })
+      guild.name = 'changed'
+      assert.are.same(etf.encode({ guild = { id = 1, name = 'guild' } }),enc:encode({ guild = guild }))
+      assert.are.same({ guild = { id = 1, name = 'guild' }, n = 1 },etf.decode(first))
+    end)
+
+    it('re-encodes after invalidate', function()
+      local enc = etf.encoder()
+      local guild = { id = 1 }
+      enc:memoize(guild)
+      enc:encode(guild)
+      guild.id = 2
+      enc:invalidate(guild)
+      assert.are.same(etf.encode({ id = 2 }),enc:encode(guild))
+      guild.id = 3
+      enc:invalidate()
+      assert.are.same(etf.encode({ id = 3 }),enc:encode(guild))
+    end)
+
+    it('splices cached bytes into other outputs', function()
+      local enc = etf.encoder()
+      local guild = { id = 1, members = { 1, 2, 3 } }
+      enc:memoize(guild)
+      local bin = enc:encode({ guild })
+      assert.are.same(#bin,enc:size({ guild }))
+      assert.are.same(etf.decode(bin),etf.decode(table.concat(enc:encode_segments({ guild }))))
+      local zenc = etf.encoder({ compress = true })
+      zenc:memoize(guild)
+      zenc:encode(guild)
+      assert.are.same({ guild },etf.decode(zenc:encode({ guild })))
+    end)
+
+    it('does not splice cached bytes into distribution messages', function()
+      local enc = etf.encoder()
+      local t = { etf.atom('hello') }
+      enc:memoize(t)
+      enc:encode(t)
+      assert.are.same(etf.encoder():encode_dist(etf.atom_cache(),t),enc:encode_dist(etf.atom_cache(),t))
+    end)
+
+    it('does not keep tables alive', function()
+      local enc = etf.encoder()
+      local weak = setmetatable({},{ __mode = 'k' })
+      do
+        local t = { id = 1 }
+        weak[t] = true
+        enc:memoize(t)
+        enc:encode(t)
+      end
+      collectgarbage()
+      collectgarbage()
+      assert.is_nil(next(weak))
+    end)
+
+    it('ignores invalidate for unknown tables', function()
+      local enc = etf.encoder()
+      enc:invalidate({})
+      enc:invalidate()
+      assert.are.same(etf.encode({ a = 1 }),enc:encode({ a = 1 }))
+    end)
+  end)
+
+end)
@@ -67,6 +67,48 @@ describe('float', function()
     assert.are.same(b.float,-7.5)
   end)
 
+  it('supports modulo with negative values', function()
+    local c = etf.float(-7.5) % etf.float(3.0)
+    assert.are.same(c.float,1.5)
+    c = etf.float(7.5) % -3
+    assert.are.same(c.float,-1.5)
+  end)
+
+  it('supports mixing with numbers', function()
+    local c = etf.float(1.5) + 2
+    assert.are.same(etf.float_mt,debug.getmetatable(c))
+    assert.are.same(c.float,3.5)
+    c = 2 * etf.float(1.5)
+    assert.are.same(c.float,3.0)
+  end)
+
+  it('supports comparisons', function()
+    assert.is_true(etf.float(1.5) == etf.float('1.5'))
+    assert.is_false(etf.float(1.5) == etf.float(2.5))
+    assert.is_true(etf.float(1.5) < etf.float(2.5))
+    assert.is_true(etf.float(1.5) <= etf.float(1.5))
+    assert.is_false(etf.float(2.5) <= etf.float(1.5))
+  end)
+
+  it('is a userdata', function()
+    local f = etf.float(1.5)
+    assert.is_userdata(f)
+    assert.is_nil(f.other)
+  end)
+
+  it('encodes tables with the float metatable', function()
+    assert.are.same(etf.encode(etf.float(1.5)),etf.encode(setmetatable({ float = 1.5 },etf.float_mt)))
+  end)
+
+  it('accepts tables with the float metatable', function()
+    local f = setmetatable({ float = 1.5 },etf.float_mt)
+    assert.are.same(2.5,(f + 1).float)
+    assert.are.same(3,(f * etf.float(2)).float)
+    assert.are.same('1.5',tostring(f))
+    assert.are.same('1.5x',f .. 'x')
+    assert.is_nil(f.other)
+  end)
+
   it('supports tostring', function()
     local a = etf.float('7.5')
     assert.are.same(tostring(a),'7.5')
@@ -54,6 +54,24 @@ describe('integer', function()
     assert.are.same(tostring(b),'54321')
   end)
 
+  it('converts long strings', function()
+    local power = '1' .. string.rep('0',3000)
+    local digits = string.rep('1234567890',300)
+    assert.are.same(power,tostring(etf.integer(power)))
+    assert.are.same(digits,tostring(etf.integer(digits)))
+    assert.are.same('-' .. digits,tostring(etf.integer('-' .. digits)))
+    assert.are.same('255',tostring(etf.integer('0x' .. string.rep('0',500) .. 'ff')))
+    assert.are.same(digits,tostring(etf.integer(power) - etf.integer(power) + etf.integer(digits)))
+
+    -- 2^8000 - 1
+    local ones = etf.integer('0x' .. string.rep('f',2000))
+    assert.is_true(ones + 1 == etf.integer('0b1' .. string.rep('0',8000)))
+    assert.is_true(ones == etf.integer('03' .. string.rep('7',2666)))
+    assert.is_true(ones == etf.integer('0x' .. string.rep('F',2000)))
+    assert.is_true(ones == etf.integer(tostring(ones)))
+    assert.are.same(2409,#tostring(ones))
+  end)
+
   it('supports addition with numbers', function()
     local b = etf.integer()
     b = b + 1
@@ -114,6 +132,50 @@ describe('integer', function()
     assert.are.same(tostring(b),'-1')
   end)
 
+  it('promotes past 64 bits', function()
+    local max = etf.integer('9223372036854775807')
+    local min = etf.integer('-9223372036854775808')
+    assert.are.same(tostring(max + 1),'9223372036854775808')
+    assert.are.same(tostring(min - 1),'-9223372036854775809')
+    assert.are.same(tostring(max * 2),'18446744073709551614')
+    assert.are.same(tostring(max * max),'85070591730234615847396907784232501249')
+    assert.is_true(max < max + 1)
+    assert.is_true(min - 1 < min)
+  end)
+
+  it('supports values larger than 128 bits', function()
+    local big = etf.integer('340282366920938463463374607431768211456')
+    assert.are.same(tostring(big - 1),'340282366920938463463374607431768211455')
+    assert.are.same(tostring(big * big),
+      '115792089237316195423570985008687907853269984665640564039457584007913129639936')
+    assert.are.same(tostring((big * big) / big),tostring(big))
+    assert.is_true(big == etf.integer(tostring(big)))
+  end)
+
+  it('multiplies and divides values of several hundred words', function()
+    local function pow(b,e)
+      local r = etf.integer(1)
+      for _=1,e do r = r * b end
+      return r
+    end
+    -- 2^8192, squared up from 2
+    local x = etf.integer(2)
+    for _=1,13 do x = x * x end
+    local y = pow(3,2500)
+    local z = pow(7,900)
+
+    assert.is_true((x - 1) * (x + 1) == x * x - 1)
+    assert.is_true((x * x - 1) / (x - 1) == x + 1)
+    assert.are.same('6',tostring((x * x + 5) % (x + 1)))
+    assert.is_true(y * z == z * y)
+    assert.is_true((y * z) / z == y)
+    assert.is_true((y * z) / y == z)
+    assert.is_true((y * z + 12345) % z == etf.integer(12345))
+    assert.is_true(y * y / y == y)
+    assert.is_true(pow(3,5000) == y * y)
+    assert.are.same('0',tostring(z % z))
+  end)
+
   it('supports unary minus', function()
     local b = etf.integer(1)
     b = -b
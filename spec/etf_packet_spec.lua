@@ -0,0 +1,182 @@
+require('busted.runner')()
+
+local etf = require'etf'
+
+describe('packet framing', function()
+  describe('encoder', function()
+    it('writes a 1-byte header', function()
+      local enc = etf.encoder({ packet = 1 })
+      assert.are.same('\3\131\97\1',enc:encode(1))
+    end)
+
+    it('writes a 2-byte header', function()
+      local enc = etf.encoder({ packet = 2 })
+      assert.are.same('\0\3\131\97\1',enc:encode(1))
+    end)
+
+    it('writes a 4-byte header', function()
+      local enc = etf.encoder({ packet = 4 })
+      assert.are.same('\0\0\0\3\131\97\1',enc:encode(1))
+    end)
+
+    it('accepts packet = 0', function()
+      local enc = etf.encoder({ packet = 0 })
+      assert.are.same('\131\97\1',enc:encode(1))
+    end)
+
+    it('rejects invalid packet sizes', function()
+      assert.has_error(function()
+        etf.encoder({ packet = 3 })
+      end)
+      assert.has_error(function()
+        etf.encoder({ packet = 'hi there' })
+      end)
+    end)
+
+    it('errors when the term is too large for the header', function()
+      local enc = etf.encoder({ packet = 1 })
+      assert.has_error(function()
+        enc:encode(string.rep('a',300))
+      end)
+      assert.are.same('\3\131\97\1',enc:encode(1))
+    end)
+
+    it('frames compressed terms', function()
+      local enc = etf.encoder({ packet = 4, compress = true })
+      local value = string.rep('abc',1000)
+      local dec = etf.decoder({ packet = 4 })
+      assert.are.same(value,dec:decode(enc:encode(value)))
+    end)
+
+    it('includes the header in size', function()
+      local enc = etf.encoder({ packet = 2 })
+      assert.are.same(#enc:encode({ a = 1 }),enc:size({ a = 1 }))
+    end)
+
+    it('frames each value in encode_many', function()
+      local enc = etf.encoder({ packet = 2 })
+      local res = enc:encode_many({ 1, 2 })
+      assert.are.same({ '\0\3\131\97\1', '\0\3\131\97\2' },res)
+    end)
+
+    it('frames streamed terms', function()
+      local enc = etf.encoder({ packet = 4 })
+      local value = { string.rep('a',1000), 1 }
+      local chunks = {}
+      enc:encode_stream(value,function(c) chunks[#chunks+1] = c end,100)
+      assert.are.same(enc:encode(value),table.concat(chunks))
+    end)
+
+    it('counts referenced binaries in the header', function()
+      local enc = etf.encoder({ packet = 4, ref_threshold = 10 })
+      local value = { string.rep('a',100), 1 }
+      assert.are.same(enc:encode(value),table.concat(enc:encode_segments(value)))
+    end)
+  end)
+
+  describe('decoder', function()
+    it('reads framed terms', function()
+      assert.are.same(1,etf.decoder({ packet = 1 }):decode('\3\131\97\1'))
+      assert.are.same(1,etf.decoder({ packet = 2 }):decode('\0\3\131\97\1'))
+      assert.are.same(1,etf.decoder({ packet = 4 }):decode('\0\0\0\3\131\97\1'))
+    end)
+
+    it('rejects mismatched lengths', function()
+      local dec = etf.decoder({ packet = 2 })
+      assert.has_error(function()
+        dec:decode('\0\4\131\97\1')
+      end)
+      assert.has_error(function()
+        dec:decode('\0')
+      end)
+    end)
+
+    it('rejects invalid packet sizes', function()
+      assert.has_error(function()
+        etf.decoder({ packet = 3 })
+      end)
+      assert.has_error(function()
+        etf.decoder({ packet = 'hi there' })
+      end)
+    end)
+
+    describe('decode_packets', function()
+      local enc = etf.encoder({ packet = 4 })
+      local dec = etf.decoder({ packet = 4 })
+
+      it('decodes every complete packet in a string', function()
+        local data = enc:encode(1) .. enc:encode('a') .. enc:encode({ b = 2 })
+        local values, consumed = dec:decode_packets(data)
+        assert.are.same({ 1, 'a', { b = 2 } },values)
+        assert.are.same(#data,consumed)
+      end)
+
+      it('stops at a partial packet', function()
+        local first = enc:encode(1)
+        local second = enc:encode('hello')
+        local data = first .. string.sub(second,1,6)
+        local values, consumed = dec:decode_packets(data)
+        assert.are.same({ 1 },values)
+        assert.are.same(#first,consumed)
+      end)
+
+      it('consumes packets from a buffer', function()
+        local buf = etf.buffer()
+        local second = enc:encode('hello')
+        enc:encode_into(buf,1)
+        buf:append(string.sub(second,1,3))
+
+        local values = dec:decode_packets(buf)
+        assert.are.same({ 1 },values)
+        assert.are.same(string.sub(second,1,3),buf:tostring())
+
+        buf:append(string.sub(second,4))
+        values = dec:decode_packets(buf)
+        assert.are.same({ 'hello' },values)
+        assert.are.same(0,buf:len())
+      end)
+
+      it('drops a malformed packet from a buffer', function()
+        local buf = etf.buffer()
+        enc:encode_into(buf,1)
+        buf:append('\0\0\0\2\131\255')
+        enc:encode_into(buf,'hello')
+
+        local values = dec:decode_packets(buf)
+        assert.are.same({ 1 },values)
+        assert.has_error(function()
+          dec:decode_packets(buf)
+        end)
+        values = dec:decode_packets(buf)
+        assert.are.same({ 'hello' },values)
+        assert.are.same(0,buf:len())
+      end)
+
+      it('locks the buffer while decoding', function()
+        local buf = etf.buffer()
+        local errors = 0
+        local adec = etf.decoder({ packet = 4, atom_map = function(a)
+          if not pcall(buf.append,buf,'more') then errors = errors + 1 end
+          if not pcall(buf.clear,buf) then errors = errors + 1 end
+          if not pcall(enc.encode_into,enc,buf,1) then errors = errors + 1 end
+          return a
+        end })
+        enc:encode_into(buf,etf.atom('one'))
+        enc:encode_into(buf,etf.atom('three'))
+
+        local values = adec:decode_packets(buf)
+        assert.are.same({ 'one', 'three' },values)
+        assert.are.same(6,errors)
+        assert.are.same(0,buf:len())
+        buf:append('more')
+        assert.are.same(4,buf:len())
+      end)
+
+      it('requires a packet size', function()
+        assert.has_error(function()
+          etf.decoder():decode_packets('')
+        end)
+      end)
+    end)
+  end)
+end)
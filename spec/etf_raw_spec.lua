@@ -0,0 +1,99 @@
+require('busted.runner')()
+
+local etf = require'etf'
+
+local node = '\119\13' .. 'nonode@noname'
+local pid = '\103' .. node .. '\0\0\0\5\0\0\0\2\1'
+
+local terms = {
+  '\97\1',
+  '\98\0\0\1\0',
+  '\70\63\248\0\0\0\0\0\0',
+  '\100\0\2' .. 'ok',
+  '\115\2' .. 'ok',
+  '\118\0\2' .. 'ok',
+  '\119\2' .. 'ok',
+  '\107\0\5' .. 'hello',
+  '\109\0\0\0\5' .. 'hello',
+  '\77\0\0\0\1\3\255',
+  '\110\1\0\1',
+  '\111\0\0\0\1\1\1',
+  '\104\2\97\1\97\2',
+  '\105\0\0\0\1\106',
+  '\106',
+  '\108\0\0\0\2\97\1\97\2\106',
+  '\116\0\0\0\1\109\0\0\0\1' .. 'a' .. '\97\1',
+  pid,
+  '\88' .. node .. '\0\0\0\5\0\0\0\2\0\0\0\1',
+  '\102' .. node .. '\0\0\0\5\1',
+  '\89' .. node .. '\0\0\0\5\0\0\0\1',
+  '\120' .. node .. '\0\0\0\0\0\0\0\5\0\0\0\1',
+  '\101' .. node .. '\0\0\0\5\1',
+  '\114\0\1' .. node .. '\1\0\0\0\5',
+  '\90\0\1' .. node .. '\0\0\0\1\0\0\0\5',
+  '\113\119\3' .. 'mod' .. '\119\3' .. 'fun' .. '\97\1',
+  '\117\0\0\0\1' .. pid .. '\119\3' .. 'mod' .. '\97\10\97\11\97\5',
+  '\112\0\0\0\8\1' .. string.rep('\0',16) .. '\0\0\0\9\0\0\0\1' ..
+    '\119\3' .. 'mod' .. '\97\10\97\11' .. pid .. '\97\5',
+}
+
+describe('etf.raw', function()
+  it('is a function', function()
+    assert.is_function(etf.raw)
+  end)
+
+  it('accepts terms with or without the version byte', function()
+    for i=1,#terms do
+      local a = etf.raw(terms[i])
+      local b = etf.raw('\131' .. terms[i])
+      assert.is.userdata(a)
+      assert.are.same(etf.raw_mt,debug.getmetatable(a))
+      assert.are.same(#terms[i],#a)
+      assert.are.same('\131' .. terms[i],tostring(a))
+      assert.are.same(tostring(a),tostring(b))
+    end
+  end)
+
+  it('is encoded verbatim', function()
+    for i=1,#terms do
+      assert.are.same('\131' .. terms[i],etf.encode(etf.raw(terms[i])))
+    end
+  end)
+
+  it('can be embedded in other values', function()
+    local inner = etf.encode({ id = 1, tags = { 'a', 'b' } })
+    local bin = etf.encode(etf.tuple({ etf.atom('forward'), etf.raw(inner) }))
+    local val = etf.decode(bin)
+    assert.are.same({ id = 1, tags = { 'a', 'b' } },val[2])
+    local enc = etf.encoder({ compress = true })
+    assert.are.same(etf.decode(inner),etf.decode(enc:encode({ etf.raw(inner) }))[1])
+  end)
+
+  it('rejects invalid terms', function()
+    local bad = {
+      '',
+      '\131',
+      '\97',
+      '\97\1\1',
+      '\104\2\97\1',
+      '\108\0\0\0\1\97\1',
+      '\109\0\0\0\5' .. 'hell',
+      '\116\255\255\255\255',
+      '\103\97\1' .. '\0\0\0\5\0\0\0\2\1',
+      '\82\1',
+      '\80\0\0\0\1\120\156',
+      '\200',
+    }
+    for i=1,#bad do
+      assert.has_error(function()
+        etf.raw(bad[i])
+      end)
+    end
+  end)
+
+  it('requires a string', function()
+    assert.has_error(function()
+      etf.raw()
+    end)
+  end)
+end)
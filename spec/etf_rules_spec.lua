@@ -0,0 +1,118 @@
+require('busted.runner')()
+
+local etf = require'etf'
+
+describe('rules', function()
+  describe('encoder', function()
+    it('encodes keys as atoms', function()
+      local enc = etf.encoder({ rules = { keys_as_atoms = true } })
+      local expected = '\131\116\0\0\0\1\119\1a\97\1'
+      assert.are.same(expected,enc:encode({ a = 1 }))
+    end)
+
+    it('leaves values alone with keys_as_atoms', function()
+      local enc = etf.encoder({ rules = { keys_as_atoms = true } })
+      local expected = '\131\116\0\0\0\1\119\1a\109\0\0\0\1b'
+      assert.are.same(expected,enc:encode({ a = 'b' }))
+    end)
+
+    it('encodes listed strings as atoms', function()
+      local enc = etf.encoder({ rules = { atoms = { 'ok', 'error' } } })
+      assert.are.same(etf.encode(etf.atom('ok')),enc:encode('ok'))
+      assert.are.same(etf.encode(etf.atom('error')),enc:encode('error'))
+      assert.are.same(etf.encode('other'),enc:encode('other'))
+      assert.are.same(
+        etf.encode(etf.tuple({ etf.atom('ok'), 'value' })),
+        enc:encode(etf.tuple({ 'ok', 'value' })))
+    end)
+
+    it('matches the equivalent value_map', function()
+      local atoms = { ok = true, error = true }
+      local slow = etf.encoder({ value_map = function(v, is_key)
+        if is_key then v = tostring(v) end
+        if type(v) == 'string' and (is_key or atoms[v]) then return etf.atom(v) end
+        if type(v) == 'boolean' then return etf.atom(tostring(v)) end
+        return v
+      end })
+      local fast = etf.encoder({ rules = { keys_as_atoms = true, atoms = { 'ok', 'error' } } })
+      local value = { status = 'ok', items = { 'error', 'x', true, 1 }, [1.5] = 'ok' }
+      assert.are.same(slow:encode(value),fast:encode(value))
+    end)
+
+    it('rejects invalid rules', function()
+      assert.has_error(function()
+        etf.encoder({ rules = 'hi there' })
+      end)
+      assert.has_error(function()
+        etf.encoder({ rules = { atoms = 'ok' } })
+      end)
+      assert.has_error(function()
+        etf.encoder({ rules = { atoms = { 1 } } })
+      end)
+    end)
+  end)
+
+  describe('decoder', function()
+    local null = etf.null
+
+    it('decodes atoms to constants', function()
+      local dec = etf.decoder({ rules = { atoms = { undefined = null, yes = true, no = false, one = 1 } } })
+      local bin = etf.encode({ etf.atom('undefined'), etf.atom('yes'), etf.atom('no'), etf.atom('one'), etf.atom('other'), etf.atom('true') })
+      local val = dec:decode(bin)
+      assert.are.equal(null,val[1])
+      assert.are.same({ true, false, 1, 'other', true },{ val[2], val[3], val[4], val[5], val[6] })
+    end)
+
+    it('leaves map keys as strings', function()
+      local dec = etf.decoder({ rules = { atoms = { yes = true } } })
+      local bin = etf.encode(etf.map({ [etf.atom('yes')] = etf.atom('yes') }))
+      assert.are.same({ yes = true },dec:decode(bin))
+    end)
+
+    it('applies to compressed data', function()
+      local dec = etf.decoder({ rules = { atoms = { yes = true } } })
+      local bin = etf.encode({ etf.atom('yes'), etf.atom(string.rep('x',300)) },{ compress = true })
+      assert.are.same({ true, string.rep('x',300) },dec:decode(bin))
+    end)
+
+    it('works with a custom atom_map', function()
+      local dec = etf.decoder({
+        rules = { atoms = { yes = true } },
+        atom_map = function(a) return 'mapped:' .. a end,
+      })
+      local bin = etf.encode({ etf.atom('yes'), etf.atom('no') })
+      assert.are.same({ true, 'mapped:no' },dec:decode(bin))
+    end)
+
+    it('decodes integers above a limit as etf.integer', function()
+      local dec = etf.decoder({ rules = { integers_above = 100 } })
+      local val = dec:decode(etf.encode({ 1, 100, 101, -101, 100000 }))
+      assert.are.same(1,val[1])
+      assert.are.same(100,val[2])
+      for i=3,5 do
+        assert.are.same(etf.integer_mt,debug.getmetatable(val[i]))
+      end
+      assert.are.same(etf.integer(101),val[3])
+      assert.are.same(etf.integer(-101),val[4])
+      assert.are.same(etf.integer(100000),val[5])
+    end)
+
+    it('applies integers_above to big integers', function()
+      local dec = etf.decoder({ rules = { integers_above = 100 } })
+      local val = dec:decode('\131\110\1\0\200')
+      assert.are.same(etf.integer_mt,debug.getmetatable(val))
+    end)
+
+    it('rejects invalid rules', function()
+      assert.has_error(function()
+        etf.decoder({ rules = 'hi there' })
+      end)
+      assert.has_error(function()
+        etf.decoder({ rules = { integers_above = -1 } })
+      end)
+      assert.has_error(function()
+        etf.decoder({ rules = { atoms = { 'a' } } })
+      end)
+    end)
+  end)
+end)